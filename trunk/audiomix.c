@@ -0,0 +1,265 @@
+/*
+ * Downmix, gain and polyphase resampler for PSP audio
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "audiomix.h"
+
+#define MAX_IN_CHANNELS  6
+#define MAX_OUT_CHANNELS 2
+
+/* taps per phase, multiple of 4 for the SSE dot product */
+#define TAPS 32
+
+/* 44100 -> 24000 reduces to 80/147 */
+#define MAX_PHASES 256
+
+struct AudioMixContext {
+    int in_channels, out_channels;
+    float matrix[MAX_OUT_CHANNELS][MAX_IN_CHANNELS]; /* gain included */
+
+    /* resampler, up by L and down by M. coef is NULL for 1:1 */
+    int L, M;
+    float *coef;        /* TAPS reversed taps per phase */
+    float *hist[MAX_OUT_CHANNELS];
+    int hist_size;      /* allocated samples per channel */
+    int len;            /* valid samples in hist */
+    int idx;            /* hist index of the newest input of next output */
+    int phase;
+};
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static inline short clip16(float v)
+{
+    int i = lrintf(v);
+    if (i < -32768)
+        return -32768;
+    if (i > 32767)
+        return 32767;
+    return i;
+}
+
+static inline float dot(const float *x, const float *h)
+{
+#ifdef __SSE__
+    __m128 acc = _mm_setzero_ps();
+    int i;
+
+    for (i = 0; i < TAPS; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+#else
+    float sum = 0;
+    int i;
+
+    for (i = 0; i < TAPS; i++)
+        sum += x[i] * h[i];
+    return sum;
+#endif
+}
+
+/* windowed sinc lowpass at 0.9 of output nyquist, split in L phases */
+static int build_filter(AudioMixContext *c)
+{
+    int n = TAPS * c->L, i, p;
+    double center = (n - 1) / 2.0;
+    double fc = 0.45 / c->M;      /* cycles per sample of upsampled rate */
+
+    c->coef = malloc(n * sizeof(float));
+    if (!c->coef)
+        return -1;
+    for (p = 0; p < c->L; p++) {
+        float *h = c->coef + p * TAPS;
+        double sum = 0;
+        for (i = 0; i < TAPS; i++) {
+            int j = i * c->L + p;
+            double t = j - center;
+            double v = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+            /* blackman */
+            v *= 0.42 - 0.5 * cos(2 * M_PI * j / (n - 1)) + 0.08 * cos(4 * M_PI * j / (n - 1));
+            h[TAPS - 1 - i] = v;
+            sum += v;
+        }
+        /* unity gain in every phase */
+        for (i = 0; i < TAPS; i++)
+            h[i] /= sum;
+    }
+    return 0;
+}
+
+static void build_matrix(AudioMixContext *c, float gain)
+{
+    int o, i;
+
+    if (c->in_channels == c->out_channels) {
+        for (o = 0; o < c->out_channels; o++)
+            c->matrix[o][o] = 1;
+    } else if (c->in_channels == 1) {
+        c->matrix[0][0] = c->matrix[1][0] = 1;
+    } else if (c->in_channels == 2) {
+        c->matrix[0][0] = c->matrix[0][1] = 0.5;
+    } else {
+        /* FL FR FC LFE BL BR, LFE is dropped */
+        const float s = 1 / (1 + 2 * M_SQRT1_2);
+        c->matrix[0][0] = c->matrix[1][1] = s;
+        c->matrix[0][2] = c->matrix[1][2] = s * M_SQRT1_2;
+        c->matrix[0][4] = c->matrix[1][5] = s * M_SQRT1_2;
+        if (c->out_channels == 1) {
+            for (i = 0; i < MAX_IN_CHANNELS; i++)
+                c->matrix[0][i] = (c->matrix[0][i] + c->matrix[1][i]) / 2;
+        }
+    }
+    for (o = 0; o < c->out_channels; o++)
+        for (i = 0; i < c->in_channels; i++)
+            c->matrix[o][i] *= gain;
+}
+
+AudioMixContext *audio_mix_init(int out_channels, int in_channels,
+                                int out_rate, int in_rate, int volume)
+{
+    AudioMixContext *c;
+    int g;
+
+    if (out_channels < 1 || out_channels > MAX_OUT_CHANNELS ||
+        (in_channels != 1 && in_channels != 2 && in_channels != 6))
+        return NULL;
+    if (out_rate <= 0 || out_rate > in_rate || in_rate > 4 * out_rate)
+        return NULL;
+    g = gcd(out_rate, in_rate);
+    if (out_rate / g > MAX_PHASES)
+        return NULL;
+
+    c = calloc(1, sizeof(AudioMixContext));
+    if (!c)
+        return NULL;
+    c->in_channels = in_channels;
+    c->out_channels = out_channels;
+    c->L = out_rate / g;
+    c->M = in_rate / g;
+    build_matrix(c, volume / 256.0);
+
+    if (c->L != c->M) {
+        if (build_filter(c) < 0) {
+            audio_mix_free(c);
+            return NULL;
+        }
+        /* start with TAPS-1 samples of silence */
+        c->len = c->idx = TAPS - 1;
+    }
+    return c;
+}
+
+void audio_mix_free(AudioMixContext *c)
+{
+    int o;
+
+    if (!c)
+        return;
+    for (o = 0; o < MAX_OUT_CHANNELS; o++)
+        free(c->hist[o]);
+    free(c->coef);
+    free(c);
+}
+
+static int hist_grow(AudioMixContext *c, int size)
+{
+    int o;
+
+    if (size <= c->hist_size)
+        return 0;
+    for (o = 0; o < c->out_channels; o++) {
+        float *h = realloc(c->hist[o], size * sizeof(float));
+        if (!h)
+            return -1;
+        if (!c->hist[o])
+            memset(h, 0, c->len * sizeof(float));
+        c->hist[o] = h;
+    }
+    c->hist_size = size;
+    return 0;
+}
+
+int audio_mix(AudioMixContext *c, short *out, const short *in, int nb_samples)
+{
+    const int ic = c->in_channels, oc = c->out_channels;
+    int i, o, k, n, keep;
+
+    if (!c->coef) {
+        for (i = 0; i < nb_samples; i++, in += ic) {
+            for (o = 0; o < oc; o++) {
+                float v = 0;
+                for (k = 0; k < ic; k++)
+                    v += c->matrix[o][k] * in[k];
+                *out++ = clip16(v);
+            }
+        }
+        return nb_samples;
+    }
+
+    if (hist_grow(c, c->len + nb_samples) < 0)
+        return 0;
+
+    /* downmix and gain into per channel history */
+    for (o = 0; o < oc; o++) {
+        const float *m = c->matrix[o];
+        const short *s = in;
+        float *h = c->hist[o] + c->len;
+        for (i = 0; i < nb_samples; i++, s += ic) {
+            float v = 0;
+            for (k = 0; k < ic; k++)
+                v += m[k] * s[k];
+            h[i] = v;
+        }
+    }
+    c->len += nb_samples;
+
+    for (n = 0; c->idx < c->len; n++) {
+        const float *coef = c->coef + c->phase * TAPS;
+        for (o = 0; o < oc; o++)
+            *out++ = clip16(dot(c->hist[o] + c->idx - (TAPS - 1), coef));
+        c->phase += c->M;
+        c->idx += c->phase / c->L;
+        c->phase %= c->L;
+    }
+
+    /* keep TAPS-1 samples of history before next output */
+    keep = c->idx - (TAPS - 1);
+    if (keep > 0) {
+        for (o = 0; o < oc; o++)
+            memmove(c->hist[o], c->hist[o] + keep, (c->len - keep) * sizeof(float));
+        c->len -= keep;
+        c->idx -= keep;
+    }
+    return n;
+}
@@ -0,0 +1,47 @@
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+#ifndef AUDIOMIX_H_
+#define AUDIOMIX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Audio conversion for the PSP stream in one pass: downmix to mono or
+// stereo, gain, and rational ratio polyphase resampling (48000 and
+// 44100 to 24000). Filter dot products use SSE when the compiler has it.
+//
+typedef struct AudioMixContext AudioMixContext;
+
+//
+// volume is 256 based, like -vol. Returns 0 if channel layout or rates
+// are not supported, caller falls back to audio_resample
+//
+AudioMixContext *audio_mix_init(int out_channels, int in_channels,
+		int out_rate, int in_rate, int volume);
+void audio_mix_free(AudioMixContext *c);
+
+//
+// Converts nb_samples interleaved input frames, returns number of output
+// frames written. Output never has more frames than input.
+//
+int audio_mix(AudioMixContext *c, short *out, const short *in, int nb_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*AUDIOMIX_H_*/
@@ -16,26 +16,34 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+
+#include <QThread>
+#include <QMutex>
+#include <QFile>
+#include <QDataStream>
+#include <vector>
+#include <map>
 
 /*
  * FFMPEG have a "feature" - it can't parse headers of MP4
  * files properly. Actually, all "atom" parsing thing is
  * missing. So, even it can generate correct header with
  * title, it can't read it later.
- * That's why mpeg4ip (libmp4v2) is used.
+ * That's why title box is read by hand, see GetMP4Title.
  */
 #include <inttypes.h>
-
-// mp4 need this
-typedef uint8_t u_int8_t;
-typedef uint16_t u_int16_t;
-typedef uint32_t u_int32_t;
-typedef uint64_t u_int64_t;
-
-#include <mp4.h>
+#include <fcntl.h>
 
 #include "avutils.h"
 
+extern "C" {
+#include "swscale.h"
+}
+
 #include "ffmpeg_glue.h"
 
 bool CanDoPSP()
@@ -55,26 +63,287 @@ bool CanDoPSP()
 	return true;
 }
 
-CAVInfo::CAVInfo(const char *filename)
+int GetNumberOfCpus()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( n > 0 ) {
+		return (int)n;
+	}
+#endif
+	return 1;
+}
+
+//
+// Probe results by path, valid while size and mtime match. Kept in
+// memory and appended to a file, so inputs seen in earlier runs are
+// not opened again either.
+//
+#define PROBE_CACHE_MAGIC	0x50524231
+#define PROBE_CACHE_VERSION	1
+
+// error strings CAVInfo gives, cached by index
+static const char *probe_errors[] = {
+	"", "Unrecognized format", "No stream info", "No video stream", "No audio stream"
+};
+#define NB_PROBE_ERRORS (int)(sizeof(probe_errors) / sizeof(probe_errors[0]))
+
+struct CProbeEntry {
+	qint64 m_size, m_mtime;
+	bool m_have_vstream, m_have_astream, m_codec_ok;
+	qint32 m_error;
+	qint32 m_sec, m_usec, m_width, m_height;
+	float m_fps;
+	qint32 m_frame_count;
+	bool m_psp_video, m_psp_audio;
+	qint32 m_videoStream, m_audioStream;
+	QByteArray m_title;
+};
+
+static QDataStream &operator<<(QDataStream &s, const CProbeEntry &e)
+{
+	s << e.m_size << e.m_mtime << e.m_have_vstream << e.m_have_astream << e.m_codec_ok
+		<< e.m_error << e.m_sec << e.m_usec << e.m_width << e.m_height << e.m_fps
+		<< e.m_frame_count << e.m_psp_video << e.m_psp_audio
+		<< e.m_videoStream << e.m_audioStream << e.m_title;
+	return s;
+}
+
+static QDataStream &operator>>(QDataStream &s, CProbeEntry &e)
+{
+	s >> e.m_size >> e.m_mtime >> e.m_have_vstream >> e.m_have_astream >> e.m_codec_ok
+		>> e.m_error >> e.m_sec >> e.m_usec >> e.m_width >> e.m_height >> e.m_fps
+		>> e.m_frame_count >> e.m_psp_video >> e.m_psp_audio
+		>> e.m_videoStream >> e.m_audioStream >> e.m_title;
+	return s;
+}
+
+class CProbeCache {
+		QMutex m_lock;
+		std::map<QByteArray, CProbeEntry> m_entries;
+		QString m_file;
+
+		static bool Stat(const char *path, qint64 &size, qint64 &mtime);
+		void Append(const QByteArray &path, const CProbeEntry &e);
+		void Rewrite();
+	public:
+		void SetFile(const QString &file);
+		bool Find(const char *path, CAVInfo &info);
+		void Store(const char *path, const CAVInfo &info);
+};
+
+static CProbeCache probe_cache;
+
+void SetProbeCacheFile(const QString &file)
+{
+	probe_cache.SetFile(file);
+}
+
+bool CProbeCache::Stat(const char *path, qint64 &size, qint64 &mtime)
+{
+	struct stat st;
+	if ( stat(path, &st) != 0 || !S_ISREG(st.st_mode) ) {
+		return false;
+	}
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+void CProbeCache::SetFile(const QString &file)
+{
+	QMutexLocker locker(&m_lock);
+
+	m_file = file;
+	m_entries.clear();
+
+	QFile f(m_file);
+	if ( !f.open(QIODevice::ReadOnly) ) {
+		return;
+	}
+	QDataStream s(&f);
+	s.setVersion(QDataStream::Qt_4_0);
+	quint32 magic = 0, version = 0;
+	s >> magic >> version;
+	int records = 0;
+	if ( magic == PROBE_CACHE_MAGIC && version == PROBE_CACHE_VERSION ) {
+		while ( !s.atEnd() ) {
+			QByteArray path;
+			CProbeEntry e;
+			s >> path >> e;
+			if ( s.status() != QDataStream::Ok ) {
+				// torn write at the end
+				break;
+			}
+			// later records are newer
+			m_entries[path] = e;
+			records++;
+		}
+	}
+	f.close();
+
+	// entries of changed files pile up, or file is from other version
+	if ( records != (int)m_entries.size() || magic != PROBE_CACHE_MAGIC ||
+		version != PROBE_CACHE_VERSION ) {
+		Rewrite();
+	}
+}
+
+void CProbeCache::Rewrite()
+{
+	QFile f(m_file);
+	if ( !f.open(QIODevice::WriteOnly | QIODevice::Truncate) ) {
+		return;
+	}
+	QDataStream s(&f);
+	s.setVersion(QDataStream::Qt_4_0);
+	s << (quint32)PROBE_CACHE_MAGIC << (quint32)PROBE_CACHE_VERSION;
+	for(std::map<QByteArray, CProbeEntry>::iterator i = m_entries.begin(); i != m_entries.end(); i++) {
+		s << i->first << i->second;
+	}
+}
+
+void CProbeCache::Append(const QByteArray &path, const CProbeEntry &e)
+{
+	if ( m_file.isEmpty() ) {
+		return;
+	}
+	QFile f(m_file);
+	if ( !f.open(QIODevice::WriteOnly | QIODevice::Append) ) {
+		return;
+	}
+	QDataStream s(&f);
+	s.setVersion(QDataStream::Qt_4_0);
+	if ( !f.size() ) {
+		s << (quint32)PROBE_CACHE_MAGIC << (quint32)PROBE_CACHE_VERSION;
+	}
+	s << path << e;
+}
+
+bool CProbeCache::Find(const char *path, CAVInfo &info)
+{
+	qint64 size, mtime;
+	if ( !Stat(path, size, mtime) ) {
+		return false;
+	}
+
+	QMutexLocker locker(&m_lock);
+	std::map<QByteArray, CProbeEntry>::iterator i = m_entries.find(QByteArray(path));
+	if ( i == m_entries.end() ) {
+		return false;
+	}
+	const CProbeEntry &e = i->second;
+	if ( e.m_size != size || e.m_mtime != mtime ||
+		e.m_error < 0 || e.m_error >= NB_PROBE_ERRORS ) {
+		return false;
+	}
+	info.m_have_vstream = e.m_have_vstream;
+	info.m_have_astream = e.m_have_astream;
+	info.m_codec_ok = e.m_codec_ok;
+	info.m_stream_error = (char *)probe_errors[e.m_error];
+	info.m_sec = e.m_sec;
+	info.m_usec = e.m_usec;
+	info.m_width = e.m_width;
+	info.m_height = e.m_height;
+	info.m_fps = e.m_fps;
+	info.m_frame_count = e.m_frame_count;
+	info.m_psp_video = e.m_psp_video;
+	info.m_psp_audio = e.m_psp_audio;
+	info.m_videoStream = e.m_videoStream;
+	info.m_audioStream = e.m_audioStream;
+	strncpy(info.m_title, e.m_title.constData(), sizeof(info.m_title) - 1);
+	info.m_title[sizeof(info.m_title) - 1] = 0;
+	return true;
+}
+
+void CProbeCache::Store(const char *path, const CAVInfo &info)
+{
+	CProbeEntry e;
+	if ( !Stat(path, e.m_size, e.m_mtime) ) {
+		return;
+	}
+	e.m_error = 0;
+	for(int i = 0; i < NB_PROBE_ERRORS; i++) {
+		if ( !strcmp(info.m_stream_error, probe_errors[i]) ) {
+			e.m_error = i;
+			break;
+		}
+	}
+	e.m_have_vstream = info.m_have_vstream;
+	e.m_have_astream = info.m_have_astream;
+	e.m_codec_ok = info.m_codec_ok;
+	e.m_sec = info.m_sec;
+	e.m_usec = info.m_usec;
+	e.m_width = info.m_width;
+	e.m_height = info.m_height;
+	e.m_fps = info.m_fps;
+	e.m_frame_count = info.m_frame_count;
+	e.m_psp_video = info.m_psp_video;
+	e.m_psp_audio = info.m_psp_audio;
+	e.m_videoStream = info.m_videoStream;
+	e.m_audioStream = info.m_audioStream;
+	e.m_title = QByteArray(info.m_title);
+
+	QMutexLocker locker(&m_lock);
+	std::map<QByteArray, CProbeEntry>::iterator i = m_entries.find(QByteArray(path));
+	if ( i != m_entries.end() && i->second.m_size == e.m_size && i->second.m_mtime == e.m_mtime ) {
+		// same file probed again, nothing new
+		return;
+	}
+	m_entries[QByteArray(path)] = e;
+	Append(QByteArray(path), e);
+}
+
+CAVInfo::CAVInfo(const char *filename, int decode_w, int decode_h, bool probe_only)
 {
 	m_have_vstream = false;
 	m_have_astream = false;
 	m_codec_ok = false;
+	m_stream_error = (char *)probe_errors[0];
+	m_sec = m_usec = 0;
+	m_width = m_height = 0;
+	m_fps = 0;
+	m_frame_count = 0;
+	m_videoStream = m_audioStream = -1;
+	m_psp_video = m_psp_audio = false;
+	m_seek_target = AV_NOPTS_VALUE;
+	m_wait_key = false;
 	m_title[0] = 0;
 	m_img_data = 0;
+	m_img_width = m_img_height = 0;
+	m_sws = 0;
 	m_pFrameRGB = m_pFrame = 0;
 	m_fctx = 0;
+	m_st = 0;
+	m_acctx = 0;
+	m_codec = 0;
 	
 	if ( !filename ) {
 		return;
 	}
-			
+	if ( probe_only && probe_cache.Find(filename, *this) ) {
+		return;
+	}
+	Open(filename, decode_w, decode_h);
+	// failure may be temporary (file still being written, locked, out
+	// of memory): probe again next time instead of remembering it
+	if ( m_codec_ok ) {
+		probe_cache.Store(filename, *this);
+	}
+}
+
+void CAVInfo::Open(const char *filename, int decode_w, int decode_h)
+{
+	ffmpeg_lock();
 	if ( av_open_input_file(&m_fctx, filename, 0, 0, 0) != 0 ) {
+		ffmpeg_unlock();
 		printf("av_open_input_file - error\n");
 		m_stream_error = "Unrecognized format";
 		return;
 	}
-	if( av_find_stream_info(m_fctx) < 0) {
+	int info_res = av_find_stream_info(m_fctx);
+	ffmpeg_unlock();
+	if( info_res < 0) {
 		printf("av_find_stream_info - error\n");
 		m_stream_error = "No stream info";
 		return;
@@ -83,7 +352,7 @@ CAVInfo::CAVInfo(const char *filename)
  	m_sec = m_fctx->duration / AV_TIME_BASE;
     m_usec = m_fctx->duration % AV_TIME_BASE;
     m_width = m_height = 0;
-	m_videoStream = -1;
+	m_videoStream = m_audioStream = -1;
 	for(int i = 0; i < m_fctx->nb_streams; i++) {
 		if ( m_fctx->streams[i]->codec->codec_type == CODEC_TYPE_VIDEO) {
 			m_width = m_fctx->streams[i]->codec->width;
@@ -92,6 +361,7 @@ CAVInfo::CAVInfo(const char *filename)
 	        m_have_vstream = true;
  		}
 		if ( m_fctx->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO) {
+	        m_audioStream = i;
 	        m_have_astream = true;
 		}
 		if ( m_have_vstream && m_have_astream ) {
@@ -117,6 +387,7 @@ CAVInfo::CAVInfo(const char *filename)
 		m_fps = av_q2d(m_st->r_frame_rate);
 	}
 	printf("Stream with %f fps\n", m_fps);
+	CheckPSPStreams();
 	/*
 	if (st->r_frame_rate.den && st->r_frame_rate.num) {
 		m_fps = av_q2d(st->r_frame_rate);
@@ -126,9 +397,13 @@ CAVInfo::CAVInfo(const char *filename)
 	*/
 	// Find the decoder for the video stream
 	m_codec = avcodec_find_decoder(m_acctx->codec_id);
-	if(m_codec && (avcodec_open(m_acctx, m_codec) == 0)) {
-        m_codec_ok = true;
-	} else {
+	if ( m_codec ) {
+		ffmpeg_set_decode_scale(m_acctx, decode_w, decode_h);
+		ffmpeg_lock();
+		m_codec_ok = avcodec_open(m_acctx, m_codec) == 0;
+		ffmpeg_unlock();
+	}
+	if ( !m_codec_ok ) {
 		return;
 	}
 	m_frame_count = m_st->nb_frames ? m_st->nb_frames : int( (m_sec + 1) * m_fps);
@@ -136,13 +411,8 @@ CAVInfo::CAVInfo(const char *filename)
     // Allocate an AVFrame structure
 	m_pFrame = avcodec_alloc_frame();
 
-	int numBytes = avpicture_get_size(PIX_FMT_RGBA32, m_acctx->width, m_acctx->height);
-	m_img_data = new uint8_t[numBytes];
+	// image buffer is allocated for the size asked in GetNextFrame
     m_pFrameRGB = avcodec_alloc_frame();
-
-    // Assign appropriate parts of buffer to image planes in pFrameRGB
-    avpicture_fill((AVPicture *)m_pFrameRGB, m_img_data, PIX_FMT_RGBA32,
-		m_acctx->width, m_acctx->height);
 	
 	//
 	// If we have .mp4 file, attempt to read title
@@ -153,10 +423,34 @@ CAVInfo::CAVInfo(const char *filename)
 	}
 }
 
+//
+// Same limits the psp muxer and firmware have for the streams we would
+// produce: MPEG-4 SP 320x240 at most 30 fps, AAC stereo. Both need
+// global header, copied into esds
+//
+void CAVInfo::CheckPSPStreams()
+{
+	AVCodecContext *v = m_fctx->streams[m_videoStream]->codec;
+	m_psp_video = v->codec_id == CODEC_ID_MPEG4 &&
+		v->width == 320 && v->height == 240 &&
+		!v->has_b_frames && v->extradata_size &&
+		m_fps > 0 && m_fps < 30.5;
+
+	AVCodecContext *a = m_fctx->streams[m_audioStream]->codec;
+	m_psp_audio = a->codec_id == CODEC_ID_AAC &&
+		a->channels <= 2 && a->extradata_size &&
+		(a->sample_rate == 24000 || a->sample_rate == 44100 || a->sample_rate == 48000);
+}
+
 CAVInfo::~CAVInfo()
 {
 	if ( m_fctx ) {
+		ffmpeg_lock();
+		if ( m_codec_ok ) {
+			avcodec_close(m_acctx);
+		}
 		av_close_input_file(m_fctx);
+		ffmpeg_unlock();
 	}
 	if ( m_pFrameRGB ) {
 	    av_free(m_pFrameRGB);
@@ -168,35 +462,110 @@ CAVInfo::~CAVInfo()
     if ( m_img_data ) {
     	delete [] m_img_data;
     }
+    if ( m_sws ) {
+    	sws_freeContext(m_sws);
+    }
 }
 
-bool CAVInfo::Seek(int secs)
+bool CAVInfo::Seek(int secs, bool exact)
 {
-	int res = av_seek_frame(m_fctx, m_videoStream, (int)(secs * m_fps), 0);
-	return res == 0;
+	if ( !m_pFrame ) {
+		// probe only, or codec failed
+		return false;
+	}
+	AVStream *st = m_fctx->streams[m_videoStream];
+	int64_t target = av_rescale_q((int64_t)secs * AV_TIME_BASE, AV_TIME_BASE_Q, st->time_base);
+	if ( st->start_time != AV_NOPTS_VALUE ) {
+		target += st->start_time;
+	}
+
+	// container index (avi, mp4) or one filled by earlier reads. Without
+	// one, lavf searches by timestamp and we may land between keyframes
+	if ( av_seek_frame(m_fctx, m_videoStream, target, AVSEEK_FLAG_BACKWARD) < 0 ) {
+		return false;
+	}
+	avcodec_flush_buffers(m_acctx);
+	m_seek_target = exact ? target : AV_NOPTS_VALUE;
+	m_wait_key = true;
+	return true;
 }
 
-bool CAVInfo::GetNextFrame()
+bool CAVInfo::ConvertFrame(int w, int h)
+{
+	if ( w <= 0 || h <= 0 ) {
+		w = m_acctx->width;
+		h = m_acctx->height;
+	}
+	if ( !m_img_data || w != m_img_width || h != m_img_height ) {
+		delete [] m_img_data;
+		m_img_data = new uint8_t[avpicture_get_size(PIX_FMT_RGBA32, w, h)];
+		avpicture_fill((AVPicture *)m_pFrameRGB, m_img_data, PIX_FMT_RGBA32, w, h);
+		m_img_width = w;
+		m_img_height = h;
+		if ( m_sws ) {
+			sws_freeContext(m_sws);
+			m_sws = 0;
+		}
+	}
+	// decoder may change picture size on new sequence header
+	if ( m_sws && (m_sws_width != m_acctx->width || m_sws_height != m_acctx->height ||
+		m_sws_fmt != m_acctx->pix_fmt) ) {
+		sws_freeContext(m_sws);
+		m_sws = 0;
+	}
+	if ( !m_sws ) {
+		m_sws = sws_getContext(m_acctx->width, m_acctx->height, m_acctx->pix_fmt,
+			w, h, PIX_FMT_RGBA32, SWS_BILINEAR, NULL, NULL, NULL);
+		if ( !m_sws ) {
+			return false;
+		}
+		m_sws_width = m_acctx->width;
+		m_sws_height = m_acctx->height;
+		m_sws_fmt = m_acctx->pix_fmt;
+	}
+	sws_scale(m_sws, m_pFrame->data, m_pFrame->linesize, 0, m_acctx->height,
+		m_pFrameRGB->data, m_pFrameRGB->linesize);
+	return true;
+}
+
+bool CAVInfo::GetNextFrame(int w, int h)
 {
     AVPacket packet;
     int frameFinished;
+    if ( !m_pFrame ) {
+    	return false;
+    }
+    AVStream *st = m_fctx->streams[m_videoStream];
     
 	while( av_read_frame(m_fctx, &packet) >=0 ) {
 	    // Is this a packet from the video stream?
 	    if(packet.stream_index == m_videoStream) {
+	    	if ( packet.flags & PKT_FLAG_KEY ) {
+	    		if ( packet.dts != AV_NOPTS_VALUE ) {
+	    			av_add_index_entry(st, packet.pos, packet.dts, packet.size, 0, AVINDEX_KEYFRAME);
+	    		}
+	    		m_wait_key = false;
+	    	}
+	    	// decoding from the middle of gop gives garbage
+	    	if ( m_wait_key ) {
+	    		av_free_packet(&packet);
+	    		continue;
+	    	}
 	        // Decode video frame
 	        avcodec_decode_video(m_acctx, m_pFrame, &frameFinished, 
 	            packet.data, packet.size);
 	
-	        // Did we get a video frame?
+	        // Did we get a video frame? Before seek target it's only
+	        // needed as reference for the next ones
+	        if ( frameFinished && m_seek_target != AV_NOPTS_VALUE &&
+	        	packet.dts != AV_NOPTS_VALUE && packet.dts < m_seek_target ) {
+	        	frameFinished = 0;
+	        }
 	        if(frameFinished) {
-	            // Convert the image from its native format to RGB
-	            img_convert((AVPicture *)m_pFrameRGB, PIX_FMT_RGBA32, 
-	                (AVPicture*)m_pFrame, m_acctx->pix_fmt, m_acctx->width, 
-	                m_acctx->height);
-				return true;
-	            // Process the video frame (save to disk etc.)
-	            //DoSomethingWithTheImage(pFrameRGB);
+	        	m_seek_target = AV_NOPTS_VALUE;
+	            av_free_packet(&packet);
+	            // Convert from native format to RGB at requested size
+				return ConvertFrame(w, h);
 	        }
 	    }
 	
@@ -274,8 +643,18 @@ int MP4_moov_uuid_parse(uint8_t *uuid_data, uint32_t data_len, char *title)
 	data += sizeof(uint16_t);
 
 	//printf("title len = %04lx (%d) \n", title_len, title_len);
-	if ( title_len > (data_len - (data - uuid_data)) ) {
-		title_len = data_len - (data - uuid_data) - 1;
+	// length is in characters, 2 bytes each. Header reads may already
+	// be past the end of a short box (buffer is padded for that)
+	int avail = (int)data_len - (int)(data - uuid_data);
+	if ( avail < 0 ) {
+		avail = 0;
+	}
+	if ( title_len > avail / 2 ) {
+		title_len = avail / 2;
+	}
+	// callers have buffer of 512
+	if ( title_len > 511 ) {
+		title_len = 511;
 	}
 
 	for(uint16_t i = 0; i < title_len; i++) {
@@ -289,25 +668,99 @@ int MP4_moov_uuid_parse(uint8_t *uuid_data, uint32_t data_len, char *title)
 	return 1;
 }
 
+//
+// Title is in moov.uuid, which usually comes after mdat. Boxes are
+// walked by seeking from one header to the next, and only uuid payload
+// is read: few hundred bytes for movie of any size. MP4Read used before
+// loaded whole moov with all sample tables.
+//
+#define MP4_BOX_MOOV	0x6d6f6f76
+#define MP4_BOX_UUID	0x75756964
+
+// psp title box is ~140 bytes, anything much bigger is not it
+#define MP4_UUID_MAX_SIZE	4096
+
+// don't walk garbage forever
+#define MP4_MAX_BOXES		1024
+
+// parser reads fixed offsets before checking the length
+#define MP4_UUID_PAD		64
+
+static bool MP4ReadBoxHeader(int fd, int64_t pos, int64_t end,
+	uint32_t &type, int64_t &size, int &hdr_size)
+{
+	uint8_t hdr[16];
+	if ( end - pos < 8 || pread(fd, hdr, 8, pos) != 8 ) {
+		return false;
+	}
+	size = read_be32(hdr);
+	type = read_be32(hdr + 4);
+	hdr_size = 8;
+	if ( size == 1 ) {
+		// 64 bit size follows
+		if ( end - pos < 16 || pread(fd, hdr + 8, 8, pos + 8) != 8 ) {
+			return false;
+		}
+		size = ((int64_t)read_be32(hdr + 8) << 32) | read_be32(hdr + 12);
+		hdr_size = 16;
+	} else if ( size == 0 ) {
+		// up to end of file
+		size = end - pos;
+	}
+	return size >= hdr_size && size <= end - pos;
+}
+
+// offset of first box of that type in [pos, end), or -1
+static int64_t MP4FindBox(int fd, int64_t pos, int64_t end, uint32_t type,
+	int64_t &size, int &hdr_size)
+{
+	for(int i = 0; i < MP4_MAX_BOXES; i++) {
+		uint32_t t;
+		if ( !MP4ReadBoxHeader(fd, pos, end, t, size, hdr_size) ) {
+			return -1;
+		}
+		if ( t == type ) {
+			return pos;
+		}
+		pos += size;
+	}
+	return -1;
+}
+
 int GetMP4Title(const char *file, char *title_buf)
 {
-	MP4FileHandle mp4File = MP4Read(file, MP4_DETAILS_ERROR);
-	if ( !mp4File ) {
+	title_buf[0] = 0;
+	int fd = open(file, O_RDONLY);
+	if ( fd < 0 ) {
 		printf("ERROR: GetMP4Title cant open [%s]\n", file);
 		return 0;
 	}
-	uint32_t vsize;
-	uint8_t *value;
-	char *pname = "moov.uuid.data";
+	struct stat st;
+	if ( fstat(fd, &st) != 0 ) {
+		close(fd);
+		return 0;
+	}
 
-	MP4GetBytesProperty(mp4File, pname, &value, &vsize);
-	if ( vsize ) {
-		if ( !MP4_moov_uuid_parse(value, vsize, title_buf) ) {
+	uint32_t vsize = 0;
+	int64_t size;
+	int hdr_size;
+	int64_t moov = MP4FindBox(fd, 0, st.st_size, MP4_BOX_MOOV, size, hdr_size);
+	int64_t uuid = -1;
+	if ( moov >= 0 ) {
+		uuid = MP4FindBox(fd, moov + hdr_size, moov + size, MP4_BOX_UUID, size, hdr_size);
+	}
+	// payload after 16 byte extended type, same libmp4v2 gives as data
+	if ( uuid >= 0 && size - hdr_size > 16 && size - hdr_size - 16 <= MP4_UUID_MAX_SIZE ) {
+		vsize = size - hdr_size - 16;
+		uint8_t *value = new uint8_t[vsize + MP4_UUID_PAD];
+		memset(value + vsize, 0, MP4_UUID_PAD);
+		if ( pread(fd, value, vsize, uuid + hdr_size + 16) != (ssize_t)vsize ||
+			!MP4_moov_uuid_parse(value, vsize, title_buf) ) {
 			title_buf[0] = 0;
 		}
-		free(value);
+		delete [] value;
 	}
-	MP4Close(mp4File);
+	close(fd);
 	
 	return vsize;
 }
@@ -315,22 +768,6 @@ int GetMP4Title(const char *file, char *title_buf)
 
 void CAVInfo::ReadMP4(const char *file)
 {
-	/*
-	MP4FileHandle mp4File = MP4Read(file, MP4_DETAILS_ERROR);
-	if ( !mp4File ) {
-		return;
-	}
-	uint32_t vsize;
-	uint8_t *value;
-	char *pname = "moov.uuid.data";
-
-	MP4GetBytesProperty(mp4File, pname, &value, &vsize);
-	if ( vsize ) {
-		MP4_moov_uuid_parse(value, vsize, m_title);
-		free(value);
-	}
-	MP4Close(mp4File);
-	*/
 	GetMP4Title(file, m_title);
 }
 
@@ -356,19 +793,177 @@ bool CFFmpeg_Glue::IsValidVersion()
 	return true;
 }
 
+//
+// One time range of segment-parallel transcode, encoded into its own
+// temporary file
+//
+class CSegmentThread : public QThread {
+	public:
+		const char *m_infile;
+		char m_outfile[PATH_MAX];
+		int m_abitrate, m_vbitrate;
+		int m_v_size, m_h_size, m_v_pad, m_h_pad;
+		int m_threads;
+		bool m_async_write, m_lowres;
+		int64_t m_start, m_end;
+
+		// written by segment, polled by thread which started it
+		volatile int m_frames;
+		volatile bool *m_abort;
+
+		// result, valid once thread is finished
+		bool m_ok;
+
+		static int UpdateProgress(void *p, int frame)
+		{
+			CSegmentThread *This = (CSegmentThread *)p;
+			This->m_frames = frame;
+			return !*This->m_abort;
+		}
+	protected:
+		void run()
+		{
+			m_ok = false;
+			FFmpegJob *job = ffmpeg_job_alloc();
+			if ( !job ) {
+				return;
+			}
+			ffmpeg_job_set_range(job, m_start, m_end);
+			ffmpeg_job_set_async_output(job, m_async_write);
+			ffmpeg_job_set_lowres(job, m_lowres);
+			m_ok = ffmpeg_do_transcode(job, (char *)m_infile, m_outfile,
+				m_abitrate, m_vbitrate, m_v_size, m_h_size, m_v_pad, m_h_pad,
+				0, m_threads, UpdateProgress, this) != 0;
+			ffmpeg_job_free(job);
+		}
+};
+
+int CFFmpeg_Glue::RunSegments(
+			const char *infile, const char *outfile,
+			int abitrate, int vbitrate,
+			int v_size, int h_size,
+			int v_pad, int h_pad,
+			const char *title,
+			int threads, int segments, bool async_write, bool lowres,
+			int (*callback)(void *, int frame), void *uptr)
+{
+	std::vector<int64_t> points(segments);
+	int n = ffmpeg_find_split_points((char *)infile, &points[0], segments);
+	if ( n < 2 ) {
+		return -1;
+	}
+
+	volatile bool abort = false;
+	std::vector<CSegmentThread *> parts;
+	for(int i = 0; i < n; i++) {
+		CSegmentThread *part = new CSegmentThread;
+		part->m_infile = infile;
+		snprintf(part->m_outfile, sizeof(part->m_outfile), "%s.part%d", outfile, i);
+		part->m_abitrate = abitrate;
+		part->m_vbitrate = vbitrate;
+		part->m_v_size = v_size;
+		part->m_h_size = h_size;
+		part->m_v_pad = v_pad;
+		part->m_h_pad = h_pad;
+		part->m_threads = (threads / n) ? (threads / n) : 1;
+		part->m_async_write = async_write;
+		part->m_lowres = lowres;
+		part->m_start = points[i];
+		part->m_end = (i + 1 < n) ? points[i + 1] : 0;
+		part->m_frames = 0;
+		part->m_abort = &abort;
+		part->m_ok = false;
+		parts.push_back(part);
+		part->start();
+	}
+
+	// callback is not reentrant: report sum of all segments from here
+	bool failed = false;
+	for(;;) {
+		int frames = 0;
+		CSegmentThread *pending = 0;
+		for(int i = 0; i < n; i++) {
+			frames += parts[i]->m_frames;
+			if ( !parts[i]->isFinished() ) {
+				if ( !pending ) {
+					pending = parts[i];
+				}
+			} else if ( !parts[i]->m_ok && !failed ) {
+				// movie would have a gap: stop the other segments
+				failed = true;
+				abort = true;
+			}
+		}
+		if ( callback && !callback(uptr, frames) ) {
+			abort = true;
+		}
+		if ( !pending ) {
+			break;
+		}
+		pending->wait(250);
+	}
+
+	bool ok = !abort && !failed;
+	bool keep_parts = false;
+	if ( ok ) {
+		std::vector<char *> files;
+		for(int i = 0; i < n; i++) {
+			files.push_back(parts[i]->m_outfile);
+		}
+		ok = ffmpeg_do_concat(&files[0], n, &points[0], (char *)outfile, (char *)title,
+			async_write) != 0;
+		// encoded segments are the only good copy now
+		keep_parts = !ok;
+		if ( keep_parts ) {
+			printf("ERROR: join failed, segments kept as %s.partN\n", outfile);
+		}
+	}
+	for(int i = 0; i < n; i++) {
+		if ( !keep_parts ) {
+			unlink(parts[i]->m_outfile);
+		}
+		delete parts[i];
+	}
+	return ok ? 1 : 0;
+}
+
 bool CFFmpeg_Glue::RunTranscode(
 			const char *infile, const char *outfile,
 			int abitrate, int vbitrate,
 			int v_size, int h_size,
 			int v_pad, int h_pad,
 			const char *title,
+			int threads, int segments, bool async_write,
+			bool copy_video, bool copy_audio, bool lowres,
 			int (*callback)(void *, int frame), void *uptr)
 {
-	ffmpeg_do_transcode((char *)infile, (char *)outfile,
+	if ( threads <= 0 ) {
+		threads = GetNumberOfCpus();
+	}
+	// copied streams are cheap, and would need to be cut exactly
+	if ( segments > 1 && !copy_video && !copy_audio ) {
+		int res = RunSegments(infile, outfile, abitrate, vbitrate,
+			v_size, h_size, v_pad, h_pad, title, threads, segments, async_write,
+			lowres, callback, uptr);
+		if ( res >= 0 ) {
+			return res != 0;
+		}
+		// no keyframes to cut at: do it in one pass
+	}
+
+	FFmpegJob *job = ffmpeg_job_alloc();
+	if ( !job ) {
+		return false;
+	}
+	ffmpeg_job_set_async_output(job, async_write);
+	ffmpeg_job_set_stream_copy(job, copy_video, copy_audio);
+	ffmpeg_job_set_lowres(job, lowres);
+	bool ok = ffmpeg_do_transcode(job, (char *)infile, (char *)outfile,
 		abitrate, vbitrate, v_size, h_size, v_pad, h_pad,
-		(char *)title, callback, uptr);
+		(char *)title, threads, callback, uptr) != 0;
+	ffmpeg_job_free(job);
 		
-	return true;
+	return ok;
 }
 
 // generate thumbnail by ffmpeg call. Don't think it's needed
@@ -21,6 +21,15 @@
 
 int GetMP4Title(const char *file, char *title_buf);
 
+struct SwsContext;
+class QString;
+
+//
+// Where probe results are kept between runs. Loads the file, call once
+// before any CAVInfo is made.
+//
+void SetProbeCacheFile(const QString &file);
+
 class CAVInfo {
 		bool m_have_vstream, m_have_astream;
 		bool m_codec_ok;
@@ -30,32 +39,64 @@ class CAVInfo {
 		int m_width, m_height;
 		float m_fps;
 		int m_frame_count;
+
+		// streams PSP plays as they are, no need to re-encode
+		bool m_psp_video, m_psp_audio;
 		
 		AVFormatContext *m_fctx;
 		AVStream *m_st;
 		AVCodecContext *m_acctx;
 		AVCodec *m_codec;
-		int m_videoStream;
+		int m_videoStream, m_audioStream;
+
+		// set by Seek: skip to keyframe, then decode up to target
+		int64_t m_seek_target;
+		bool m_wait_key;
+
 		AVFrame *m_pFrame, *m_pFrameRGB;
 		unsigned char *m_img_data;
+		int m_img_width, m_img_height;
+
+		// yuv -> rgb and scale in one pass, made for current sizes
+		struct SwsContext *m_sws;
+		int m_sws_width, m_sws_height, m_sws_fmt;
+
+		bool ConvertFrame(int w, int h);
 		
 		// same size as in libavformat
 		char m_title[512];
 
-		// call to mpeg4ip to read title
+		// title from moov.uuid, see GetMP4Title
 		void ReadMP4(const char *file);
+
+		void CheckPSPStreams();
+
+		void Open(const char *file, int decode_w, int decode_h);
+
+		friend class CProbeCache;
 	public:
-		CAVInfo(const char *file);
+		//
+		// decode_w x decode_h is size images are shown at. Big input
+		// is decoded at 1/2 or 1/4 size then, 0 keeps full size.
+		// probe_only takes stream info from probe cache when file did
+		// not change since, without opening it. No frames then.
+		//
+		CAVInfo(const char *file, int decode_w = 0, int decode_h = 0,
+			bool probe_only = false);
 		CAVInfo()
 		{
 			/* for stl */ 
 			m_img_data = 0;
+			m_img_width = m_img_height = 0;
+			m_sws = 0;
 			m_fctx = 0;
 			m_st = 0;
 			m_acctx = 0;
 			m_codec = 0;
 			m_pFrame = 0;
 			m_pFrameRGB = 0;
+			m_seek_target = AV_NOPTS_VALUE;
+			m_wait_key = false;
 		}
 		~CAVInfo();
 		
@@ -72,10 +113,26 @@ class CAVInfo {
 		int H() { return m_height; }
 		
 		int FrameCount() { return m_frame_count; }
+
+		bool PSPVideo() { return m_psp_video; }
+		bool PSPAudio() { return m_psp_audio; }
 		
-		bool Seek(int secs);
-		bool GetNextFrame();
+		//
+		// Seek goes back to keyframe before the time, and next
+		// GetNextFrame decodes forward to it, or returns the keyframe
+		// itself if not exact. Keyframes seen while reading are added
+		// to stream index, so later seeks nearby land on them directly.
+		//
+		bool Seek(int secs, bool exact = true);
+		//
+		// Image is made at w x h straight from decoded picture,
+		// 0 keeps decoded size
+		//
+		bool GetNextFrame(int w = 0, int h = 0);
 		uint8_t *ImageData() { return (uint8_t *)m_img_data; }
+		// size of last image, may differ from W() x H()
+		int ImageW() { return m_img_width; }
+		int ImageH() { return m_img_height; }
 		
 		const char *Title() { return &m_title[0]; }
 };
@@ -83,6 +140,11 @@ class CAVInfo {
 
 bool CanDoPSP();
 
+//
+// Number of processors online, at least 1
+//
+int GetNumberOfCpus();
+
 /*
  * Instead of running ffmpeg in separate process and parse its
  * output, hoping for the best, I will take few files from ffmpeg
@@ -92,6 +154,15 @@ bool CanDoPSP();
  * be happy.
  */
 class CFFmpeg_Glue {
+		// -1 when input can't be split, 0 when a segment failed or was stopped
+		int RunSegments(
+			const char *infile, const char *outfile,
+			int abitrate, int vbitrate,
+			int v_size, int h_size,
+			int v_pad, int h_pad,
+			const char *title,
+			int threads, int segments, bool async_write, bool lowres,
+			int (*callback)(void *, int frame), void *uptr);
 	public:
 		CFFmpeg_Glue();
 		~CFFmpeg_Glue();
@@ -102,7 +173,13 @@ class CFFmpeg_Glue {
 		bool IsValidVersion();
 		
 		//
-		// Call to encoder loop
+		// Call to encoder loop. threads = 0 means one per cpu.
+		// segments > 1 cuts input into that many time ranges at
+		// keyframes, encodes them in parallel and joins the result.
+		// async_write moves file writes to a background thread.
+		// copy_video/copy_audio remux the stream without decoding,
+		// segments are not used then. lowres lets decoder produce
+		// smaller pictures for input twice the output size or more.
 		//
 //		bool RunTranscode(
 //			const char *infile, const char *outfile,
@@ -116,6 +193,8 @@ class CFFmpeg_Glue {
 			int v_size, int h_size,
 			int v_pad, int h_pad,
 			const char *title,
+			int threads, int segments, bool async_write,
+			bool copy_video, bool copy_audio, bool lowres,
 			int (*callback)(void *, int frame), void *uptr);
 
 		//
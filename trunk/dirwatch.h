@@ -0,0 +1,54 @@
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+#ifndef DIRWATCH_H_
+#define DIRWATCH_H_
+
+#include <QObject>
+#include <QString>
+
+class QSocketNotifier;
+
+//
+// Reports changes of files directly in one directory (inotify on
+// linux). Signals come from gui event loop.
+//
+class CDirWatch : public QObject {
+		Q_OBJECT
+		QString m_path;
+		int m_fd, m_wd;
+
+		// parent directory, to see m_path recreated under its name
+		QString m_parent, m_name;
+		int m_parent_wd;
+		QSocketNotifier *m_notifier;
+	private slots:
+		void readEvents();
+	public:
+		CDirWatch(const QString &path, QObject *parent = 0);
+		~CDirWatch();
+
+		// (re)starts watching, false if directory can't be watched
+		bool Watch();
+		bool IsActive() { return m_wd >= 0; }
+	signals:
+		// file was written and closed, moved in, removed or moved out
+		void fileChanged(const QString &name);
+
+		// directory itself was moved away or removed and not recreated,
+		// or events were dropped: watch is off, rescan needed
+		void dirLost();
+};
+
+#endif /*DIRWATCH_H_*/
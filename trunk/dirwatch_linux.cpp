@@ -0,0 +1,130 @@
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <QSocketNotifier>
+
+#include "dirwatch.h"
+
+// files that are complete, or gone
+#define FILE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define DIR_EVENTS (IN_DELETE_SELF | IN_MOVE_SELF)
+// directory appearing in parent
+#define PARENT_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+CDirWatch::CDirWatch(const QString &path, QObject *parent) : QObject(parent)
+{
+	m_path = path;
+	m_wd = -1;
+	m_parent = QFileInfo(path).path();
+	m_name = QFileInfo(path).fileName();
+	m_parent_wd = -1;
+	m_notifier = 0;
+	m_fd = inotify_init();
+	if ( m_fd < 0 ) {
+		printf("ERROR: inotify_init failed, directories are rescanned instead\n");
+		return;
+	}
+	fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+	m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+	connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readEvents()));
+}
+
+CDirWatch::~CDirWatch()
+{
+	if ( m_fd >= 0 ) {
+		// drops the watch too
+		close(m_fd);
+	}
+}
+
+bool CDirWatch::Watch()
+{
+	if ( m_fd < 0 ) {
+		return false;
+	}
+	if ( m_wd >= 0 ) {
+		inotify_rm_watch(m_fd, m_wd);
+	}
+	m_wd = inotify_add_watch(m_fd, QFile::encodeName(m_path), FILE_EVENTS | DIR_EVENTS | IN_ONLYDIR);
+	if ( m_parent_wd < 0 ) {
+		// without it, a recreated directory means a rescan
+		m_parent_wd = inotify_add_watch(m_fd, QFile::encodeName(m_parent), PARENT_EVENTS | IN_ONLYDIR);
+	}
+	return m_wd >= 0;
+}
+
+void CDirWatch::readEvents()
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	bool lost = false, overflow = false;
+
+	while ( (len = read(m_fd, buf, sizeof(buf))) > 0 ) {
+		for(char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+			// comes with wd -1: events were dropped
+			if ( ev->mask & IN_Q_OVERFLOW ) {
+				overflow = true;
+				continue;
+			}
+			if ( ev->wd == m_parent_wd ) {
+				if ( ev->mask & IN_IGNORED ) {
+					m_parent_wd = -1;
+				} else if ( m_wd < 0 && ev->len && (ev->mask & IN_ISDIR) &&
+					QFile::decodeName(ev->name).toLower() == m_name.toLower() && Watch() ) {
+					// directory was recreated (psp transfer renames it away
+					// and back). Files that came before the new watch are
+					// reported now, later ones as usual
+					QStringList files(QDir(m_path).entryList(QDir::Files));
+					for(QStringList::const_iterator it = files.begin(); it != files.end(); it++) {
+						emit fileChanged(*it);
+					}
+				}
+				continue;
+			}
+			// events of a watch removed by Watch()
+			if ( ev->wd != m_wd ) {
+				continue;
+			}
+			if ( ev->mask & (DIR_EVENTS | IN_IGNORED) ) {
+				// directory may be back under the same name later, but
+				// watch stays on the old inode
+				inotify_rm_watch(m_fd, m_wd);
+				m_wd = -1;
+				lost = true;
+			} else if ( (ev->mask & FILE_EVENTS) && ev->len ) {
+				emit fileChanged(QFile::decodeName(ev->name));
+			}
+		}
+	}
+	if ( overflow ) {
+		if ( m_wd >= 0 ) {
+			inotify_rm_watch(m_fd, m_wd);
+			m_wd = -1;
+		}
+		emit dirLost();
+	} else if ( lost && m_wd < 0 ) {
+		emit dirLost();
+	}
+}
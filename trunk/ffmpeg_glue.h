@@ -15,19 +15,107 @@
 #ifndef FFMPEG_GLUE_H_
 #define FFMPEG_GLUE_H_
 
+#include <inttypes.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//
+// All encoder state of one transcode. Opaque outside ffmpeg_patched.c, so
+// each job gets its own and jobs may run on different threads.
+//
+typedef struct FFmpegJob FFmpegJob;
+
+FFmpegJob *ffmpeg_job_alloc();
+void ffmpeg_job_free(FFmpegJob *job);
+
 int ffmpeg_main(int argc, char **argv, int(*cb)(void *, int), void *ptr);
-int ffmpeg_do_transcode(char *in_file, char *out_file, int avitrate, int vbitrate,
-		int size_v, int size_h, int pad_v, int pad_h, char *title,
+//
+// threads: codec threads for video decoder and encoder. Clamped to
+// 1..8, libavcodec needs to be configured with --enable-pthreads
+// for this to have any effect.
+//
+// Returns 0 when the job failed (bad input, codec or output file). Errors
+// end only this job, never the process.
+//
+int ffmpeg_do_transcode(FFmpegJob *job, char *in_file, char *out_file, int avitrate, int vbitrate,
+		int size_v, int size_h, int pad_v, int pad_h, char *title, int threads,
 		int(*cb)(void *, int), void *ptr);
 
+//
+// Limit job to part of the input, in AV_TIME_BASE units from start of
+// the movie. end_time = 0 means until the end. Call before
+// ffmpeg_do_transcode.
+//
+void ffmpeg_job_set_range(FFmpegJob *job, int64_t start_time, int64_t end_time);
+
+//
+// Write output from a separate I/O thread in large blocks, synced to
+// disk once at close. Meant for slow (network, USB) target storage.
+//
+void ffmpeg_job_set_async_output(FFmpegJob *job, int on);
+
+//
+// Copy video and/or audio packets into output as they are, instead of
+// re-encoding. Input streams must already be what psp format needs.
+//
+void ffmpeg_job_set_stream_copy(FFmpegJob *job, int video, int audio);
+
+//
+// How input files are read. Default is a read-ahead thread keeping
+// FFMPEG_PREFETCH_WINDOW bytes ahead of the demuxer, so a cold cache
+// does not stall the encoder. window <= 0 keeps the current size.
+//
+#define FFMPEG_PREFETCH_NONE	0
+#define FFMPEG_PREFETCH_THREAD	1
+#define FFMPEG_PREFETCH_MMAP	2
+
+#define FFMPEG_PREFETCH_WINDOW	(8 * 1024 * 1024)
+
+void ffmpeg_job_set_prefetch(FFmpegJob *job, int mode, int window);
+
+//
+// Decode video at reduced size when input is at least twice the frame
+// it is scaled to. On by default.
+//
+void ffmpeg_job_set_lowres(FFmpegJob *job, int on);
+
+//
+// Set up decoder to produce 1/2 or 1/4 size pictures (lowres) as long
+// as they are still at least dst_w x dst_h. Only for decoders having
+// lowres, h264 gets deblocking skipped instead. Changes width/height to
+// decoded size and returns lowres level. Call before avcodec_open.
+//
+struct AVCodecContext;
+int ffmpeg_set_decode_scale(struct AVCodecContext *enc, int dst_w, int dst_h);
+
+//
+// Split input into up to nb_points time ranges of about same length,
+// starting on video keyframes. points[0] is always 0. Returns number
+// of ranges found, 0 when input can't be opened.
+//
+int ffmpeg_find_split_points(char *in_file, int64_t *points, int nb_points);
+
+//
+// Join psp files produced from consecutive ranges into one movie.
+// start_times are the range starts passed to ffmpeg_job_set_range.
+//
+int ffmpeg_do_concat(char **in_files, int nb_in_files, int64_t *start_times,
+		char *out_file, char *title, int async_output);
+
 void ffmpeg_init();
 
 void ffmpeg_deinit();
 
+//
+// avcodec_open/avcodec_close are not thread safe. Anyone opening or
+// closing codecs (or input files, which do it internally) while a
+// transcode may be running must hold this lock.
+//
+void ffmpeg_lock();
+void ffmpeg_unlock();
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,6 +18,7 @@
  */
 #define HAVE_AV_CONFIG_H
 #include <limits.h>
+#include <errno.h>
 #include "avformat.h"
 #include "swscale.h"
 #include "framehook.h"
@@ -28,6 +29,8 @@
 #ifndef __MINGW32__
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <termios.h>
@@ -45,20 +48,18 @@
 #include "version.h"
 #include "cmdutils.h"
 
+#include "ffmpeg_glue.h"
+#include "yuvscale.h"
+#include "audiomix.h"
+
 #undef NDEBUG
 #include <assert.h>
+#include <pthread.h>
 
 #if !defined(INFINITY) && defined(HUGE_VAL)
 #define INFINITY HUGE_VAL
 #endif
 
-//
-// Binding to cpp glue. When callback returns 0, set termination signal. If
-// we want to pass signal to cpp - run callback with frame=-1
-//
-void *cpp_passed_ptr;
-int (*cpp_callback)(void *ptr, int frame) = 0;
-
 /* select an input stream for an output stream */
 typedef struct AVStreamMap {
     int file_index;
@@ -73,168 +74,221 @@ typedef struct AVMetaDataMap {
     int in_file;
 } AVMetaDataMap;
 
-extern const OptionDef options[];
-
-static void show_help(void);
-static void show_license(void);
-static int opt_default(const char *opt, const char *arg);
-
 #define MAX_FILES 20
 
-static AVFormatContext *input_files[MAX_FILES];
-static int64_t input_files_ts_offset[MAX_FILES];
-static int nb_input_files = 0;
-
-static AVFormatContext *output_files[MAX_FILES];
-static int nb_output_files = 0;
-
-static AVStreamMap stream_maps[MAX_FILES];
-static int nb_stream_maps;
-
-static AVMetaDataMap meta_data_maps[MAX_FILES];
-static int nb_meta_data_maps;
-
-static AVInputFormat *file_iformat;
-static AVOutputFormat *file_oformat;
-static AVImageFormat *image_format;
-static int frame_width  = 0;
-static int frame_height = 0;
-static float frame_aspect_ratio = 0;
-static enum PixelFormat frame_pix_fmt = PIX_FMT_NONE;
-static int frame_padtop  = 0;
-static int frame_padbottom = 0;
-static int frame_padleft  = 0;
-static int frame_padright = 0;
-static int padcolor[3] = {16,128,128}; /* default to black */
-static int frame_topBand  = 0;
-static int frame_bottomBand = 0;
-static int frame_leftBand  = 0;
-static int frame_rightBand = 0;
-static int max_frames[4] = {INT_MAX, INT_MAX, INT_MAX, INT_MAX};
-static int frame_rate = 25;
-static int frame_rate_base = 1;
-static int video_bit_rate = 200*1000;
-static float video_qscale = 0;
-static int video_qdiff = 3;
-static uint16_t *intra_matrix = NULL;
-static uint16_t *inter_matrix = NULL;
-#if 0 //experimental, (can be removed)
-static float video_rc_qsquish=1.0;
-static float video_rc_qmod_amp=0;
-static int video_rc_qmod_freq=0;
-#endif
-static char *video_rc_override_string=NULL;
-static char *video_rc_eq="tex^qComp";
-static int me_method = ME_EPZS;
-static int video_disable = 0;
-static int video_discard = 0;
-static int video_codec_id = CODEC_ID_NONE;
-static int video_codec_tag = 0;
-static int same_quality = 0;
-static int do_deinterlace = 0;
-static int packet_size = 0;
-static int strict = 0;
-static int top_field_first = -1;
-static int me_threshold = 0;
-static int intra_dc_precision = 8;
-static int loop_input = 0;
-static int loop_output = AVFMT_NOOUTPUTLOOP;
-static int qp_hist = 0;
-
-static int intra_only = 0;
-static int audio_sample_rate = 44100;
-static int audio_bit_rate = 64000;
+/* recycled buffer, see job_buffer_get() */
+typedef struct JobBuffer {
+    uint8_t *data;
+    unsigned int size;
+} JobBuffer;
+
 #define QSCALE_NONE -99999
-static float audio_qscale = QSCALE_NONE;
-static int audio_disable = 0;
-static int audio_channels = 1;
-static int audio_codec_id = CODEC_ID_NONE;
-static int audio_codec_tag = 0;
-static char *audio_language = NULL;
-
-static int subtitle_codec_id = CODEC_ID_NONE;
-static char *subtitle_language = NULL;
-
-static float mux_preload= 0.5;
-static float mux_max_delay= 0.7;
-
-static int64_t recording_time = 0;
-static int64_t start_time = 0;
-static int64_t rec_timestamp = 0;
-static int64_t input_ts_offset = 0;
-static int file_overwrite = 0;
-static char *str_title = NULL;
-static char *str_author = NULL;
-static char *str_copyright = NULL;
-static char *str_comment = NULL;
-static char *str_album = NULL;
-static int do_benchmark = 0;
-static int do_hex_dump = 0;
-static int do_pkt_dump = 0;
-static int do_psnr = 0;
-static int do_vstats = 0;
-static int do_pass = 0;
-static char *pass_logfilename = NULL;
-static int audio_stream_copy = 0;
-static int video_stream_copy = 0;
-static int subtitle_stream_copy = 0;
-static int video_sync_method= 1;
-static int audio_sync_method= 0;
-static int copy_ts= 0;
-static int opt_shortest = 0; //
-static int video_global_header = 0;
-
-static int rate_emu = 0;
-
-#ifdef CONFIG_BKTR
-static const char *video_grab_format = "bktr";
-#else
-#ifdef CONFIG_VIDEO4LINUX2
-static const char *video_grab_format = "video4linux2";
-#else
-static const char *video_grab_format = "video4linux";
-#endif
-#endif
-static char *video_device = NULL;
-static char *grab_device = NULL;
-static int  video_channel = 0;
-static char *video_standard = "ntsc";
-
-static const char *audio_grab_format = "audio_device";
-static char *audio_device = NULL;
-static int audio_volume = 256;
-
-static int using_stdin = 0;
-static int using_vhook = 0;
-static int verbose = 1;
-static int thread_count= 1;
-static int q_pressed = 0;
-static int64_t video_size = 0;
-static int64_t audio_size = 0;
-static int64_t extra_size = 0;
-static int nb_frames_dup = 0;
-static int nb_frames_drop = 0;
-static int input_sync;
-static int limit_filesize = 0; //
-
-static int pgmyuv_compatibility_hack=0;
-static int dts_delta_threshold = 10;
-
-static int sws_flags = SWS_BICUBIC;
-
-const char **opt_names=NULL;
-int opt_name_count=0;
-AVCodecContext *avctx_opts;
-AVFormatContext *avformat_opts;
-
-static AVBitStreamFilterContext *video_bitstream_filters=NULL;
-static AVBitStreamFilterContext *audio_bitstream_filters=NULL;
-static AVBitStreamFilterContext *bitstream_filters[MAX_FILES][MAX_STREAMS];
+
+/* libavcodec limit for slice threads in mpegvideo encoders */
+#define FFMPEG_MAX_THREADS 8
+
+/*
+ * Everything ffmpeg.c keeps in file-level statics lives here instead: option
+ * values, opened files, encoder buffers and the glue callback. One of these is
+ * created per transcode, so several jobs can run on different threads in one
+ * process.
+ */
+struct FFmpegJob {
+    //
+    // Binding to cpp glue. When callback returns 0, set termination signal. If
+    // we want to pass signal to cpp - run callback with frame=-1
+    //
+    void *cpp_passed_ptr;
+    int (*cpp_callback)(void *ptr, int frame);
+    volatile int received_sigterm;
+    /* first error, negative errno. Set instead of exit(), ends the job */
+    volatile int error;
+
+    AVFormatContext *input_files[MAX_FILES];
+    int64_t input_files_ts_offset[MAX_FILES];
+    int nb_input_files;
+
+    AVFormatContext *output_files[MAX_FILES];
+    int nb_output_files;
+
+    AVStreamMap stream_maps[MAX_FILES];
+    int nb_stream_maps;
+
+    AVMetaDataMap meta_data_maps[MAX_FILES];
+    int nb_meta_data_maps;
+
+    AVInputFormat *file_iformat;
+    AVOutputFormat *file_oformat;
+    AVImageFormat *image_format;
+    int frame_width;
+    int frame_height;
+    float frame_aspect_ratio;
+    enum PixelFormat frame_pix_fmt;
+    int frame_padtop;
+    int frame_padbottom;
+    int frame_padleft;
+    int frame_padright;
+    int padcolor[3];
+    int frame_topBand;
+    int frame_bottomBand;
+    int frame_leftBand;
+    int frame_rightBand;
+    int max_frames[4];
+    int frame_rate;
+    int frame_rate_base;
+    int video_bit_rate;
+    float video_qscale;
+    int video_qdiff;
+    uint16_t *intra_matrix;
+    uint16_t *inter_matrix;
+    char *video_rc_override_string;
+    char *video_rc_eq;
+    int me_method;
+    int video_disable;
+    int video_discard;
+    int video_codec_id;
+    int video_codec_tag;
+    int same_quality;
+    int do_deinterlace;
+    int packet_size;
+    int strict;
+    int top_field_first;
+    int me_threshold;
+    int intra_dc_precision;
+    int loop_input;
+    int loop_output;
+    int qp_hist;
+
+    int intra_only;
+    int audio_sample_rate;
+    int audio_bit_rate;
+    float audio_qscale;
+    int audio_disable;
+    int audio_channels;
+    int audio_codec_id;
+    int audio_codec_tag;
+    char *audio_language;
+
+    int subtitle_codec_id;
+    char *subtitle_language;
+
+    float mux_preload;
+    float mux_max_delay;
+
+    int64_t recording_time;
+    int64_t start_time;
+    int cut_at_start;        /* drop decoded data from before the input seek point */
+    int async_output;        /* write output files through async: protocol */
+    int input_prefetch;      /* FFMPEG_PREFETCH_xxx for input files */
+    int prefetch_window;     /* bytes kept ahead of the demuxer */
+    int decode_lowres;       /* reduced size decoding for big inputs */
+    int lowres_width;        /* smallest picture decoder may produce */
+    int lowres_height;
+    int64_t rec_timestamp;
+    int64_t input_ts_offset;
+    int file_overwrite;
+    char *str_title;
+    char *str_author;
+    char *str_copyright;
+    char *str_comment;
+    char *str_album;
+    int do_benchmark;
+    int do_hex_dump;
+    int do_pkt_dump;
+    int do_psnr;
+    int do_vstats;
+    int do_pass;
+    char *pass_logfilename;
+    int audio_stream_copy;
+    int video_stream_copy;
+    int subtitle_stream_copy;
+    int video_sync_method;
+    int audio_sync_method;
+    int copy_ts;
+    int opt_shortest;
+    int video_global_header;
+
+    int rate_emu;
+
+    int audio_volume;
+
+    int using_stdin;
+    int using_vhook;
+    int verbose;
+    int thread_count;
+    int64_t video_size;
+    int64_t audio_size;
+    int64_t extra_size;
+    int64_t picture_write_size; /* bytes written into output pictures */
+    int nb_frames_dup;
+    int nb_frames_drop;
+    int input_sync;
+    int limit_filesize;
+
+    int pgmyuv_compatibility_hack;
+    int dts_delta_threshold;
+
+    int sws_flags;
+
+    const char **opt_names;
+    int opt_name_count;
+    AVCodecContext *avctx_opts;
+    AVFormatContext *avformat_opts;
+
+    AVBitStreamFilterContext *video_bitstream_filters;
+    AVBitStreamFilterContext *audio_bitstream_filters;
+    AVBitStreamFilterContext *bitstream_filters[MAX_FILES][MAX_STREAMS];
+
+    /* encoder scratch buffers, used to be function statics */
+    int bit_buffer_size;
+    uint8_t *bit_buffer;
+    uint8_t *audio_out;
+    JobBuffer samples;
+    JobBuffer deinterlace_buf;
+    uint8_t *subtitle_out;
+    FILE *fvstats;
+
+    /* job_buffer_get() calls and how many of them had to allocate */
+    int buffer_requests;
+    int buffer_allocs;
+
+    /* encoder/muxer side of av_encode, see mux_thread() */
+    struct MuxQueue *mux_queue;
+};
+
+static int opt_default(FFmpegJob *job, const char *opt, const char *arg);
+
+/* other jobs in the process go on, this one stops at the next check */
+static void job_fail(FFmpegJob *job, int err)
+{
+    if (!job->error)
+        job->error = err;
+}
+
+/*
+ * libavcodec keeps global state in avcodec_open/avcodec_close and complains
+ * about "insufficient thread locking" when two threads get there at once.
+ * Every codec open/close - including the ones av_find_stream_info and
+ * av_close_input_file do internally - goes through this lock.
+ */
+static pthread_mutex_t codec_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define DEFAULT_PASS_LOGFILENAME "ffmpeg2pass"
 
 struct AVInputStream;
 
+/*
+ * Raw audio waiting for the encoder. Converted samples are written in
+ * place at wpos and whole encoder frames are read in place at rpos, so
+ * the encoder always sees a contiguous frame. Instead of wrapping, the
+ * partial frame left at the end is moved to the start of the buffer.
+ */
+typedef struct AudioRing {
+    uint8_t *buf;
+    int size;
+    int rpos, wpos;
+} AudioRing;
+
 typedef struct AVOutputStream {
     int file_index;          /* file index */
     int index;               /* stream index in the output file */
@@ -247,10 +301,11 @@ typedef struct AVOutputStream {
     //double sync_ipts;        /* dts from the AVPacket of the demuxer in second units */
     struct AVInputStream *sync_ist; /* input stream to sync against */
     int64_t sync_opts;       /* output frame counter, could be changed to some true timestamp */ //FIXME look at frame_number
+    int64_t queued_dts;      /* last dts handed to the muxer, in st->time_base */
     /* video only */
     int video_resample;
-    AVFrame pict_tmp;      /* temporary image for resampling */
     struct SwsContext *img_resample_ctx; /* for image resampling */
+    YuvScaleContext *fast_resample_ctx;  /* used instead of swscale when set */
     int resample_height;
 
     int video_crop;
@@ -266,8 +321,10 @@ typedef struct AVOutputStream {
     /* audio only */
     int audio_resample;
     ReSampleContext *resample; /* for audio resampling */
-    AVFifoBuffer fifo;     /* for compression: one audio fifo per codec */
+    AudioMixContext *audio_mix; /* used instead of resample when set, applies audio_volume */
+    AudioRing fifo;        /* for compression: one audio fifo per codec */
     FILE *logfile;
+    int opened;              /* encoder is open */
 } AVOutputStream;
 
 typedef struct AVInputStream {
@@ -284,6 +341,8 @@ typedef struct AVInputStream {
                                 is not defined */
     int64_t       pts;       /* current pts */
     int is_start;            /* is 1 at the start and after a discontinuity */
+    int scalar_volume;       /* an output without audio_mix needs audio_volume applied */
+    int opened;              /* decoder is open */
 } AVInputStream;
 
 typedef struct AVInputFile {
@@ -295,58 +354,55 @@ typedef struct AVInputFile {
     int nb_streams;       /* nb streams we are aware of */
 } AVInputFile;
 
-#ifndef __MINGW32__
-
-/* init terminal so that we can grab keys */
-static struct termios oldtty;
-
-static void term_exit(void)
-{
-}
-
-static volatile sig_atomic_t received_sigterm = 0;
-
-static void
-sigterm_handler(int sig)
-{
-    received_sigterm = sig;
-    term_exit();
-}
-
-static void term_init(void)
-{
-}
-
-/* read a key without blocking */
-static int read_key(void)
-{
-    return -1;
-}
+/*
+ * av_encode is split in two stages: demuxing, decoding and scaling run on the
+ * calling thread, video encoding and all muxing on mux_thread(). They are
+ * connected by a bounded single producer/single consumer ring. The producer
+ * blocks when the ring is full, so the decoder never runs more than
+ * MUX_QUEUE_SIZE frames ahead of the encoder.
+ * Demuxer stays with the decoder: parsers write into the same codec context
+ * the decoder uses.
+ */
+#define MUX_QUEUE_SIZE 8
 
-static int decode_interrupt_cb(void)
-{
-    return q_pressed || (q_pressed = read_key() == 'q');
-}
+enum MuxItemType {
+    MUX_ITEM_VIDEO,     /* scaled picture, to be encoded nb_frames times */
+    MUX_ITEM_PACKET,    /* ready packet, owned by the queue */
+    MUX_ITEM_FLUSH,     /* drain delayed frames out of video encoder */
+    MUX_ITEM_EOF,
+};
 
-#else
+typedef struct MuxItem {
+    enum MuxItemType type;
+    AVOutputStream *ost;
+    AVInputStream *ist;
 
-static volatile int received_sigterm = 0;
+    /* copy of unowned packet data, belongs to the slot */
+    JobBuffer pkt_buf;
 
-/* no interactive support */
-static void term_exit(void)
-{
-}
+    /* video: picture buffer belongs to the slot and is reused */
+    AVFrame picture;
+    int pict_width, pict_height, pict_fmt;
+    AVOutputStream *pict_pad_ost; /* stream whose bars are painted in picture */
+    int nb_frames;
+    int64_t sync_opts;       /* pts of first frame */
+    int frame_number;        /* ost->frame_number after this item */
 
-static void term_init(void)
-{
-}
+    AVPacket pkt;
+} MuxItem;
 
-static int read_key(void)
-{
-    return 0;
-}
+typedef struct MuxQueue {
+    MuxItem items[MUX_QUEUE_SIZE];
+    int rindex, windex, count;
+    int64_t out_size;        /* size of first output file, for limit_filesize */
 
-#endif
+    /* 0: no encoder thread, items are processed as soon as they are put */
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} MuxQueue;
 
 static int read_ffserver_streams(AVFormatContext *s, const char *filename)
 {
@@ -374,10 +430,33 @@ static int read_ffserver_streams(AVFormatContext *s, const char *filename)
 }
 
 static double
-get_sync_ipts(const AVOutputStream *ost)
+get_sync_ipts(FFmpegJob *job, const AVOutputStream *ost)
 {
     const AVInputStream *ist = ost->sync_ist;
-    return (double)(ist->pts + input_files_ts_offset[ist->file_index] - start_time)/AV_TIME_BASE;
+    return (double)(ist->pts + job->input_files_ts_offset[ist->file_index] - job->start_time)/AV_TIME_BASE;
+}
+
+/*
+ * Per job buffers are kept for the whole transcode and only grow, so in
+ * steady state no frame or packet goes to the allocator. Producer side
+ * only, counters are not locked.
+ */
+static void *job_buffer_get(FFmpegJob *job, JobBuffer *b, unsigned int size)
+{
+    job->buffer_requests++;
+    if (size > b->size) {
+        job->buffer_allocs++;
+        av_free(b->data);
+        b->data = av_malloc(size);
+        b->size = b->data ? size : 0;
+    }
+    return b->data;
+}
+
+static void job_buffer_free(JobBuffer *b)
+{
+    av_freep(&b->data);
+    b->size = 0;
 }
 
 static void write_frame(AVFormatContext *s, AVPacket *pkt, AVCodecContext *avctx, AVBitStreamFilterContext *bsfc){
@@ -399,32 +478,188 @@ static void write_frame(AVFormatContext *s, AVPacket *pkt, AVCodecContext *avctx
     av_interleaved_write_frame(s, pkt);
 }
 
+static void mux_item_process(FFmpegJob *job, MuxItem *item);
+
+/* get free slot at the write position, waiting for the encoder if needed */
+static MuxItem *mux_queue_get(FFmpegJob *job)
+{
+    MuxQueue *q = job->mux_queue;
+
+    if (q->threaded) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == MUX_QUEUE_SIZE)
+            pthread_cond_wait(&q->not_full, &q->lock);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return &q->items[q->windex];
+}
+
+/* hand slot returned by mux_queue_get over to the encoder */
+static void mux_queue_put(FFmpegJob *job)
+{
+    MuxQueue *q = job->mux_queue;
+
+    if (!q->threaded) {
+        mux_item_process(job, &q->items[q->windex]);
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    q->windex = (q->windex + 1) % MUX_QUEUE_SIZE;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* queue takes ownership of pkt, data of unowned packets is copied
+   into the slot */
+static void mux_queue_packet(FFmpegJob *job, AVOutputStream *ost, AVPacket *pkt)
+{
+    MuxItem *item = mux_queue_get(job);
+
+    if (pkt->dts != AV_NOPTS_VALUE)
+        ost->queued_dts = pkt->dts;
+    else if (pkt->pts != AV_NOPTS_VALUE)
+        ost->queued_dts = pkt->pts;
+
+    item->type = MUX_ITEM_PACKET;
+    item->ost = ost;
+    item->pkt = *pkt;
+    if (job->mux_queue->threaded && pkt->destruct != av_destruct_packet) {
+        uint8_t *data = job_buffer_get(job, &item->pkt_buf, pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (data) {
+            memcpy(data, pkt->data, pkt->size);
+            memset(data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+            item->pkt.data = data;
+            item->pkt.destruct = NULL;
+        } else {
+            av_dup_packet(&item->pkt);
+        }
+    }
+    mux_queue_put(job);
+}
+
+static void mux_queue_simple(FFmpegJob *job, AVOutputStream *ost, enum MuxItemType type)
+{
+    MuxItem *item = mux_queue_get(job);
+
+    item->type = type;
+    item->ost = ost;
+    mux_queue_put(job);
+}
+
+static int mux_item_alloc_picture(FFmpegJob *job, MuxItem *item, AVCodecContext *enc)
+{
+    job->buffer_requests++;
+    if (item->picture.data[0] &&
+        item->pict_width == enc->width && item->pict_height == enc->height &&
+        item->pict_fmt == enc->pix_fmt)
+        return 0;
+
+    job->buffer_allocs++;
+    av_free(item->picture.data[0]);
+    avcodec_get_frame_defaults(&item->picture);
+    if (avpicture_alloc((AVPicture *)&item->picture, enc->pix_fmt, enc->width, enc->height) < 0)
+        return -1;
+    item->pict_width = enc->width;
+    item->pict_height = enc->height;
+    item->pict_fmt = enc->pix_fmt;
+    item->pict_pad_ost = NULL;
+    return 0;
+}
+
+/* paint padding bars of slot picture. Frames only write the active
+   region, so bars stay valid until the picture is reallocated */
+static void mux_item_fill_pad(FFmpegJob *job, MuxItem *item, AVOutputStream *ost)
+{
+    AVCodecContext *enc = ost->st->codec;
+
+    if (item->pict_pad_ost == ost)
+        return;
+    img_pad((AVPicture *)&item->picture, NULL,
+            enc->height, enc->width, enc->pix_fmt,
+            ost->padtop, ost->padbottom, ost->padleft, ost->padright, job->padcolor);
+    job->picture_write_size += avpicture_get_size(enc->pix_fmt, enc->width, enc->height) -
+        avpicture_get_size(enc->pix_fmt,
+                           enc->width - (ost->padleft + ost->padright),
+                           enc->height - (ost->padtop + ost->padbottom));
+    item->pict_pad_ost = ost;
+}
+
 #define MAX_AUDIO_PACKET_SIZE (128 * 1024)
 
-static void do_audio_out(AVFormatContext *s,
+static int audio_ring_init(AudioRing *r, int size)
+{
+    r->buf = av_malloc(size);
+    r->size = size;
+    r->rpos = r->wpos = 0;
+    return r->buf ? 0 : -1;
+}
+
+static void audio_ring_free(AudioRing *r)
+{
+    av_freep(&r->buf);
+}
+
+static int audio_ring_size(AudioRing *r)
+{
+    return r->wpos - r->rpos;
+}
+
+/* room for len bytes at the write position, NULL if it does not fit */
+static uint8_t *audio_ring_reserve(AudioRing *r, int len)
+{
+    if (r->wpos + len > r->size && r->rpos) {
+        memmove(r->buf, r->buf + r->rpos, r->wpos - r->rpos);
+        r->wpos -= r->rpos;
+        r->rpos = 0;
+    }
+    if (r->wpos + len > r->size)
+        return NULL;
+    return r->buf + r->wpos;
+}
+
+static void audio_ring_commit(AudioRing *r, int len)
+{
+    r->wpos += len;
+}
+
+/* len contiguous bytes at the read position, NULL if not there yet */
+static uint8_t *audio_ring_peek(AudioRing *r, int len)
+{
+    if (r->wpos - r->rpos < len)
+        return NULL;
+    return r->buf + r->rpos;
+}
+
+static void audio_ring_consume(AudioRing *r, int len)
+{
+    r->rpos += len;
+    if (r->rpos == r->wpos)
+        r->rpos = r->wpos = 0;
+}
+
+static void do_audio_out(FFmpegJob *job,
+                         AVFormatContext *s,
                          AVOutputStream *ost,
                          AVInputStream *ist,
                          unsigned char *buf, int size)
 {
-    uint8_t *buftmp;
-    static uint8_t *audio_buf = NULL;
-    static uint8_t *audio_out = NULL;
+    uint8_t *buftmp, *frame;
     const int audio_out_size= 4*MAX_AUDIO_PACKET_SIZE;
 
-    int size_out, frame_bytes, ret;
+    int size_out, max_out, frame_bytes, ret;
     AVCodecContext *enc= ost->st->codec;
+    AVCodecContext *dec= ist->st->codec;
 
     /* SC: dynamic allocation of buffers */
-    if (!audio_buf)
-        audio_buf = av_malloc(2*MAX_AUDIO_PACKET_SIZE);
-    if (!audio_out)
-        audio_out = av_malloc(audio_out_size);
-    if (!audio_buf || !audio_out)
+    if (!job->audio_out)
+        job->audio_out = av_malloc(audio_out_size);
+    if (!job->audio_out)
         return;               /* Should signal an error ! */
 
-    if(audio_sync_method){
-        double delta = get_sync_ipts(ost) * enc->sample_rate - ost->sync_opts
-                - av_fifo_size(&ost->fifo)/(ost->st->codec->channels * 2);
+    if(job->audio_sync_method){
+        double delta = get_sync_ipts(job, ost) * enc->sample_rate - ost->sync_opts
+                - audio_ring_size(&ost->fifo)/(ost->st->codec->channels * 2);
         double idelta= delta*ist->st->codec->sample_rate / enc->sample_rate;
         int byte_delta= ((int)idelta)*2*ist->st->codec->channels;
 
@@ -435,72 +670,85 @@ static void do_audio_out(AVFormatContext *s,
                     byte_delta= FFMAX(byte_delta, -size);
                     size += byte_delta;
                     buf  -= byte_delta;
-                    if(verbose > 2)
+                    if(job->verbose > 2)
                         fprintf(stderr, "discarding %d audio samples\n", (int)-delta);
                     if(!size)
                         return;
                     ist->is_start=0;
                 }else{
-                    static uint8_t *input_tmp= NULL;
-                    input_tmp= av_realloc(input_tmp, byte_delta + size);
+                    /* silence goes straight into the fifo, already
+                       in output format */
+                    int silence= ((int)delta)*2*enc->channels;
 
-                    if(byte_delta + size <= MAX_AUDIO_PACKET_SIZE)
+                    if(silence <= MAX_AUDIO_PACKET_SIZE)
                         ist->is_start=0;
                     else
-                        byte_delta= MAX_AUDIO_PACKET_SIZE - size;
+                        silence= MAX_AUDIO_PACKET_SIZE;
 
-                    memset(input_tmp, 0, byte_delta);
-                    memcpy(input_tmp + byte_delta, buf, size);
-                    buf= input_tmp;
-                    size += byte_delta;
-                    if(verbose > 2)
+                    buftmp= audio_ring_reserve(&ost->fifo, silence);
+                    if(!buftmp)
+                        return;
+                    memset(buftmp, 0, silence);
+                    audio_ring_commit(&ost->fifo, silence);
+                    if(job->verbose > 2)
                         fprintf(stderr, "adding %d audio samples of silence\n", (int)delta);
                 }
-            }else if(audio_sync_method>1){
-                int comp= clip(delta, -audio_sync_method, audio_sync_method);
+            }else if(job->audio_sync_method>1){
+                int comp= clip(delta, -job->audio_sync_method, job->audio_sync_method);
                 assert(ost->audio_resample);
-                if(verbose > 2)
+                if(job->verbose > 2)
                     fprintf(stderr, "compensating audio timestamp drift:%f compensation:%d in:%d\n", delta, comp, enc->sample_rate);
-//                fprintf(stderr, "drift:%f len:%d opts:%lld ipts:%lld fifo:%d\n", delta, -1, ost->sync_opts, (int64_t)(get_sync_ipts(ost) * enc->sample_rate), av_fifo_size(&ost->fifo)/(ost->st->codec->channels * 2));
+//                fprintf(stderr, "drift:%f len:%d opts:%lld ipts:%lld fifo:%d\n", delta, -1, ost->sync_opts, (int64_t)(get_sync_ipts(job, ost) * enc->sample_rate), audio_ring_size(&ost->fifo)/(ost->st->codec->channels * 2));
                 av_resample_compensate(*(struct AVResampleContext**)ost->resample, comp, enc->sample_rate);
             }
         }
     }else
-        ost->sync_opts= lrintf(get_sync_ipts(ost) * enc->sample_rate)
-                        - av_fifo_size(&ost->fifo)/(ost->st->codec->channels * 2); //FIXME wrong
-
-    if (ost->audio_resample) {
-        buftmp = audio_buf;
+        ost->sync_opts= lrintf(get_sync_ipts(job, ost) * enc->sample_rate)
+                        - audio_ring_size(&ost->fifo)/(ost->st->codec->channels * 2); //FIXME wrong
+
+    /* converted samples are written straight into the fifo. Bound is
+       for the resampler, which may return a few extra samples */
+    max_out = (int)((int64_t)(size / (dec->channels * 2) + 16) * enc->sample_rate / dec->sample_rate + 16)
+              * enc->channels * 2;
+    buftmp = audio_ring_reserve(&ost->fifo, ost->audio_resample || ost->audio_mix ? max_out : size);
+    if (!buftmp) {
+        fprintf(stderr, "Audio fifo overflow\n");
+        return;
+    }
+    if (ost->audio_mix) {
+        size_out = audio_mix(ost->audio_mix,
+                             (short *)buftmp, (short *)buf,
+                             size / (dec->channels * 2));
+        size_out = size_out * enc->channels * 2;
+    } else if (ost->audio_resample) {
         size_out = audio_resample(ost->resample,
                                   (short *)buftmp, (short *)buf,
-                                  size / (ist->st->codec->channels * 2));
+                                  size / (dec->channels * 2));
         size_out = size_out * enc->channels * 2;
     } else {
-        buftmp = buf;
+        memcpy(buftmp, buf, size);
         size_out = size;
     }
+    audio_ring_commit(&ost->fifo, size_out);
 
     /* now encode as many frames as possible */
     if (enc->frame_size > 1) {
-        /* output resampled raw samples */
-        av_fifo_write(&ost->fifo, buftmp, size_out);
-
         frame_bytes = enc->frame_size * 2 * enc->channels;
 
-        while (av_fifo_read(&ost->fifo, audio_buf, frame_bytes) == 0) {
+        while ((frame = audio_ring_peek(&ost->fifo, frame_bytes)) != NULL) {
             AVPacket pkt;
             av_init_packet(&pkt);
 
-            ret = avcodec_encode_audio(enc, audio_out, audio_out_size,
-                                       (short *)audio_buf);
-            audio_size += ret;
+            ret = avcodec_encode_audio(enc, job->audio_out, audio_out_size,
+                                       (short *)frame);
+            audio_ring_consume(&ost->fifo, frame_bytes);
             pkt.stream_index= ost->index;
-            pkt.data= audio_out;
+            pkt.data= job->audio_out;
             pkt.size= ret;
             if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
                 pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
             pkt.flags |= PKT_FLAG_KEY;
-            write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+            mux_queue_packet(job, ost, &pkt);
 
             ost->sync_opts += enc->frame_size;
         }
@@ -508,6 +756,10 @@ static void do_audio_out(AVFormatContext *s,
         AVPacket pkt;
         av_init_packet(&pkt);
 
+        /* pcm takes all there is, including inserted silence */
+        size_out = audio_ring_size(&ost->fifo);
+        frame = audio_ring_peek(&ost->fifo, size_out);
+        audio_ring_consume(&ost->fifo, size_out);
         ost->sync_opts += size_out / (2 * enc->channels);
 
         /* output a pcm frame */
@@ -535,20 +787,20 @@ static void do_audio_out(AVFormatContext *s,
             size_out = size_out >> 1;
             break;
         }
-        ret = avcodec_encode_audio(enc, audio_out, size_out,
-                                   (short *)buftmp);
-        audio_size += ret;
+        ret = avcodec_encode_audio(enc, job->audio_out, size_out,
+                                   (short *)frame);
         pkt.stream_index= ost->index;
-        pkt.data= audio_out;
+        pkt.data= job->audio_out;
         pkt.size= ret;
         if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
             pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
         pkt.flags |= PKT_FLAG_KEY;
-        write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+        mux_queue_packet(job, ost, &pkt);
     }
 }
 
-static void pre_process_video_frame(AVInputStream *ist, AVPicture *picture, void **bufp)
+/* result may point to job->deinterlace_buf, valid until next frame */
+static void pre_process_video_frame(FFmpegJob *job, AVInputStream *ist, AVPicture *picture)
 {
     AVCodecContext *dec;
     AVPicture *picture2;
@@ -558,24 +810,22 @@ static void pre_process_video_frame(AVInputStream *ist, AVPicture *picture, void
     dec = ist->st->codec;
 
     /* deinterlace : must be done before any resize */
-    if (do_deinterlace || using_vhook) {
+    if (job->do_deinterlace || job->using_vhook) {
         int size;
 
         /* create temporary picture */
         size = avpicture_get_size(dec->pix_fmt, dec->width, dec->height);
-        buf = av_malloc(size);
+        buf = job_buffer_get(job, &job->deinterlace_buf, size);
         if (!buf)
             return;
 
         picture2 = &picture_tmp;
         avpicture_fill(picture2, buf, dec->pix_fmt, dec->width, dec->height);
 
-        if (do_deinterlace){
+        if (job->do_deinterlace){
             if(avpicture_deinterlace(picture2, picture,
                                      dec->pix_fmt, dec->width, dec->height) < 0) {
                 /* if error, do not deinterlace */
-                av_free(buf);
-                buf = NULL;
                 picture2 = picture;
             }
         } else {
@@ -589,19 +839,18 @@ static void pre_process_video_frame(AVInputStream *ist, AVPicture *picture, void
 
     if (picture != picture2)
         *picture = *picture2;
-    *bufp = buf;
 }
 
 /* we begin to correct av delay at this threshold */
 #define AV_DELAY_MAX 0.100
 
-static void do_subtitle_out(AVFormatContext *s,
+static void do_subtitle_out(FFmpegJob *job,
+                            AVFormatContext *s,
                             AVOutputStream *ost,
                             AVInputStream *ist,
                             AVSubtitle *sub,
                             int64_t pts)
 {
-    static uint8_t *subtitle_out = NULL;
     int subtitle_out_max_size = 65536;
     int subtitle_out_size, nb, i;
     AVCodecContext *enc;
@@ -614,8 +863,8 @@ static void do_subtitle_out(AVFormatContext *s,
 
     enc = ost->st->codec;
 
-    if (!subtitle_out) {
-        subtitle_out = av_malloc(subtitle_out_max_size);
+    if (!job->subtitle_out) {
+        job->subtitle_out = av_malloc(subtitle_out_max_size);
     }
 
     /* Note: DVB subtitle need one packet to draw them and one other
@@ -627,14 +876,14 @@ static void do_subtitle_out(AVFormatContext *s,
         nb = 1;
 
     for(i = 0; i < nb; i++) {
-        subtitle_out_size = avcodec_encode_subtitle(enc, subtitle_out,
+        subtitle_out_size = avcodec_encode_subtitle(enc, job->subtitle_out,
                                                     subtitle_out_max_size, sub);
 
         av_init_packet(&pkt);
         pkt.stream_index = ost->index;
-        pkt.data = subtitle_out;
+        pkt.data = job->subtitle_out;
         pkt.size = subtitle_out_size;
-        pkt.pts = av_rescale_q(av_rescale_q(pts, ist->st->time_base, AV_TIME_BASE_Q) + input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q,  ost->st->time_base);
+        pkt.pts = av_rescale_q(av_rescale_q(pts, ist->st->time_base, AV_TIME_BASE_Q) + job->input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q,  ost->st->time_base);
         if (enc->codec_id == CODEC_ID_DVB_SUBTITLE) {
             /* XXX: the pts correction is handled here. Maybe handling
                it in the codec would be better */
@@ -643,24 +892,22 @@ static void do_subtitle_out(AVFormatContext *s,
             else
                 pkt.pts += 90 * sub->end_display_time;
         }
-        write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+        mux_queue_packet(job, ost, &pkt);
     }
 }
 
-static int bit_buffer_size= 1024*256;
-static uint8_t *bit_buffer= NULL;
-
-static void do_video_out(AVFormatContext *s,
+static void do_video_out(FFmpegJob *job,
+                         AVFormatContext *s,
                          AVOutputStream *ost,
                          AVInputStream *ist,
-                         AVFrame *in_picture,
-                         int *frame_size)
+                         AVFrame *in_picture)
 {
-    int nb_frames, i, ret;
-    AVFrame *final_picture, *formatted_picture, *resampling_dst, *padding_src;
+    int nb_frames;
+    int active_width, active_height;
+    AVFrame *final_picture, *formatted_picture, *resampling_dst;
     AVFrame picture_crop_temp, picture_pad_temp;
-    uint8_t *buf = NULL, *buf1 = NULL;
     AVCodecContext *enc, *dec;
+    MuxItem *item;
 
     avcodec_get_frame_defaults(&picture_crop_temp);
     avcodec_get_frame_defaults(&picture_pad_temp);
@@ -671,11 +918,9 @@ static void do_video_out(AVFormatContext *s,
     /* by default, we output a single frame */
     nb_frames = 1;
 
-    *frame_size = 0;
-
-    if(video_sync_method){
+    if(job->video_sync_method){
         double vdelta;
-        vdelta = get_sync_ipts(ost) / av_q2d(enc->time_base) - ost->sync_opts;
+        vdelta = get_sync_ipts(job, ost) / av_q2d(enc->time_base) - ost->sync_opts;
         //FIXME set to 0.5 after we fix some dts/pts bugs like in avidec.c
         if (vdelta < -1.1)
             nb_frames = 0;
@@ -683,60 +928,173 @@ static void do_video_out(AVFormatContext *s,
             nb_frames = lrintf(vdelta);
 //fprintf(stderr, "vdelta:%f, ost->sync_opts:%lld, ost->sync_ipts:%f nb_frames:%d\n", vdelta, ost->sync_opts, ost->sync_ipts, nb_frames);
         if (nb_frames == 0){
-            ++nb_frames_drop;
-            if (verbose>2)
+            ++job->nb_frames_drop;
+            if (job->verbose>2)
                 fprintf(stderr, "*** drop!\n");
         }else if (nb_frames > 1) {
-            nb_frames_dup += nb_frames;
-            if (verbose>2)
+            job->nb_frames_dup += nb_frames;
+            if (job->verbose>2)
                 fprintf(stderr, "*** %d dup!\n", nb_frames-1);
         }
     }else
-        ost->sync_opts= lrintf(get_sync_ipts(ost) / av_q2d(enc->time_base));
+        ost->sync_opts= lrintf(get_sync_ipts(job, ost) / av_q2d(enc->time_base));
 
-    nb_frames= FFMIN(nb_frames, max_frames[CODEC_TYPE_VIDEO] - ost->frame_number);
+    nb_frames= FFMIN(nb_frames, job->max_frames[CODEC_TYPE_VIDEO] - ost->frame_number);
     if (nb_frames <= 0)
         return;
 
     if (ost->video_crop) {
         if (img_crop((AVPicture *)&picture_crop_temp, (AVPicture *)in_picture, dec->pix_fmt, ost->topBand, ost->leftBand) < 0) {
             av_log(NULL, AV_LOG_ERROR, "error cropping picture\n");
-            goto the_end;
+            return;
         }
         formatted_picture = &picture_crop_temp;
     } else {
         formatted_picture = in_picture;
     }
 
-    final_picture = formatted_picture;
-    padding_src = formatted_picture;
-    resampling_dst = &ost->pict_tmp;
+    /* decoder reuses its buffers, so picture always goes through a slot */
+    item = mux_queue_get(job);
+    if (mux_item_alloc_picture(job, item, enc) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "error allocating picture\n");
+        return;
+    }
+
+    final_picture = &item->picture;
+    resampling_dst = final_picture;
+    active_width = enc->width - (ost->padleft + ost->padright);
+    active_height = enc->height - (ost->padtop + ost->padbottom);
+
+    /* letterbox: bars are painted once per slot picture, the frame is
+       scaled or copied straight into the active region */
     if (ost->video_pad) {
-        final_picture = &ost->pict_tmp;
-        if (ost->video_resample) {
-            if (img_crop((AVPicture *)&picture_pad_temp, (AVPicture *)final_picture, enc->pix_fmt, ost->padtop, ost->padleft) < 0) {
-                av_log(NULL, AV_LOG_ERROR, "error padding picture\n");
-                goto the_end;
-            }
-            resampling_dst = &picture_pad_temp;
+        mux_item_fill_pad(job, item, ost);
+        if (img_crop((AVPicture *)&picture_pad_temp, (AVPicture *)final_picture, enc->pix_fmt, ost->padtop, ost->padleft) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "error padding picture\n");
+            return;
         }
+        resampling_dst = &picture_pad_temp;
     }
 
-    if (ost->video_resample) {
-        padding_src = NULL;
-        final_picture = &ost->pict_tmp;
+    if (ost->fast_resample_ctx) {
+        yuv_scale(ost->fast_resample_ctx, formatted_picture->data, formatted_picture->linesize,
+                  resampling_dst->data, resampling_dst->linesize);
+    } else if (ost->video_resample) {
         sws_scale(ost->img_resample_ctx, formatted_picture->data, formatted_picture->linesize,
               0, ost->resample_height, resampling_dst->data, resampling_dst->linesize);
+    } else {
+        img_copy((AVPicture*)resampling_dst, (AVPicture *)formatted_picture,
+                 enc->pix_fmt, active_width, active_height);
+    }
+    job->picture_write_size += avpicture_get_size(enc->pix_fmt, active_width, active_height);
+
+    /* better than nothing: use input picture interlaced
+       settings */
+    final_picture->interlaced_frame = in_picture->interlaced_frame;
+    if(job->avctx_opts->flags & (CODEC_FLAG_INTERLACED_DCT|CODEC_FLAG_INTERLACED_ME)){
+        if(job->top_field_first == -1)
+            final_picture->top_field_first = in_picture->top_field_first;
+        else
+            final_picture->top_field_first = job->top_field_first;
     }
 
-    if (ost->video_pad) {
-        img_pad((AVPicture*)final_picture, (AVPicture *)padding_src,
-                enc->height, enc->width, enc->pix_fmt,
-                ost->padtop, ost->padbottom, ost->padleft, ost->padright, padcolor);
+    /* handles sameq here. This is not correct because it may
+       not be a global option */
+    if (job->same_quality) {
+        final_picture->quality = ist->st->quality;
+    }else
+        final_picture->quality = ost->st->quality;
+    final_picture->pict_type = job->me_threshold ? in_picture->pict_type : 0;
+
+    item->type = MUX_ITEM_VIDEO;
+    item->ost = ost;
+    item->ist = ist;
+    item->nb_frames = nb_frames;
+    item->sync_opts = ost->sync_opts;
+    item->frame_number = ost->frame_number + nb_frames;
+    mux_queue_put(job);
+
+    /* duplicates are encoded by the mux thread */
+    ost->sync_opts += nb_frames;
+    ost->frame_number += nb_frames;
+}
+
+static double psnr(double d){
+    if(d==0) return INFINITY;
+    return -10.0*log(d)/log(10.0);
+}
+
+static void do_video_stats(FFmpegJob *job, AVFormatContext *os, AVOutputStream *ost,
+                           int frame_number, int64_t sync_opts, int frame_size)
+{
+    char filename[40];
+    time_t today2;
+    struct tm *today;
+    AVCodecContext *enc;
+    int64_t ti;
+    double ti1, bitrate, avg_bitrate;
+
+    if (!job->fvstats) {
+        today2 = time(NULL);
+        today = localtime(&today2);
+        snprintf(filename, sizeof(filename), "vstats_%02d%02d%02d.log", today->tm_hour,
+                                               today->tm_min,
+                                               today->tm_sec);
+        job->fvstats = fopen(filename,"w");
+        if (!job->fvstats) {
+            perror("fopen");
+            job->do_vstats = 0;
+            return;
+        }
+    }
+
+    ti = MAXINT64;
+    enc = ost->st->codec;
+    if (enc->codec_type == CODEC_TYPE_VIDEO) {
+        fprintf(job->fvstats, "frame= %5d q= %2.1f ", frame_number, enc->coded_frame->quality/(float)FF_QP2LAMBDA);
+        if (enc->flags&CODEC_FLAG_PSNR)
+            fprintf(job->fvstats, "PSNR= %6.2f ", psnr(enc->coded_frame->error[0]/(enc->width*enc->height*255.0*255.0)));
+
+        fprintf(job->fvstats,"f_size= %6d ", frame_size);
+        /* compute pts value */
+        ti1 = sync_opts * av_q2d(enc->time_base);
+        if (ti1 < 0.01)
+            ti1 = 0.01;
+
+        bitrate = (frame_size * 8) / av_q2d(enc->time_base) / 1000.0;
+        avg_bitrate = (double)(job->video_size * 8) / ti1 / 1000.0;
+        fprintf(job->fvstats, "s_size= %8.0fkB time= %0.3f br= %7.1fkbits/s avg_br= %7.1fkbits/s ",
+            (double)job->video_size / 1024, ti1, bitrate, avg_bitrate);
+        fprintf(job->fvstats,"type= %c\n", av_get_pict_type_char(enc->coded_frame->pict_type));
     }
+}
+
+static void print_report(FFmpegJob *job,
+                         AVOutputStream **ost_table, int nb_ostreams,
+                         int is_last_report)
+{
+	if ( job->cpp_callback ) {
+		AVOutputStream *ost = ost_table[0];
+        if ( !job->cpp_callback(job->cpp_passed_ptr, ost->frame_number) ) {
+        	job->received_sigterm = 1;
+		}
+	}
+}
+
+/*
+ * Encoder/muxer stage. Everything below runs on mux_thread() when the
+ * pipeline is threaded, and is the only code writing to output files or
+ * touching video encoder and job->bit_buffer.
+ */
+static void encode_video_item(FFmpegJob *job, MuxItem *item)
+{
+    AVOutputStream *ost = item->ost;
+    AVFormatContext *s = job->output_files[ost->file_index];
+    AVCodecContext *enc = ost->st->codec;
+    int i, ret, frame_size = 0;
 
     /* duplicates frame if needed */
-    for(i=0;i<nb_frames;i++) {
+    for(i=0;i<item->nb_frames;i++) {
         AVPacket pkt;
         av_init_packet(&pkt);
         pkt.stream_index= ost->index;
@@ -744,167 +1102,232 @@ static void do_video_out(AVFormatContext *s,
         if (s->oformat->flags & AVFMT_RAWPICTURE) {
             /* raw pictures are written as AVPicture structure to
                avoid any copies. We support temorarily the older
-               method. */
+               method. Never threaded, so decoder is still ours */
+            AVCodecContext *dec = item->ist->st->codec;
             AVFrame* old_frame = enc->coded_frame;
             enc->coded_frame = dec->coded_frame; //FIXME/XXX remove this hack
-            pkt.data= (uint8_t *)final_picture;
+            pkt.data= (uint8_t *)&item->picture;
             pkt.size=  sizeof(AVPicture);
             if(dec->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
                 pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
             if(dec->coded_frame && dec->coded_frame->key_frame)
                 pkt.flags |= PKT_FLAG_KEY;
 
-            write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+            write_frame(s, &pkt, ost->st->codec, job->bitstream_filters[ost->file_index][pkt.stream_index]);
             enc->coded_frame = old_frame;
         } else {
             AVFrame big_picture;
 
-            big_picture= *final_picture;
-            /* better than nothing: use input picture interlaced
-               settings */
-            big_picture.interlaced_frame = in_picture->interlaced_frame;
-            if(avctx_opts->flags & (CODEC_FLAG_INTERLACED_DCT|CODEC_FLAG_INTERLACED_ME)){
-                if(top_field_first == -1)
-                    big_picture.top_field_first = in_picture->top_field_first;
-                else
-                    big_picture.top_field_first = top_field_first;
-            }
-
-            /* handles sameq here. This is not correct because it may
-               not be a global option */
-            if (same_quality) {
-                big_picture.quality = ist->st->quality;
-            }else
-                big_picture.quality = ost->st->quality;
-            if(!me_threshold)
-                big_picture.pict_type = 0;
-//            big_picture.pts = AV_NOPTS_VALUE;
-            big_picture.pts= ost->sync_opts;
-//            big_picture.pts= av_rescale(ost->sync_opts, AV_TIME_BASE*(int64_t)enc->time_base.num, enc->time_base.den);
-//av_log(NULL, AV_LOG_DEBUG, "%lld -> encoder\n", ost->sync_opts);
+            big_picture= item->picture;
+            big_picture.pts= item->sync_opts + i;
             ret = avcodec_encode_video(enc,
-                                       bit_buffer, bit_buffer_size,
+                                       job->bit_buffer, job->bit_buffer_size,
                                        &big_picture);
             if (ret == -1) {
                 fprintf(stderr, "Video encoding failed\n");
-                exit(1);
+                job_fail(job, -EIO);
+                return;
             }
-            //enc->frame_number = enc->real_pict_num;
             if(ret>0){
-                pkt.data= bit_buffer;
+                pkt.data= job->bit_buffer;
                 pkt.size= ret;
                 if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
                     pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
-/*av_log(NULL, AV_LOG_DEBUG, "encoder -> %lld/%lld\n",
-   pkt.pts != AV_NOPTS_VALUE ? av_rescale(pkt.pts, enc->time_base.den, AV_TIME_BASE*(int64_t)enc->time_base.num) : -1,
-   pkt.dts != AV_NOPTS_VALUE ? av_rescale(pkt.dts, enc->time_base.den, AV_TIME_BASE*(int64_t)enc->time_base.num) : -1);*/
-
                 if(enc->coded_frame && enc->coded_frame->key_frame)
                     pkt.flags |= PKT_FLAG_KEY;
-                write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
-                *frame_size = ret;
-                //fprintf(stderr,"\nFrame: %3d %3d size: %5d type: %d",
-                //        enc->frame_number-1, enc->real_pict_num, ret,
-                //        enc->pict_type);
+                write_frame(s, &pkt, ost->st->codec, job->bitstream_filters[ost->file_index][pkt.stream_index]);
+                job->video_size += ret;
+                frame_size = ret;
                 /* if two pass, output log */
                 if (ost->logfile && enc->stats_out) {
                     fprintf(ost->logfile, "%s", enc->stats_out);
                 }
             }
         }
-        ost->sync_opts++;
-        ost->frame_number++;
     }
- the_end:
-    av_free(buf);
-    av_free(buf1);
+    if (job->do_vstats && frame_size)
+        do_video_stats(job, s, ost, item->frame_number, item->sync_opts + item->nb_frames, frame_size);
 }
 
-static double psnr(double d){
-    if(d==0) return INFINITY;
-    return -10.0*log(d)/log(10.0);
+static void flush_video_encoder(FFmpegJob *job, AVOutputStream *ost)
+{
+    AVFormatContext *os = job->output_files[ost->file_index];
+    AVCodecContext *enc = ost->st->codec;
+    int ret;
+
+    for(;;) {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.stream_index= ost->index;
+
+        ret = avcodec_encode_video(enc, job->bit_buffer, job->bit_buffer_size, NULL);
+        if(ret<=0)
+            break;
+        job->video_size += ret;
+        if(enc->coded_frame && enc->coded_frame->key_frame)
+            pkt.flags |= PKT_FLAG_KEY;
+        if (ost->logfile && enc->stats_out) {
+            fprintf(ost->logfile, "%s", enc->stats_out);
+        }
+        pkt.data= job->bit_buffer;
+        pkt.size= ret;
+        if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
+            pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
+        write_frame(os, &pkt, ost->st->codec, job->bitstream_filters[ost->file_index][pkt.stream_index]);
+    }
 }
 
-static void do_video_stats(AVFormatContext *os, AVOutputStream *ost,
-                           int frame_size)
+static void mux_item_process(FFmpegJob *job, MuxItem *item)
 {
-    static FILE *fvstats=NULL;
-    char filename[40];
-    time_t today2;
-    struct tm *today;
+    AVOutputStream *ost = item->ost;
     AVCodecContext *enc;
-    int frame_number;
-    int64_t ti;
-    double ti1, bitrate, avg_bitrate;
 
-    if (!fvstats) {
-        today2 = time(NULL);
-        today = localtime(&today2);
-        snprintf(filename, sizeof(filename), "vstats_%02d%02d%02d.log", today->tm_hour,
-                                               today->tm_min,
-                                               today->tm_sec);
-        fvstats = fopen(filename,"w");
-        if (!fvstats) {
-            perror("fopen");
-            exit(1);
-        }
+    /* after an error queue is only drained */
+    if (job->error) {
+        if (item->type == MUX_ITEM_PACKET)
+            av_free_packet(&item->pkt);
+        return;
     }
 
-    ti = MAXINT64;
-    enc = ost->st->codec;
-    if (enc->codec_type == CODEC_TYPE_VIDEO) {
-        frame_number = ost->frame_number;
-        fprintf(fvstats, "frame= %5d q= %2.1f ", frame_number, enc->coded_frame->quality/(float)FF_QP2LAMBDA);
-        if (enc->flags&CODEC_FLAG_PSNR)
-            fprintf(fvstats, "PSNR= %6.2f ", psnr(enc->coded_frame->error[0]/(enc->width*enc->height*255.0*255.0)));
-
-        fprintf(fvstats,"f_size= %6d ", frame_size);
-        /* compute pts value */
-        ti1 = ost->sync_opts * av_q2d(enc->time_base);
-        if (ti1 < 0.01)
-            ti1 = 0.01;
+    switch(item->type) {
+    case MUX_ITEM_VIDEO:
+        encode_video_item(job, item);
+        break;
+    case MUX_ITEM_FLUSH:
+        flush_video_encoder(job, ost);
+        break;
+    case MUX_ITEM_PACKET:
+        enc = ost->st->codec;
+        if(enc->codec_type == CODEC_TYPE_AUDIO)
+            job->audio_size += item->pkt.size;
+        else if(enc->codec_type == CODEC_TYPE_VIDEO)
+            job->video_size += item->pkt.size;
 
-        bitrate = (frame_size * 8) / av_q2d(enc->time_base) / 1000.0;
-        avg_bitrate = (double)(video_size * 8) / ti1 / 1000.0;
-        fprintf(fvstats, "s_size= %8.0fkB time= %0.3f br= %7.1fkbits/s avg_br= %7.1fkbits/s ",
-            (double)video_size / 1024, ti1, bitrate, avg_bitrate);
-        fprintf(fvstats,"type= %c\n", av_get_pict_type_char(enc->coded_frame->pict_type));
+        if (ost->encoding_needed) {
+            write_frame(job->output_files[ost->file_index], &item->pkt, enc,
+                        job->bitstream_filters[ost->file_index][ost->index]);
+        } else {
+            AVFrame avframe; //FIXME/XXX remove this
+
+            /* no reencoding needed : output the packet directly */
+            avcodec_get_frame_defaults(&avframe);
+            enc->coded_frame= &avframe;
+            avframe.key_frame = item->pkt.flags & PKT_FLAG_KEY;
+            write_frame(job->output_files[ost->file_index], &item->pkt, enc,
+                        job->bitstream_filters[ost->file_index][ost->index]);
+            enc->coded_frame= NULL;
+            enc->frame_number++;
+        }
+        av_free_packet(&item->pkt);
+        break;
+    case MUX_ITEM_EOF:
+        break;
     }
 }
 
-static void print_report(AVFormatContext **output_files,
-                         AVOutputStream **ost_table, int nb_ostreams,
-                         int is_last_report)
+static void *mux_thread(void *arg)
 {
-	if ( cpp_callback ) {
-		AVOutputStream *ost = ost_table[0];
-        if ( !cpp_callback(cpp_passed_ptr, ost->frame_number) ) {
-        	received_sigterm = 1;
-		}
-	}
+    FFmpegJob *job = arg;
+    MuxQueue *q = job->mux_queue;
+    MuxItem *item;
+    int eof;
+
+    do {
+        pthread_mutex_lock(&q->lock);
+        while (!q->count)
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        item = &q->items[q->rindex];
+        pthread_mutex_unlock(&q->lock);
+
+        eof = (item->type == MUX_ITEM_EOF);
+        mux_item_process(job, item);
+
+        pthread_mutex_lock(&q->lock);
+        q->rindex = (q->rindex + 1) % MUX_QUEUE_SIZE;
+        q->count--;
+        q->out_size = url_ftell(&job->output_files[0]->pb);
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+    } while (!eof);
+
+    return NULL;
 }
 
-/* pkt = NULL means EOF (needed to flush decoder buffers) */
-static int output_packet(AVInputStream *ist, int ist_index,
-                         AVOutputStream **ost_table, int nb_ostreams,
-                         const AVPacket *pkt)
+static int mux_queue_init(FFmpegJob *job, int threaded)
 {
-    AVFormatContext *os;
-    AVOutputStream *ost;
-    uint8_t *ptr;
-    int len, ret, i;
-    uint8_t *data_buf;
-    int data_size, got_picture;
-    AVFrame picture;
-    void *buffer_to_free;
-    static unsigned int samples_size= 0;
-    static short *samples= NULL;
-    AVSubtitle subtitle, *subtitle_to_free;
-    int got_subtitle;
+    MuxQueue *q = av_mallocz(sizeof(MuxQueue));
+    if (!q)
+        return -1;
+    job->mux_queue = q;
 
-    if(!pkt){
-        ist->pts= ist->next_pts; // needed for last packet if vsync=0
-    } else if (pkt->dts != AV_NOPTS_VALUE) { //FIXME seems redundant, as libavformat does this too
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    if (threaded && !pthread_create(&q->thread, NULL, mux_thread, job))
+        q->threaded = 1;
+    return 0;
+}
+
+static int64_t mux_queue_out_size(FFmpegJob *job)
+{
+    MuxQueue *q = job->mux_queue;
+    int64_t size;
+
+    if (!q->threaded)
+        return url_ftell(&job->output_files[0]->pb);
+    pthread_mutex_lock(&q->lock);
+    size = q->out_size;
+    pthread_mutex_unlock(&q->lock);
+    return size;
+}
+
+/* push EOF and wait until everything queued is written */
+static void mux_queue_finish(FFmpegJob *job)
+{
+    MuxQueue *q = job->mux_queue;
+
+    mux_queue_simple(job, NULL, MUX_ITEM_EOF);
+    if (q->threaded) {
+        pthread_join(q->thread, NULL);
+        q->threaded = 0;
+    }
+}
+
+static void mux_queue_free(FFmpegJob *job)
+{
+    MuxQueue *q = job->mux_queue;
+    int i;
+
+    if (!q)
+        return;
+    for(i=0;i<MUX_QUEUE_SIZE;i++) {
+        av_free(q->items[i].picture.data[0]);
+        job_buffer_free(&q->items[i].pkt_buf);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    av_freep(&job->mux_queue);
+}
+
+/* pkt = NULL means EOF (needed to flush decoder buffers) */
+static int output_packet(FFmpegJob *job, AVInputStream *ist, int ist_index,
+                         AVOutputStream **ost_table, int nb_ostreams,
+                         const AVPacket *pkt)
+{
+    AVFormatContext *os;
+    AVOutputStream *ost;
+    uint8_t *ptr;
+    int len, ret, i;
+    uint8_t *data_buf;
+    int data_size, got_picture;
+    AVFrame picture;
+    AVSubtitle subtitle, *subtitle_to_free;
+    int got_subtitle;
+
+    if(!pkt){
+        ist->pts= ist->next_pts; // needed for last packet if vsync=0
+    } else if (pkt->dts != AV_NOPTS_VALUE) { //FIXME seems redundant, as libavformat does this too
         ist->next_pts = ist->pts = av_rescale_q(pkt->dts, ist->st->time_base, AV_TIME_BASE_Q);
     } else {
 //        assert(ist->pts == ist->next_pts);
@@ -929,10 +1352,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
             switch(ist->st->codec->codec_type) {
             case CODEC_TYPE_AUDIO:{
                 if(pkt)
-                    samples= av_fast_realloc(samples, &samples_size, FFMAX(pkt->size, AVCODEC_MAX_AUDIO_FRAME_SIZE));
+                    job_buffer_get(job, &job->samples, FFMAX(pkt->size, AVCODEC_MAX_AUDIO_FRAME_SIZE));
                     /* XXX: could avoid copy if PCM 16 bits with same
                        endianness as CPU */
-                ret = avcodec_decode_audio(ist->st->codec, samples, &data_size,
+                ret = avcodec_decode_audio(ist->st->codec, (short *)job->samples.data, &data_size,
                                            ptr, len);
                 if (ret < 0)
                     goto fail_decode;
@@ -944,7 +1367,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                     /* no audio frame */
                     continue;
                 }
-                data_buf = (uint8_t *)samples;
+                data_buf = job->samples.data;
                 ist->next_pts += ((int64_t)AV_TIME_BASE/2 * data_size) /
                     (ist->st->codec->sample_rate * ist->st->codec->channels);
                 break;}
@@ -1003,19 +1426,17 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 len = 0;
             }
 
-            buffer_to_free = NULL;
             if (ist->st->codec->codec_type == CODEC_TYPE_VIDEO) {
-                pre_process_video_frame(ist, (AVPicture *)&picture,
-                                        &buffer_to_free);
+                pre_process_video_frame(job, ist, (AVPicture *)&picture);
             }
 
-            // preprocess audio (volume)
+            // preprocess audio (volume), unless it is done by audio_mix
             if (ist->st->codec->codec_type == CODEC_TYPE_AUDIO) {
-                if (audio_volume != 256) {
+                if (job->audio_volume != 256 && ist->scalar_volume) {
                     short *volp;
-                    volp = samples;
+                    volp = (short *)job->samples.data;
                     for(i=0;i<(data_size / sizeof(short));i++) {
-                        int v = ((*volp) * audio_volume + 128) >> 8;
+                        int v = ((*volp) * job->audio_volume + 128) >> 8;
                         if (v < -32768) v = -32768;
                         if (v >  32767) v = 32767;
                         *volp++ = v;
@@ -1048,13 +1469,12 @@ static int output_packet(AVInputStream *ist, int ist_index,
 #endif
             /* if output time reached then transcode raw format,
                encode packets and output them */
-            if (start_time == 0 || ist->pts >= start_time)
+            if ((job->start_time == 0 || ist->pts >= job->start_time) &&
+                (!job->cut_at_start || ist->pts + job->input_files_ts_offset[ist->file_index] >= 0))
                 for(i=0;i<nb_ostreams;i++) {
-                    int frame_size;
-
                     ost = ost_table[i];
                     if (ost->source_index == ist_index) {
-                        os = output_files[ost->file_index];
+                        os = job->output_files[ost->file_index];
 
 #if 0
                         printf("%d: got pts=%0.3f %0.3f\n", i,
@@ -1063,48 +1483,37 @@ static int output_packet(AVInputStream *ist, int ist_index,
                                ((double)ost->st->pts.val * ost->st->time_base.num / ost->st->time_base.den));
 #endif
                         /* set the input output pts pairs */
-                        //ost->sync_ipts = (double)(ist->pts + input_files_ts_offset[ist->file_index] - start_time)/ AV_TIME_BASE;
+                        //ost->sync_ipts = (double)(ist->pts + job->input_files_ts_offset[ist->file_index] - job->start_time)/ AV_TIME_BASE;
 
                         if (ost->encoding_needed) {
                             switch(ost->st->codec->codec_type) {
                             case CODEC_TYPE_AUDIO:
-                                do_audio_out(os, ost, ist, data_buf, data_size);
+                                do_audio_out(job, os, ost, ist, data_buf, data_size);
                                 break;
                             case CODEC_TYPE_VIDEO:
-                                    do_video_out(os, ost, ist, &picture, &frame_size);
-                                    video_size += frame_size;
-                                    if (do_vstats && frame_size)
-                                        do_video_stats(os, ost, frame_size);
+                                    do_video_out(job, os, ost, ist, &picture);
                                 break;
                             case CODEC_TYPE_SUBTITLE:
-                                do_subtitle_out(os, ost, ist, &subtitle,
+                                do_subtitle_out(job, os, ost, ist, &subtitle,
                                                 pkt->pts);
                                 break;
                             default:
                                 av_abort();
                             }
                         } else {
-                            AVFrame avframe; //FIXME/XXX remove this
                             AVPacket opkt;
                             av_init_packet(&opkt);
 
                             /* no reencoding needed : output the packet directly */
                             /* force the input stream PTS */
 
-                            avcodec_get_frame_defaults(&avframe);
-                            ost->st->codec->coded_frame= &avframe;
-                            avframe.key_frame = pkt->flags & PKT_FLAG_KEY;
-
-                            if(ost->st->codec->codec_type == CODEC_TYPE_AUDIO)
-                                audio_size += data_size;
-                            else if (ost->st->codec->codec_type == CODEC_TYPE_VIDEO) {
-                                video_size += data_size;
+                            if (ost->st->codec->codec_type == CODEC_TYPE_VIDEO) {
                                 ost->sync_opts++;
                             }
 
                             opkt.stream_index= ost->index;
                             if(pkt->pts != AV_NOPTS_VALUE)
-                                opkt.pts= av_rescale_q(av_rescale_q(pkt->pts, ist->st->time_base, AV_TIME_BASE_Q) + input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q,  ost->st->time_base);
+                                opkt.pts= av_rescale_q(av_rescale_q(pkt->pts, ist->st->time_base, AV_TIME_BASE_Q) + job->input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q,  ost->st->time_base);
                             else
                                 opkt.pts= AV_NOPTS_VALUE;
 
@@ -1114,7 +1523,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                                     dts = ist->next_pts;
                                 else
                                     dts= av_rescale_q(pkt->dts, ist->st->time_base, AV_TIME_BASE_Q);
-                                opkt.dts= av_rescale_q(dts + input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q,  ost->st->time_base);
+                                opkt.dts= av_rescale_q(dts + job->input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q,  ost->st->time_base);
                             }
                             opkt.flags= pkt->flags;
 
@@ -1122,14 +1531,11 @@ static int output_packet(AVInputStream *ist, int ist_index,
                             if(av_parser_change(ist->st->parser, ost->st->codec, &opkt.data, &opkt.size, data_buf, data_size, pkt->flags & PKT_FLAG_KEY))
                                 opkt.destruct= av_destruct_packet;
 
-                            write_frame(os, &opkt, ost->st->codec, bitstream_filters[ost->file_index][pkt->stream_index]);
-                            ost->st->codec->frame_number++;
+                            mux_queue_packet(job, ost, &opkt);
                             ost->frame_number++;
-                            av_free_packet(&opkt);
                         }
                     }
                 }
-            av_free(buffer_to_free);
             /* XXX: allocate the subtitles in the codec ? */
             if (subtitle_to_free) {
                 if (subtitle_to_free->rects != NULL) {
@@ -1151,59 +1557,51 @@ static int output_packet(AVInputStream *ist, int ist_index,
             ost = ost_table[i];
             if (ost->source_index == ist_index) {
                 AVCodecContext *enc= ost->st->codec;
-                os = output_files[ost->file_index];
+                os = job->output_files[ost->file_index];
 
                 if(ost->st->codec->codec_type == CODEC_TYPE_AUDIO && enc->frame_size <=1)
                     continue;
                 if(ost->st->codec->codec_type == CODEC_TYPE_VIDEO && (os->oformat->flags & AVFMT_RAWPICTURE))
                     continue;
 
-                if (ost->encoding_needed) {
+                if (!ost->encoding_needed)
+                    continue;
+                if (enc->codec_type == CODEC_TYPE_VIDEO) {
+                    mux_queue_simple(job, ost, MUX_ITEM_FLUSH);
+                } else if (enc->codec_type == CODEC_TYPE_AUDIO) {
+                    /* job->bit_buffer belongs to video encoder on mux thread */
+                    if (!job->audio_out)
+                        job->audio_out = av_malloc(4*MAX_AUDIO_PACKET_SIZE);
+                    if (!job->audio_out)
+                        continue;
                     for(;;) {
                         AVPacket pkt;
                         int fifo_bytes;
                         av_init_packet(&pkt);
                         pkt.stream_index= ost->index;
 
-                        switch(ost->st->codec->codec_type) {
-                        case CODEC_TYPE_AUDIO:
-                            fifo_bytes = av_fifo_size(&ost->fifo);
-                            ret = 0;
-                            /* encode any samples remaining in fifo */
-                            if(fifo_bytes > 0 && enc->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME) {
-                                int fs_tmp = enc->frame_size;
-                                enc->frame_size = fifo_bytes / (2 * enc->channels);
-                                if(av_fifo_read(&ost->fifo, (uint8_t *)samples, fifo_bytes) == 0) {
-                                    ret = avcodec_encode_audio(enc, bit_buffer, bit_buffer_size, samples);
-                                }
-                                enc->frame_size = fs_tmp;
-                            }
-                            if(ret <= 0) {
-                                ret = avcodec_encode_audio(enc, bit_buffer, bit_buffer_size, NULL);
-                            }
-                            audio_size += ret;
-                            pkt.flags |= PKT_FLAG_KEY;
-                            break;
-                        case CODEC_TYPE_VIDEO:
-                            ret = avcodec_encode_video(enc, bit_buffer, bit_buffer_size, NULL);
-                            video_size += ret;
-                            if(enc->coded_frame && enc->coded_frame->key_frame)
-                                pkt.flags |= PKT_FLAG_KEY;
-                            if (ost->logfile && enc->stats_out) {
-                                fprintf(ost->logfile, "%s", enc->stats_out);
-                            }
-                            break;
-                        default:
-                            ret=-1;
+                        fifo_bytes = audio_ring_size(&ost->fifo);
+                        ret = 0;
+                        /* encode any samples remaining in fifo */
+                        if(fifo_bytes > 0 && enc->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME) {
+                            int fs_tmp = enc->frame_size;
+                            enc->frame_size = fifo_bytes / (2 * enc->channels);
+                            ret = avcodec_encode_audio(enc, job->audio_out, 4*MAX_AUDIO_PACKET_SIZE,
+                                                       (short *)audio_ring_peek(&ost->fifo, fifo_bytes));
+                            audio_ring_consume(&ost->fifo, fifo_bytes);
+                            enc->frame_size = fs_tmp;
+                        }
+                        if(ret <= 0) {
+                            ret = avcodec_encode_audio(enc, job->audio_out, 4*MAX_AUDIO_PACKET_SIZE, NULL);
                         }
-
                         if(ret<=0)
                             break;
-                        pkt.data= bit_buffer;
+                        pkt.flags |= PKT_FLAG_KEY;
+                        pkt.data= job->audio_out;
                         pkt.size= ret;
                         if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
                             pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
-                        write_frame(os, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+                        mux_queue_packet(job, ost, &pkt);
                     }
                 }
             }
@@ -1219,29 +1617,24 @@ static int output_packet(AVInputStream *ist, int ist_index,
 /*
  * The following code is the main loop of the file converter
  */
-static int av_encode(AVFormatContext **output_files,
-                     int nb_output_files,
-                     AVFormatContext **input_files,
-                     int nb_input_files,
-                     AVStreamMap *stream_maps, int nb_stream_maps)
+static int av_encode(FFmpegJob *job)
 {
-    int ret, i, j, k, n, nb_istreams = 0, nb_ostreams = 0;
+    int ret, i, j, k, n, nb_istreams = 0, nb_ostreams = 0, threaded;
     AVFormatContext *is, *os;
     AVCodecContext *codec, *icodec;
     AVOutputStream *ost, **ost_table = NULL;
     AVInputStream *ist, **ist_table = NULL;
     AVInputFile *file_table;
     AVFormatContext *stream_no_data;
-    int key;
 
-    file_table= (AVInputFile*) av_mallocz(nb_input_files * sizeof(AVInputFile));
+    file_table= (AVInputFile*) av_mallocz(job->nb_input_files * sizeof(AVInputFile));
     if (!file_table)
-        goto fail;
+        goto fail_nomem;
 
     /* input stream init */
     j = 0;
-    for(i=0;i<nb_input_files;i++) {
-        is = input_files[i];
+    for(i=0;i<job->nb_input_files;i++) {
+        is = job->input_files[i];
         file_table[i].ist_index = j;
         file_table[i].nb_streams = is->nb_streams;
         j += is->nb_streams;
@@ -1250,17 +1643,17 @@ static int av_encode(AVFormatContext **output_files,
 
     ist_table = av_mallocz(nb_istreams * sizeof(AVInputStream *));
     if (!ist_table)
-        goto fail;
+        goto fail_nomem;
 
     for(i=0;i<nb_istreams;i++) {
         ist = av_mallocz(sizeof(AVInputStream));
         if (!ist)
-            goto fail;
+            goto fail_nomem;
         ist_table[i] = ist;
     }
     j = 0;
-    for(i=0;i<nb_input_files;i++) {
-        is = input_files[i];
+    for(i=0;i<job->nb_input_files;i++) {
+        is = job->input_files[i];
         for(k=0;k<is->nb_streams;k++) {
             ist = ist_table[j++];
             ist->st = is->streams[k];
@@ -1278,63 +1671,67 @@ static int av_encode(AVFormatContext **output_files,
 
     /* output stream init */
     nb_ostreams = 0;
-    for(i=0;i<nb_output_files;i++) {
-        os = output_files[i];
+    for(i=0;i<job->nb_output_files;i++) {
+        os = job->output_files[i];
         nb_ostreams += os->nb_streams;
     }
-    if (nb_stream_maps > 0 && nb_stream_maps != nb_ostreams) {
+    if (job->nb_stream_maps > 0 && job->nb_stream_maps != nb_ostreams) {
         fprintf(stderr, "Number of stream maps must match number of output streams\n");
-        exit(1);
+        ret = -EINVAL;
+        goto fail;
     }
 
     /* Sanity check the mapping args -- do the input files & streams exist? */
-    for(i=0;i<nb_stream_maps;i++) {
-        int fi = stream_maps[i].file_index;
-        int si = stream_maps[i].stream_index;
+    for(i=0;i<job->nb_stream_maps;i++) {
+        int fi = job->stream_maps[i].file_index;
+        int si = job->stream_maps[i].stream_index;
 
-        if (fi < 0 || fi > nb_input_files - 1 ||
+        if (fi < 0 || fi > job->nb_input_files - 1 ||
             si < 0 || si > file_table[fi].nb_streams - 1) {
             fprintf(stderr,"Could not find input stream #%d.%d\n", fi, si);
-            exit(1);
+            ret = -EINVAL;
+            goto fail;
         }
-        fi = stream_maps[i].sync_file_index;
-        si = stream_maps[i].sync_stream_index;
-        if (fi < 0 || fi > nb_input_files - 1 ||
+        fi = job->stream_maps[i].sync_file_index;
+        si = job->stream_maps[i].sync_stream_index;
+        if (fi < 0 || fi > job->nb_input_files - 1 ||
             si < 0 || si > file_table[fi].nb_streams - 1) {
             fprintf(stderr,"Could not find sync stream #%d.%d\n", fi, si);
-            exit(1);
+            ret = -EINVAL;
+            goto fail;
         }
     }
 
     ost_table = av_mallocz(sizeof(AVOutputStream *) * nb_ostreams);
     if (!ost_table)
-        goto fail;
+        goto fail_nomem;
     for(i=0;i<nb_ostreams;i++) {
         ost = av_mallocz(sizeof(AVOutputStream));
         if (!ost)
-            goto fail;
+            goto fail_nomem;
         ost_table[i] = ost;
     }
 
     n = 0;
-    for(k=0;k<nb_output_files;k++) {
-        os = output_files[k];
+    for(k=0;k<job->nb_output_files;k++) {
+        os = job->output_files[k];
         for(i=0;i<os->nb_streams;i++) {
             int found;
             ost = ost_table[n++];
             ost->file_index = k;
             ost->index = i;
             ost->st = os->streams[i];
-            if (nb_stream_maps > 0) {
-                ost->source_index = file_table[stream_maps[n-1].file_index].ist_index +
-                    stream_maps[n-1].stream_index;
+            if (job->nb_stream_maps > 0) {
+                ost->source_index = file_table[job->stream_maps[n-1].file_index].ist_index +
+                    job->stream_maps[n-1].stream_index;
 
                 /* Sanity check that the stream types match */
                 if (ist_table[ost->source_index]->st->codec->codec_type != ost->st->codec->codec_type) {
                     fprintf(stderr, "Codec type mismatch for mapping #%d.%d -> #%d.%d\n",
-                        stream_maps[n-1].file_index, stream_maps[n-1].stream_index,
+                        job->stream_maps[n-1].file_index, job->stream_maps[n-1].stream_index,
                         ost->file_index, ost->index);
-                    exit(1);
+                    ret = -EINVAL;
+                    goto fail;
                 }
 
             } else {
@@ -1362,15 +1759,16 @@ static int av_encode(AVFormatContext **output_files,
                     if (!found) {
                         fprintf(stderr, "Could not find input stream matching output stream #%d.%d\n",
                                 ost->file_index, ost->index);
-                        exit(1);
+                        ret = -EINVAL;
+                        goto fail;
                     }
                 }
             }
             ist = ist_table[ost->source_index];
             ist->discard = 0;
-            ost->sync_ist = (nb_stream_maps > 0) ?
-                ist_table[file_table[stream_maps[n-1].sync_file_index].ist_index +
-                         stream_maps[n-1].sync_stream_index] : ist;
+            ost->sync_ist = (job->nb_stream_maps > 0) ?
+                ist_table[file_table[job->stream_maps[n-1].sync_file_index].ist_index +
+                         job->stream_maps[n-1].sync_stream_index] : ist;
         }
     }
 
@@ -1412,8 +1810,8 @@ static int av_encode(AVFormatContext **output_files,
         } else {
             switch(codec->codec_type) {
             case CODEC_TYPE_AUDIO:
-                if (av_fifo_init(&ost->fifo, 2 * MAX_AUDIO_PACKET_SIZE))
-                    goto fail;
+                if (audio_ring_init(&ost->fifo, 4 * MAX_AUDIO_PACKET_SIZE))
+                    goto fail_nomem;
 
                 if (codec->channels == icodec->channels &&
                     codec->sample_rate == icodec->sample_rate) {
@@ -1435,65 +1833,74 @@ static int av_encode(AVFormatContext **output_files,
                         ost->audio_resample = 1;
                     }
                 }
-                if(audio_sync_method>1)
+                if(job->audio_sync_method>1)
                     ost->audio_resample = 1;
 
-                if(ost->audio_resample){
+                /* drift compensation needs the generic resampler */
+                if(job->audio_sync_method<=1 &&
+                   (ost->audio_resample || job->audio_volume != 256)){
+                    ost->audio_mix = audio_mix_init(codec->channels, icodec->channels,
+                                                    codec->sample_rate, icodec->sample_rate,
+                                                    job->audio_volume);
+                }
+                if(!ost->audio_mix)
+                    ist->scalar_volume = 1;
+
+                if(ost->audio_resample && !ost->audio_mix){
                     ost->resample = audio_resample_init(codec->channels, icodec->channels,
                                                     codec->sample_rate, icodec->sample_rate);
                     if(!ost->resample){
                         printf("Can't resample.  Aborting.\n");
-                        av_abort();
+                        ret = -EINVAL;
+                        goto fail;
                     }
                 }
                 ist->decoding_needed = 1;
                 ost->encoding_needed = 1;
                 break;
             case CODEC_TYPE_VIDEO:
-                ost->video_crop = ((frame_leftBand + frame_rightBand + frame_topBand + frame_bottomBand) != 0);
-                ost->video_pad = ((frame_padleft + frame_padright + frame_padtop + frame_padbottom) != 0);
+                ost->video_crop = ((job->frame_leftBand + job->frame_rightBand + job->frame_topBand + job->frame_bottomBand) != 0);
+                ost->video_pad = ((job->frame_padleft + job->frame_padright + job->frame_padtop + job->frame_padbottom) != 0);
                 ost->video_resample = ((codec->width != icodec->width -
-                                (frame_leftBand + frame_rightBand) +
-                                (frame_padleft + frame_padright)) ||
+                                (job->frame_leftBand + job->frame_rightBand) +
+                                (job->frame_padleft + job->frame_padright)) ||
                         (codec->height != icodec->height -
-                                (frame_topBand  + frame_bottomBand) +
-                                (frame_padtop + frame_padbottom)) ||
+                                (job->frame_topBand  + job->frame_bottomBand) +
+                                (job->frame_padtop + job->frame_padbottom)) ||
                         (codec->pix_fmt != icodec->pix_fmt));
                 if (ost->video_crop) {
-                    ost->topBand = frame_topBand;
-                    ost->leftBand = frame_leftBand;
+                    ost->topBand = job->frame_topBand;
+                    ost->leftBand = job->frame_leftBand;
                 }
                 if (ost->video_pad) {
-                    ost->padtop = frame_padtop;
-                    ost->padleft = frame_padleft;
-                    ost->padbottom = frame_padbottom;
-                    ost->padright = frame_padright;
-                    if (!ost->video_resample) {
-                        avcodec_get_frame_defaults(&ost->pict_tmp);
-                        if( avpicture_alloc( (AVPicture*)&ost->pict_tmp, codec->pix_fmt,
-                                         codec->width, codec->height ) )
-                            goto fail;
-                    }
+                    ost->padtop = job->frame_padtop;
+                    ost->padleft = job->frame_padleft;
+                    ost->padbottom = job->frame_padbottom;
+                    ost->padright = job->frame_padright;
                 }
-                if (ost->video_resample) {
-                    avcodec_get_frame_defaults(&ost->pict_tmp);
-                    if( avpicture_alloc( (AVPicture*)&ost->pict_tmp, codec->pix_fmt,
-                                         codec->width, codec->height ) )
-                        goto fail;
-
+                if (ost->video_resample && icodec->pix_fmt == PIX_FMT_YUV420P &&
+                    codec->pix_fmt == PIX_FMT_YUV420P) {
+                    ost->fast_resample_ctx = yuv_scale_init(
+                            icodec->width - (job->frame_leftBand + job->frame_rightBand),
+                            icodec->height - (job->frame_topBand + job->frame_bottomBand),
+                            codec->width - (job->frame_padleft + job->frame_padright),
+                            codec->height - (job->frame_padtop + job->frame_padbottom));
+                }
+                if (ost->video_resample && !ost->fast_resample_ctx) {
                     ost->img_resample_ctx = sws_getContext(
-                            icodec->width - (frame_leftBand + frame_rightBand),
-                            icodec->height - (frame_topBand + frame_bottomBand),
+                            icodec->width - (job->frame_leftBand + job->frame_rightBand),
+                            icodec->height - (job->frame_topBand + job->frame_bottomBand),
                             icodec->pix_fmt,
-                            codec->width - (frame_padleft + frame_padright),
-                            codec->height - (frame_padtop + frame_padbottom),
+                            codec->width - (job->frame_padleft + job->frame_padright),
+                            codec->height - (job->frame_padtop + job->frame_padbottom),
                             codec->pix_fmt,
-                            sws_flags, NULL, NULL, NULL);
+                            job->sws_flags, NULL, NULL, NULL);
                     if (ost->img_resample_ctx == NULL) {
                         fprintf(stderr, "Cannot get resampling context\n");
-                        exit(1);
+                        ret = -EINVAL;
+                        goto fail;
                     }
-                    ost->resample_height = icodec->height - (frame_topBand + frame_bottomBand);
+                    ost->resample_height = icodec->height - (job->frame_topBand + job->frame_bottomBand);
                 }
                 ost->encoding_needed = 1;
                 ist->decoding_needed = 1;
@@ -1515,13 +1922,14 @@ static int av_encode(AVFormatContext **output_files,
                 char *logbuffer;
 
                 snprintf(logfilename, sizeof(logfilename), "%s-%d.log",
-                         pass_logfilename ?
-                         pass_logfilename : DEFAULT_PASS_LOGFILENAME, i);
+                         job->pass_logfilename ?
+                         job->pass_logfilename : DEFAULT_PASS_LOGFILENAME, i);
                 if (codec->flags & CODEC_FLAG_PASS1) {
                     f = fopen(logfilename, "w");
                     if (!f) {
                         perror(logfilename);
-                        exit(1);
+                        ret = -EIO;
+                        goto fail;
                     }
                     ost->logfile = f;
                 } else {
@@ -1529,7 +1937,8 @@ static int av_encode(AVFormatContext **output_files,
                     f = fopen(logfilename, "r");
                     if (!f) {
                         perror(logfilename);
-                        exit(1);
+                        ret = -EIO;
+                        goto fail;
                     }
                     fseek(f, 0, SEEK_END);
                     size = ftell(f);
@@ -1537,7 +1946,8 @@ static int av_encode(AVFormatContext **output_files,
                     logbuffer = av_malloc(size + 1);
                     if (!logbuffer) {
                         fprintf(stderr, "Could not allocate log buffer\n");
-                        exit(1);
+                        fclose(f);
+                        goto fail_nomem;
                     }
                     size = fread(logbuffer, 1, size, f);
                     fclose(f);
@@ -1548,23 +1958,23 @@ static int av_encode(AVFormatContext **output_files,
         }
         if(codec->codec_type == CODEC_TYPE_VIDEO){
             int size= codec->width * codec->height;
-            bit_buffer_size= FFMAX(bit_buffer_size, 4*size);
+            job->bit_buffer_size= FFMAX(job->bit_buffer_size, 4*size);
         }
     }
 
-    if (!bit_buffer)
-        bit_buffer = av_malloc(bit_buffer_size);
-    if (!bit_buffer)
-        goto fail;
+    if (!job->bit_buffer)
+        job->bit_buffer = av_malloc(job->bit_buffer_size);
+    if (!job->bit_buffer)
+        goto fail_nomem;
 
     /* dump the file output parameters - cannot be done before in case
        of stream copy */
-    for(i=0;i<nb_output_files;i++) {
-        dump_format(output_files[i], i, output_files[i]->filename, 1);
+    for(i=0;i<job->nb_output_files;i++) {
+        dump_format(job->output_files[i], i, job->output_files[i]->filename, 1);
     }
 
     /* dump the stream mapping */
-    if (verbose >= 0) {
+    if (job->verbose >= 0) {
         fprintf(stderr, "Stream mapping:\n");
         for(i=0;i<nb_ostreams;i++) {
             ost = ost_table[i];
@@ -1590,14 +2000,20 @@ static int av_encode(AVFormatContext **output_files,
             if (!codec) {
                 fprintf(stderr, "Unsupported codec for output stream #%d.%d\n",
                         ost->file_index, ost->index);
-                exit(1);
+                ret = -EINVAL;
+                goto fail;
             }
-            if (avcodec_open(ost->st->codec, codec) < 0) {
+            ffmpeg_lock();
+            ret = avcodec_open(ost->st->codec, codec);
+            ffmpeg_unlock();
+            ost->opened = ret >= 0;
+            if (ret < 0) {
                 fprintf(stderr, "Error while opening codec for output stream #%d.%d - maybe incorrect parameters such as bit_rate, rate, width or height\n",
                         ost->file_index, ost->index);
-                exit(1);
+                ret = -EINVAL;
+                goto fail;
             }
-            extra_size += ost->st->codec->extradata_size;
+            job->extra_size += ost->st->codec->extradata_size;
         }
     }
 
@@ -1610,12 +2026,18 @@ static int av_encode(AVFormatContext **output_files,
             if (!codec) {
                 fprintf(stderr, "Unsupported codec (id=%d) for input stream #%d.%d\n",
                         ist->st->codec->codec_id, ist->file_index, ist->index);
-                exit(1);
+                ret = -EINVAL;
+                goto fail;
             }
-            if (avcodec_open(ist->st->codec, codec) < 0) {
+            ffmpeg_lock();
+            ret = avcodec_open(ist->st->codec, codec);
+            ffmpeg_unlock();
+            ist->opened = ret >= 0;
+            if (ret < 0) {
                 fprintf(stderr, "Error while opening codec for input stream #%d.%d\n",
                         ist->file_index, ist->index);
-                exit(1);
+                ret = -EINVAL;
+                goto fail;
             }
             //if (ist->st->codec->codec_type == CODEC_TYPE_VIDEO)
             //    ist->st->codec->flags |= CODEC_FLAG_REPEAT_FIELD;
@@ -1625,41 +2047,41 @@ static int av_encode(AVFormatContext **output_files,
     /* init pts */
     for(i=0;i<nb_istreams;i++) {
         ist = ist_table[i];
-        is = input_files[ist->file_index];
+        is = job->input_files[ist->file_index];
         ist->pts = 0;
         ist->next_pts = av_rescale_q(ist->st->start_time, ist->st->time_base, AV_TIME_BASE_Q);
         if(ist->st->start_time == AV_NOPTS_VALUE)
             ist->next_pts=0;
-        if(input_files_ts_offset[ist->file_index])
+        if(job->input_files_ts_offset[ist->file_index])
             ist->next_pts= AV_NOPTS_VALUE;
         ist->is_start = 1;
     }
 
     /* compute buffer size max (should use a complete heuristic) */
-    for(i=0;i<nb_input_files;i++) {
+    for(i=0;i<job->nb_input_files;i++) {
         file_table[i].buffer_size_max = 2048;
     }
 
     /* set meta data information from input file if required */
-    for (i=0;i<nb_meta_data_maps;i++) {
+    for (i=0;i<job->nb_meta_data_maps;i++) {
         AVFormatContext *out_file;
         AVFormatContext *in_file;
 
-        int out_file_index = meta_data_maps[i].out_file;
-        int in_file_index = meta_data_maps[i].in_file;
-        if ( out_file_index < 0 || out_file_index >= nb_output_files ) {
+        int out_file_index = job->meta_data_maps[i].out_file;
+        int in_file_index = job->meta_data_maps[i].in_file;
+        if ( out_file_index < 0 || out_file_index >= job->nb_output_files ) {
             fprintf(stderr, "Invalid output file index %d map_meta_data(%d,%d)\n", out_file_index, out_file_index, in_file_index);
             ret = -EINVAL;
             goto fail;
         }
-        if ( in_file_index < 0 || in_file_index >= nb_input_files ) {
+        if ( in_file_index < 0 || in_file_index >= job->nb_input_files ) {
             fprintf(stderr, "Invalid input file index %d map_meta_data(%d,%d)\n", in_file_index, out_file_index, in_file_index);
             ret = -EINVAL;
             goto fail;
         }
 
-        out_file = output_files[out_file_index];
-        in_file = input_files[in_file_index];
+        out_file = job->output_files[out_file_index];
+        in_file = job->input_files[in_file_index];
 
         strcpy(out_file->title, in_file->title);
         strcpy(out_file->author, in_file->author);
@@ -1672,8 +2094,8 @@ static int av_encode(AVFormatContext **output_files,
     }
 
     /* open files and write file headers */
-    for(i=0;i<nb_output_files;i++) {
-        os = output_files[i];
+    for(i=0;i<job->nb_output_files;i++) {
+        os = job->output_files[i];
         if (av_write_header(os) < 0) {
             fprintf(stderr, "Could not write header for output file #%d (incorrect codec parameters ?)\n", i);
             ret = -EINVAL;
@@ -1681,18 +2103,18 @@ static int av_encode(AVFormatContext **output_files,
         }
     }
 
-#ifndef __MINGW32__
-    if ( !using_stdin && verbose >= 0) {
-        fprintf(stderr, "Press [q] to stop encoding\n");
-        url_set_interrupt_cb(decode_interrupt_cb);
+    /* raw pictures point into the slot they were scaled to, no queueing */
+    threaded = 1;
+    for(i=0;i<job->nb_output_files;i++) {
+        if (job->output_files[i]->oformat->flags & AVFMT_RAWPICTURE)
+            threaded = 0;
     }
-#endif
-    term_init();
+    if (mux_queue_init(job, threaded) < 0)
+        goto fail_nomem;
 
     stream_no_data = 0;
-    key = -1;
 
-    for(; received_sigterm == 0;) {
+    for(; job->received_sigterm == 0 && !job->error;) {
         int file_index, ist_index;
         AVPacket pkt;
         double ipts_min;
@@ -1701,15 +2123,6 @@ static int av_encode(AVFormatContext **output_files,
     redo:
         ipts_min= 1e100;
         opts_min= 1e100;
-        /* if 'q' pressed, exits */
-        if (!using_stdin) {
-            if (q_pressed)
-                break;
-            /* read_key() returns 0 on EOF */
-            key = read_key();
-            if (key == 'q')
-                break;
-        }
 
         /* select the stream that we must read now by looking at the
            smallest output pts */
@@ -1717,24 +2130,27 @@ static int av_encode(AVFormatContext **output_files,
         for(i=0;i<nb_ostreams;i++) {
             double ipts, opts;
             ost = ost_table[i];
-            os = output_files[ost->file_index];
+            os = job->output_files[ost->file_index];
             ist = ist_table[ost->source_index];
+            /* st->pts belongs to the mux thread, use what was queued so far */
             if(ost->st->codec->codec_type == CODEC_TYPE_VIDEO)
                 opts = ost->sync_opts * av_q2d(ost->st->codec->time_base);
+            else if(ost->encoding_needed && ost->st->codec->codec_type == CODEC_TYPE_AUDIO)
+                opts = (double)ost->sync_opts / ost->st->codec->sample_rate;
             else
-                opts = ost->st->pts.val * av_q2d(ost->st->time_base);
+                opts = ost->queued_dts * av_q2d(ost->st->time_base);
             ipts = (double)ist->pts;
             if (!file_table[ist->file_index].eof_reached){
                 if(ipts < ipts_min) {
                     ipts_min = ipts;
-                    if(input_sync ) file_index = ist->file_index;
+                    if(job->input_sync ) file_index = ist->file_index;
                 }
                 if(opts < opts_min) {
                     opts_min = opts;
-                    if(!input_sync) file_index = ist->file_index;
+                    if(!job->input_sync) file_index = ist->file_index;
                 }
             }
-            if(ost->frame_number >= max_frames[ost->st->codec->codec_type]){
+            if(ost->frame_number >= job->max_frames[ost->st->codec->codec_type]){
                 file_index= -1;
                 break;
             }
@@ -1745,18 +2161,18 @@ static int av_encode(AVFormatContext **output_files,
         }
 
         /* finish if recording time exhausted */
-        if (recording_time > 0 && opts_min >= (recording_time / 1000000.0))
+        if (job->recording_time > 0 && opts_min >= (job->recording_time / 1000000.0))
             break;
 
         /* finish if limit size exhausted */
-        if (limit_filesize != 0 && (limit_filesize * 1024) < url_ftell(&output_files[0]->pb))
+        if (job->limit_filesize != 0 && (job->limit_filesize * 1024) < mux_queue_out_size(job))
             break;
 
         /* read a frame from it and output it in the fifo */
-        is = input_files[file_index];
+        is = job->input_files[file_index];
         if (av_read_frame(is, &pkt) < 0) {
             file_table[file_index].eof_reached = 1;
-            if (opt_shortest) break; else continue; //
+            if (job->opt_shortest) break; else continue; //
         }
 
         if (!pkt.size) {
@@ -1764,8 +2180,8 @@ static int av_encode(AVFormatContext **output_files,
         } else {
             stream_no_data = 0;
         }
-        if (do_pkt_dump) {
-            av_pkt_dump(stdout, &pkt, do_hex_dump);
+        if (job->do_pkt_dump) {
+            av_pkt_dump(stdout, &pkt, job->do_hex_dump);
         }
         /* the following test is needed in case new streams appear
            dynamically in stream : we ignore them */
@@ -1776,13 +2192,13 @@ static int av_encode(AVFormatContext **output_files,
         if (ist->discard)
             goto discard_packet;
 
-//        fprintf(stderr, "next:%lld dts:%lld off:%lld %d\n", ist->next_pts, pkt.dts, input_files_ts_offset[ist->file_index], ist->st->codec->codec_type);
+//        fprintf(stderr, "next:%lld dts:%lld off:%lld %d\n", ist->next_pts, pkt.dts, job->input_files_ts_offset[ist->file_index], ist->st->codec->codec_type);
         if (pkt.dts != AV_NOPTS_VALUE && ist->next_pts != AV_NOPTS_VALUE) {
             int64_t delta= av_rescale_q(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q) - ist->next_pts;
-            if(ABS(delta) > 1LL*dts_delta_threshold*AV_TIME_BASE && !copy_ts){
-                input_files_ts_offset[ist->file_index]-= delta;
-                if (verbose > 2)
-                    fprintf(stderr, "timestamp discontinuity %"PRId64", new offset= %"PRId64"\n", delta, input_files_ts_offset[ist->file_index]);
+            if(ABS(delta) > 1LL*job->dts_delta_threshold*AV_TIME_BASE && !job->copy_ts){
+                job->input_files_ts_offset[ist->file_index]-= delta;
+                if (job->verbose > 2)
+                    fprintf(stderr, "timestamp discontinuity %"PRId64", new offset= %"PRId64"\n", delta, job->input_files_ts_offset[ist->file_index]);
                 for(i=0; i<file_table[file_index].nb_streams; i++){
                     int index= file_table[file_index].ist_index + i;
                     ist_table[index]->next_pts += delta;
@@ -1792,9 +2208,9 @@ static int av_encode(AVFormatContext **output_files,
         }
 
         //fprintf(stderr,"read #%d.%d size=%d\n", ist->file_index, ist->index, pkt.size);
-        if (output_packet(ist, ist_index, ost_table, nb_ostreams, &pkt) < 0) {
+        if (output_packet(job, ist, ist_index, ost_table, nb_ostreams, &pkt) < 0) {
 
-            if (verbose >= 0)
+            if (job->verbose >= 0)
                 fprintf(stderr, "Error while decoding stream #%d.%d\n",
                         ist->file_index, ist->index);
 
@@ -1806,50 +2222,63 @@ static int av_encode(AVFormatContext **output_files,
         av_free_packet(&pkt);
 
         /* dump report by using the output first video and audio streams */
-        print_report(output_files, ost_table, nb_ostreams, 0);
+        print_report(job, ost_table, nb_ostreams, 0);
     }
 
     /* at the end of stream, we must flush the decoder buffers */
-    for(i=0;i<nb_istreams;i++) {
+    for(i=0;i<nb_istreams && !job->error;i++) {
         ist = ist_table[i];
         if (ist->decoding_needed) {
-            output_packet(ist, i, ost_table, nb_ostreams, NULL);
+            output_packet(job, ist, i, ost_table, nb_ostreams, NULL);
         }
     }
-
-    term_exit();
+    mux_queue_finish(job);
+    if (job->error) {
+        ret = job->error;
+        goto fail;
+    }
 
     /* write the trailer if needed and close file */
-    for(i=0;i<nb_output_files;i++) {
-        os = output_files[i];
+    for(i=0;i<job->nb_output_files;i++) {
+        os = job->output_files[i];
         av_write_trailer(os);
     }
 
     /* dump report by using the first video and audio streams */
-    print_report(output_files, ost_table, nb_ostreams, 1);
+    print_report(job, ost_table, nb_ostreams, 1);
+    if (job->verbose > 1) {
+        fprintf(stderr, "video pictures: %"PRId64"kB written\n", job->picture_write_size / 1024);
+        fprintf(stderr, "buffers: %d requests, %d allocations\n",
+                job->buffer_requests, job->buffer_allocs);
+    }
 
+    /* finished ! */
+
+    ret = 0;
+ fail:
     /* close each encoder */
-    for(i=0;i<nb_ostreams;i++) {
+    for(i=0;ost_table && i<nb_ostreams;i++) {
         ost = ost_table[i];
-        if (ost->encoding_needed) {
+        if (ost && ost->opened) {
             av_freep(&ost->st->codec->stats_in);
+            ffmpeg_lock();
             avcodec_close(ost->st->codec);
+            ffmpeg_unlock();
         }
     }
 
     /* close each decoder */
-    for(i=0;i<nb_istreams;i++) {
+    for(i=0;ist_table && i<nb_istreams;i++) {
         ist = ist_table[i];
-        if (ist->decoding_needed) {
+        if (ist && ist->opened) {
+            ffmpeg_lock();
             avcodec_close(ist->st->codec);
+            ffmpeg_unlock();
         }
     }
 
-    /* finished ! */
-
-    ret = 0;
- fail1:
-    av_freep(&bit_buffer);
+    mux_queue_free(job);
+    av_freep(&job->bit_buffer);
     av_free(file_table);
 
     if (ist_table) {
@@ -1867,12 +2296,15 @@ static int av_encode(AVFormatContext **output_files,
                     fclose(ost->logfile);
                     ost->logfile = NULL;
                 }
-                av_fifo_free(&ost->fifo); /* works even if fifo is not
-                                             initialized but set to zero */
-                av_free(ost->pict_tmp.data[0]);
-                if (ost->video_resample)
+                audio_ring_free(&ost->fifo); /* works even if fifo is not
+                                                initialized but set to zero */
+                if (ost->fast_resample_ctx)
+                    yuv_scale_free(ost->fast_resample_ctx);
+                else if (ost->video_resample)
                     sws_freeContext(ost->img_resample_ctx);
-                if (ost->audio_resample)
+                if (ost->audio_mix)
+                    audio_mix_free(ost->audio_mix);
+                else if (ost->audio_resample)
                     audio_resample_close(ost->resample);
                 av_free(ost);
             }
@@ -1880,9 +2312,9 @@ static int av_encode(AVFormatContext **output_files,
         av_free(ost_table);
     }
     return ret;
- fail:
+ fail_nomem:
     ret = -ENOMEM;
-    goto fail1;
+    goto fail;
 }
 
 #if 0
@@ -1907,7 +2339,7 @@ int file_read(const char *filename)
 }
 #endif
 
-static void opt_image_format(const char *arg)
+static void opt_image_format(FFmpegJob *job, const char *arg)
 {
     AVImageFormat *f;
 
@@ -1917,138 +2349,155 @@ static void opt_image_format(const char *arg)
     }
     if (!f) {
         fprintf(stderr, "Unknown image format: '%s'\n", arg);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    image_format = f;
+    job->image_format = f;
 }
 
-static void opt_format(const char *arg)
+static void opt_format(FFmpegJob *job, const char *arg)
 {
     /* compatibility stuff for pgmyuv */
     if (!strcmp(arg, "pgmyuv")) {
-        pgmyuv_compatibility_hack=1;
-//        opt_image_format(arg);
+        job->pgmyuv_compatibility_hack=1;
+//        opt_image_format(job, arg);
         arg = "image2";
     }
 
-    file_iformat = av_find_input_format(arg);
-    file_oformat = guess_format(arg, NULL, NULL);
-    if (!file_iformat && !file_oformat) {
+    job->file_iformat = av_find_input_format(arg);
+    job->file_oformat = guess_format(arg, NULL, NULL);
+    if (!job->file_iformat && !job->file_oformat) {
         fprintf(stderr, "Unknown input or output format: %s\n", arg);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
-static void opt_video_rc_eq(char *arg)
+static void opt_video_rc_eq(FFmpegJob *job, char *arg)
 {
-    video_rc_eq = arg;
+    job->video_rc_eq = arg;
 }
 
-static void opt_video_rc_override_string(char *arg)
+static void opt_video_rc_override_string(FFmpegJob *job, char *arg)
 {
-    video_rc_override_string = arg;
+    job->video_rc_override_string = arg;
 }
 
-static void opt_me_threshold(const char *arg)
+static void opt_me_threshold(FFmpegJob *job, const char *arg)
 {
-    me_threshold = atoi(arg);
+    job->me_threshold = atoi(arg);
 }
 
-static void opt_verbose(const char *arg)
+static void opt_verbose(FFmpegJob *job, const char *arg)
 {
-    verbose = atoi(arg);
+    job->verbose = atoi(arg);
     av_log_set_level(atoi(arg));
 }
 
-static void opt_frame_rate(const char *arg)
+static void opt_frame_rate(FFmpegJob *job, const char *arg)
 {
-    if (parse_frame_rate(&frame_rate, &frame_rate_base, arg) < 0) {
+    if (parse_frame_rate(&job->frame_rate, &job->frame_rate_base, arg) < 0) {
         fprintf(stderr, "Incorrect frame rate\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
-static void opt_frame_crop_top(const char *arg)
+static void opt_frame_crop_top(FFmpegJob *job, const char *arg)
 {
-    frame_topBand = atoi(arg);
-    if (frame_topBand < 0) {
+    job->frame_topBand = atoi(arg);
+    if (job->frame_topBand < 0) {
         fprintf(stderr, "Incorrect top crop size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_topBand % 2) != 0) {
+    if ((job->frame_topBand % 2) != 0) {
         fprintf(stderr, "Top crop size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_topBand) >= frame_height){
+    if ((job->frame_topBand) >= job->frame_height){
         fprintf(stderr, "Vertical crop dimensions are outside the range of the original image.\nRemember to crop first and scale second.\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    frame_height -= frame_topBand;
+    job->frame_height -= job->frame_topBand;
 }
 
-static void opt_frame_crop_bottom(const char *arg)
+static void opt_frame_crop_bottom(FFmpegJob *job, const char *arg)
 {
-    frame_bottomBand = atoi(arg);
-    if (frame_bottomBand < 0) {
+    job->frame_bottomBand = atoi(arg);
+    if (job->frame_bottomBand < 0) {
         fprintf(stderr, "Incorrect bottom crop size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_bottomBand % 2) != 0) {
+    if ((job->frame_bottomBand % 2) != 0) {
         fprintf(stderr, "Bottom crop size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_bottomBand) >= frame_height){
+    if ((job->frame_bottomBand) >= job->frame_height){
         fprintf(stderr, "Vertical crop dimensions are outside the range of the original image.\nRemember to crop first and scale second.\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    frame_height -= frame_bottomBand;
+    job->frame_height -= job->frame_bottomBand;
 }
 
-static void opt_frame_crop_left(const char *arg)
+static void opt_frame_crop_left(FFmpegJob *job, const char *arg)
 {
-    frame_leftBand = atoi(arg);
-    if (frame_leftBand < 0) {
+    job->frame_leftBand = atoi(arg);
+    if (job->frame_leftBand < 0) {
         fprintf(stderr, "Incorrect left crop size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_leftBand % 2) != 0) {
+    if ((job->frame_leftBand % 2) != 0) {
         fprintf(stderr, "Left crop size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_leftBand) >= frame_width){
+    if ((job->frame_leftBand) >= job->frame_width){
         fprintf(stderr, "Horizontal crop dimensions are outside the range of the original image.\nRemember to crop first and scale second.\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    frame_width -= frame_leftBand;
+    job->frame_width -= job->frame_leftBand;
 }
 
-static void opt_frame_crop_right(const char *arg)
+static void opt_frame_crop_right(FFmpegJob *job, const char *arg)
 {
-    frame_rightBand = atoi(arg);
-    if (frame_rightBand < 0) {
+    job->frame_rightBand = atoi(arg);
+    if (job->frame_rightBand < 0) {
         fprintf(stderr, "Incorrect right crop size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_rightBand % 2) != 0) {
+    if ((job->frame_rightBand % 2) != 0) {
         fprintf(stderr, "Right crop size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_rightBand) >= frame_width){
+    if ((job->frame_rightBand) >= job->frame_width){
         fprintf(stderr, "Horizontal crop dimensions are outside the range of the original image.\nRemember to crop first and scale second.\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    frame_width -= frame_rightBand;
+    job->frame_width -= job->frame_rightBand;
 }
 
-static void opt_frame_size(const char *arg)
+static void opt_frame_size(FFmpegJob *job, const char *arg)
 {
-    if (parse_image_size(&frame_width, &frame_height, arg) < 0) {
+    if (parse_image_size(&job->frame_width, &job->frame_height, arg) < 0) {
         fprintf(stderr, "Incorrect frame size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_width % 2) != 0 || (frame_height % 2) != 0) {
+    if ((job->frame_width % 2) != 0 || (job->frame_height % 2) != 0) {
         fprintf(stderr, "Frame size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
@@ -2069,7 +2518,7 @@ static void opt_frame_size(const char *arg)
 (((FIX(0.50000) * r1 - FIX(0.41869) * g1 -           \
    FIX(0.08131) * b1 + (ONE_HALF << shift) - 1) >> (SCALEBITS + shift)) + 128)
 
-static void opt_pad_color(const char *arg) {
+static void opt_pad_color(FFmpegJob *job, const char *arg) {
     /* Input is expected to be six hex digits similar to
        how colors are expressed in html tags (but without the #) */
     int rgb = strtol(arg, NULL, 16);
@@ -2079,72 +2528,80 @@ static void opt_pad_color(const char *arg) {
     g = ((rgb >> 8) & 255);
     b = (rgb & 255);
 
-    padcolor[0] = RGB_TO_Y(r,g,b);
-    padcolor[1] = RGB_TO_U(r,g,b,0);
-    padcolor[2] = RGB_TO_V(r,g,b,0);
+    job->padcolor[0] = RGB_TO_Y(r,g,b);
+    job->padcolor[1] = RGB_TO_U(r,g,b,0);
+    job->padcolor[2] = RGB_TO_V(r,g,b,0);
 }
 
-static void opt_frame_pad_top(const char *arg)
+static void opt_frame_pad_top(FFmpegJob *job, const char *arg)
 {
-    frame_padtop = atoi(arg);
-    if (frame_padtop < 0) {
+    job->frame_padtop = atoi(arg);
+    if (job->frame_padtop < 0) {
         fprintf(stderr, "Incorrect top pad size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_padtop % 2) != 0) {
+    if ((job->frame_padtop % 2) != 0) {
         fprintf(stderr, "Top pad size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
-static void opt_frame_pad_bottom(const char *arg)
+static void opt_frame_pad_bottom(FFmpegJob *job, const char *arg)
 {
-    frame_padbottom = atoi(arg);
-    if (frame_padbottom < 0) {
+    job->frame_padbottom = atoi(arg);
+    if (job->frame_padbottom < 0) {
         fprintf(stderr, "Incorrect bottom pad size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_padbottom % 2) != 0) {
+    if ((job->frame_padbottom % 2) != 0) {
         fprintf(stderr, "Bottom pad size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
 
-static void opt_frame_pad_left(const char *arg)
+static void opt_frame_pad_left(FFmpegJob *job, const char *arg)
 {
-    frame_padleft = atoi(arg);
-    if (frame_padleft < 0) {
+    job->frame_padleft = atoi(arg);
+    if (job->frame_padleft < 0) {
         fprintf(stderr, "Incorrect left pad size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_padleft % 2) != 0) {
+    if ((job->frame_padleft % 2) != 0) {
         fprintf(stderr, "Left pad size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
 
-static void opt_frame_pad_right(const char *arg)
+static void opt_frame_pad_right(FFmpegJob *job, const char *arg)
 {
-    frame_padright = atoi(arg);
-    if (frame_padright < 0) {
+    job->frame_padright = atoi(arg);
+    if (job->frame_padright < 0) {
         fprintf(stderr, "Incorrect right pad size\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    if ((frame_padright % 2) != 0) {
+    if ((job->frame_padright % 2) != 0) {
         fprintf(stderr, "Right pad size must be a multiple of 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
 
-static void opt_frame_pix_fmt(const char *arg)
+static void opt_frame_pix_fmt(FFmpegJob *job, const char *arg)
 {
-    frame_pix_fmt = avcodec_get_pix_fmt(arg);
+    job->frame_pix_fmt = avcodec_get_pix_fmt(arg);
 }
 
-static void opt_frame_aspect_ratio(const char *arg)
+static void opt_frame_aspect_ratio(FFmpegJob *job, const char *arg)
 {
     int x = 0, y = 0;
     double ar = 0;
@@ -2162,96 +2619,74 @@ static void opt_frame_aspect_ratio(const char *arg)
 
     if (!ar) {
         fprintf(stderr, "Incorrect aspect ratio specification.\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    frame_aspect_ratio = ar;
+    job->frame_aspect_ratio = ar;
 }
 
-static void opt_qscale(const char *arg)
+static void opt_qscale(FFmpegJob *job, const char *arg)
 {
-    video_qscale = atof(arg);
-    if (video_qscale <= 0 ||
-        video_qscale > 255) {
+    job->video_qscale = atof(arg);
+    if (job->video_qscale <= 0 ||
+        job->video_qscale > 255) {
         fprintf(stderr, "qscale must be > 0.0 and <= 255\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
-static void opt_qdiff(const char *arg)
+static void opt_qdiff(FFmpegJob *job, const char *arg)
 {
-    video_qdiff = atoi(arg);
-    if (video_qdiff < 0 ||
-        video_qdiff > 31) {
+    job->video_qdiff = atoi(arg);
+    if (job->video_qdiff < 0 ||
+        job->video_qdiff > 31) {
         fprintf(stderr, "qdiff must be >= 1 and <= 31\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
-static void opt_packet_size(const char *arg)
+static void opt_packet_size(FFmpegJob *job, const char *arg)
 {
-    packet_size= atoi(arg);
+    job->packet_size= atoi(arg);
 }
 
-static void opt_strict(const char *arg)
+static void opt_strict(FFmpegJob *job, const char *arg)
 {
-    strict= atoi(arg);
+    job->strict= atoi(arg);
 }
 
-static void opt_top_field_first(const char *arg)
+static void opt_top_field_first(FFmpegJob *job, const char *arg)
 {
-    top_field_first= atoi(arg);
+    job->top_field_first= atoi(arg);
 }
 
-static void opt_thread_count(const char *arg)
+static void opt_thread_count(FFmpegJob *job, const char *arg)
 {
-    thread_count= atoi(arg);
+    job->thread_count= atoi(arg);
 #if !defined(HAVE_THREADS)
-    if (verbose >= 0)
+    if (job->verbose >= 0)
         fprintf(stderr, "Warning: not compiled with thread support, using thread emulation\n");
 #endif
 }
 
-static void opt_audio_bitrate(const char *arg)
-{
-    audio_bit_rate = atoi(arg) * 1000;
-}
-
-static void opt_audio_rate(const char *arg)
+static void opt_audio_bitrate(FFmpegJob *job, const char *arg)
 {
-    audio_sample_rate = atoi(arg);
+    job->audio_bit_rate = atoi(arg) * 1000;
 }
 
-static void opt_audio_channels(const char *arg)
+static void opt_audio_rate(FFmpegJob *job, const char *arg)
 {
-    audio_channels = atoi(arg);
+    job->audio_sample_rate = atoi(arg);
 }
 
-static void opt_video_device(const char *arg)
+static void opt_audio_channels(FFmpegJob *job, const char *arg)
 {
-    video_device = av_strdup(arg);
+    job->audio_channels = atoi(arg);
 }
 
-static void opt_grab_device(const char *arg)
-{
-    grab_device = av_strdup(arg);
-}
-
-static void opt_video_channel(const char *arg)
-{
-    video_channel = strtol(arg, NULL, 0);
-}
-
-static void opt_video_standard(const char *arg)
-{
-    video_standard = av_strdup(arg);
-}
-
-static void opt_audio_device(const char *arg)
-{
-    audio_device = av_strdup(arg);
-}
-
-static void opt_codec(int *pstream_copy, int *pcodec_id,
+static void opt_codec(FFmpegJob *job, int *pstream_copy, int *pcodec_id,
                       int codec_type, const char *arg)
 {
     AVCodec *p;
@@ -2267,44 +2702,45 @@ static void opt_codec(int *pstream_copy, int *pcodec_id,
         }
         if (p == NULL) {
             fprintf(stderr, "Unknown codec '%s'\n", arg);
-            exit(1);
+            job_fail(job, -EINVAL);
+            return;
         } else {
             *pcodec_id = p->id;
         }
     }
 }
 
-static void opt_audio_codec(const char *arg)
+static void opt_audio_codec(FFmpegJob *job, const char *arg)
 {
-    opt_codec(&audio_stream_copy, &audio_codec_id, CODEC_TYPE_AUDIO, arg);
+    opt_codec(job, &job->audio_stream_copy, &job->audio_codec_id, CODEC_TYPE_AUDIO, arg);
 }
 
-static void opt_audio_tag(const char *arg)
+static void opt_audio_tag(FFmpegJob *job, const char *arg)
 {
     char *tail;
-    audio_codec_tag= strtol(arg, &tail, 0);
+    job->audio_codec_tag= strtol(arg, &tail, 0);
 
     if(!tail || *tail)
-        audio_codec_tag= arg[0] + (arg[1]<<8) + (arg[2]<<16) + (arg[3]<<24);
+        job->audio_codec_tag= arg[0] + (arg[1]<<8) + (arg[2]<<16) + (arg[3]<<24);
 }
 
-static void opt_video_tag(const char *arg)
+static void opt_video_tag(FFmpegJob *job, const char *arg)
 {
     char *tail;
-    video_codec_tag= strtol(arg, &tail, 0);
+    job->video_codec_tag= strtol(arg, &tail, 0);
 
     if(!tail || *tail)
-        video_codec_tag= arg[0] + (arg[1]<<8) + (arg[2]<<16) + (arg[3]<<24);
+        job->video_codec_tag= arg[0] + (arg[1]<<8) + (arg[2]<<16) + (arg[3]<<24);
 }
 
-static void add_frame_hooker(const char *arg)
+static void add_frame_hooker(FFmpegJob *job, const char *arg)
 {
     int argc = 0;
     char *argv[64];
     int i;
     char *args = av_strdup(arg);
 
-    using_vhook = 1;
+    job->using_vhook = 1;
 
     argv[0] = strtok(args, " ");
     while (argc < 62 && (argv[++argc] = strtok(NULL, " "))) {
@@ -2314,7 +2750,8 @@ static void add_frame_hooker(const char *arg)
 
     if (i != 0) {
         fprintf(stderr, "Failed to add video hook function: %s\n", arg);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
@@ -2331,39 +2768,40 @@ const char *motion_str[] = {
     NULL,
 };
 
-static void opt_motion_estimation(const char *arg)
+static void opt_motion_estimation(FFmpegJob *job, const char *arg)
 {
     const char **p;
     p = motion_str;
     for(;;) {
         if (!*p) {
             fprintf(stderr, "Unknown motion estimation method '%s'\n", arg);
-            exit(1);
+            job_fail(job, -EINVAL);
+            return;
         }
         if (!strcmp(*p, arg))
             break;
         p++;
     }
-    me_method = (p - motion_str) + 1;
+    job->me_method = (p - motion_str) + 1;
 }
 
-static void opt_video_codec(const char *arg)
+static void opt_video_codec(FFmpegJob *job, const char *arg)
 {
-    opt_codec(&video_stream_copy, &video_codec_id, CODEC_TYPE_VIDEO, arg);
+    opt_codec(job, &job->video_stream_copy, &job->video_codec_id, CODEC_TYPE_VIDEO, arg);
 }
 
-static void opt_subtitle_codec(const char *arg)
+static void opt_subtitle_codec(FFmpegJob *job, const char *arg)
 {
-    opt_codec(&subtitle_stream_copy, &subtitle_codec_id, CODEC_TYPE_SUBTITLE, arg);
+    opt_codec(job, &job->subtitle_stream_copy, &job->subtitle_codec_id, CODEC_TYPE_SUBTITLE, arg);
 }
 
-static void opt_map(const char *arg)
+static void opt_map(FFmpegJob *job, const char *arg)
 {
     AVStreamMap *m;
     const char *p;
 
     p = arg;
-    m = &stream_maps[nb_stream_maps++];
+    m = &job->stream_maps[job->nb_stream_maps++];
 
     m->file_index = strtol(arg, (char **)&p, 0);
     if (*p)
@@ -2382,13 +2820,13 @@ static void opt_map(const char *arg)
     }
 }
 
-static void opt_map_meta_data(const char *arg)
+static void opt_map_meta_data(FFmpegJob *job, const char *arg)
 {
     AVMetaDataMap *m;
     const char *p;
 
     p = arg;
-    m = &meta_data_maps[nb_meta_data_maps++];
+    m = &job->meta_data_maps[job->nb_meta_data_maps++];
 
     m->out_file = strtol(arg, (char **)&p, 0);
     if (*p)
@@ -2397,37 +2835,39 @@ static void opt_map_meta_data(const char *arg)
     m->in_file = strtol(p, (char **)&p, 0);
 }
 
-static void opt_recording_time(const char *arg)
+static void opt_recording_time(FFmpegJob *job, const char *arg)
 {
-    recording_time = parse_date(arg, 1);
+    job->recording_time = parse_date(arg, 1);
 }
 
-static void opt_start_time(const char *arg)
+static void opt_start_time(FFmpegJob *job, const char *arg)
 {
-    start_time = parse_date(arg, 1);
+    job->start_time = parse_date(arg, 1);
 }
 
-static void opt_rec_timestamp(const char *arg)
+static void opt_rec_timestamp(FFmpegJob *job, const char *arg)
 {
-    rec_timestamp = parse_date(arg, 0) / 1000000;
+    job->rec_timestamp = parse_date(arg, 0) / 1000000;
 }
 
-static void opt_input_ts_offset(const char *arg)
+static void opt_input_ts_offset(FFmpegJob *job, const char *arg)
 {
-    input_ts_offset = parse_date(arg, 1);
+    job->input_ts_offset = parse_date(arg, 1);
 }
 
-static void opt_input_file(const char *filename)
+static void opt_input_file(FFmpegJob *job, const char *filename)
 {
     AVFormatContext *ic;
     AVFormatParameters params, *ap = &params;
     int err, i, ret, rfps, rfps_base;
     int64_t timestamp;
+    char prefetch_name[1024];
+    const char *open_name = filename;
 
     if (!strcmp(filename, "-"))
         filename = "pipe:";
 
-    using_stdin |= !strncmp(filename, "pipe:", 5) ||
+    job->using_stdin |= !strncmp(filename, "pipe:", 5) ||
                    !strcmp( filename, "/dev/stdin" );
 
     /* get default parameters from command line */
@@ -2435,119 +2875,141 @@ static void opt_input_file(const char *filename)
 
     memset(ap, 0, sizeof(*ap));
     ap->prealloced_context = 1;
-    ap->sample_rate = audio_sample_rate;
-    ap->channels = audio_channels;
-    ap->time_base.den = frame_rate;
-    ap->time_base.num = frame_rate_base;
-    ap->width = frame_width + frame_padleft + frame_padright;
-    ap->height = frame_height + frame_padtop + frame_padbottom;
-    ap->image_format = image_format;
-    ap->pix_fmt = frame_pix_fmt;
-    ap->device  = grab_device;
-    ap->channel = video_channel;
-    ap->standard = video_standard;
-    ap->video_codec_id = video_codec_id;
-    ap->audio_codec_id = audio_codec_id;
-    if(pgmyuv_compatibility_hack)
+    ap->sample_rate = job->audio_sample_rate;
+    ap->channels = job->audio_channels;
+    ap->time_base.den = job->frame_rate;
+    ap->time_base.num = job->frame_rate_base;
+    ap->width = job->frame_width + job->frame_padleft + job->frame_padright;
+    ap->height = job->frame_height + job->frame_padtop + job->frame_padbottom;
+    ap->image_format = job->image_format;
+    ap->pix_fmt = job->frame_pix_fmt;
+    ap->video_codec_id = job->video_codec_id;
+    ap->audio_codec_id = job->audio_codec_id;
+    if(job->pgmyuv_compatibility_hack)
         ap->video_codec_id= CODEC_ID_PGMYUV;
 
-    for(i=0; i<opt_name_count; i++){
+    for(i=0; i<job->opt_name_count; i++){
         AVOption *opt;
-        double d= av_get_double(avformat_opts, opt_names[i], &opt);
+        double d= av_get_double(job->avformat_opts, job->opt_names[i], &opt);
         if(d==d && (opt->flags&AV_OPT_FLAG_DECODING_PARAM))
-            av_set_double(ic, opt_names[i], d);
+            av_set_double(ic, job->opt_names[i], d);
+    }
+    /* plain files are read through one of the prefetch protocols */
+    if (job->input_prefetch != FFMPEG_PREFETCH_NONE && !strchr(filename, ':')) {
+        snprintf(prefetch_name, sizeof(prefetch_name), "%s:%d:%s",
+                 job->input_prefetch == FFMPEG_PREFETCH_MMAP ? "mmap" : "readahead",
+                 job->prefetch_window / 1024, filename);
+        open_name = prefetch_name;
     }
+
     /* open the input file with generic libav function */
-    err = av_open_input_file(&ic, filename, file_iformat, 0, ap);
+    ffmpeg_lock();
+    err = av_open_input_file(&ic, open_name, job->file_iformat, 0, ap);
     if (err < 0) {
+        ffmpeg_unlock();
         //print_error(filename, err);
-        //exit(1);
+        fprintf(stderr, "%s: could not open input\n", filename);
+        job_fail(job, err);
         return;
     }
 
-    ic->loop_input = loop_input;
+    ic->loop_input = job->loop_input;
 
     /* If not enough info to get the stream parameters, we decode the
        first frames to get it. (used in mpeg case for example) */
     ret = av_find_stream_info(ic);
-    if (ret < 0 && verbose >= 0) {
+    if (ret < 0 && job->verbose >= 0) {
+        av_close_input_file(ic);
+        ffmpeg_unlock();
         fprintf(stderr, "%s: could not find codec parameters\n", filename);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
+    ffmpeg_unlock();
 
-    timestamp = start_time;
+    timestamp = job->start_time;
     /* add the stream start time */
     if (ic->start_time != AV_NOPTS_VALUE)
         timestamp += ic->start_time;
 
     /* if seeking requested, we execute it */
-    if (start_time != 0) {
+    if (job->start_time != 0) {
         ret = av_seek_frame(ic, -1, timestamp, AVSEEK_FLAG_BACKWARD);
         if (ret < 0) {
             fprintf(stderr, "%s: could not seek to position %0.3f\n",
                     filename, (double)timestamp / AV_TIME_BASE);
         }
         /* reset seek info */
-        start_time = 0;
+        job->start_time = 0;
     }
 
     /* update the current parameters so that they match the one of the input stream */
     for(i=0;i<ic->nb_streams;i++) {
         int j;
         AVCodecContext *enc = ic->streams[i]->codec;
+        /* only video decoders make use of extra threads */
+        if(enc->codec_type == CODEC_TYPE_VIDEO) {
 #if defined(HAVE_THREADS)
-        if(thread_count>1)
-            avcodec_thread_init(enc, thread_count);
+            if(job->thread_count>1)
+                avcodec_thread_init(enc, job->thread_count);
 #endif
-        enc->thread_count= thread_count;
+            enc->thread_count= job->thread_count;
+        }
         switch(enc->codec_type) {
         case CODEC_TYPE_AUDIO:
-            for(j=0; j<opt_name_count; j++){
+            for(j=0; j<job->opt_name_count; j++){
                 AVOption *opt;
-                double d= av_get_double(avctx_opts, opt_names[j], &opt);
+                double d= av_get_double(job->avctx_opts, job->opt_names[j], &opt);
                 if(d==d && (opt->flags&AV_OPT_FLAG_AUDIO_PARAM) && (opt->flags&AV_OPT_FLAG_DECODING_PARAM))
-                    av_set_double(enc, opt_names[j], d);
+                    av_set_double(enc, job->opt_names[j], d);
             }
             //fprintf(stderr, "\nInput Audio channels: %d", enc->channels);
-            audio_channels = enc->channels;
-            audio_sample_rate = enc->sample_rate;
-            if(audio_disable)
+            job->audio_channels = enc->channels;
+            job->audio_sample_rate = enc->sample_rate;
+            if(job->audio_disable)
                 ic->streams[i]->discard= AVDISCARD_ALL;
             break;
         case CODEC_TYPE_VIDEO:
-            for(j=0; j<opt_name_count; j++){
+            for(j=0; j<job->opt_name_count; j++){
                 AVOption *opt;
-                double d= av_get_double(avctx_opts, opt_names[j], &opt);
+                double d= av_get_double(job->avctx_opts, job->opt_names[j], &opt);
                 if(d==d && (opt->flags&AV_OPT_FLAG_VIDEO_PARAM) && (opt->flags&AV_OPT_FLAG_DECODING_PARAM))
-                    av_set_double(enc, opt_names[j], d);
+                    av_set_double(enc, job->opt_names[j], d);
             }
-            frame_height = enc->height;
-            frame_width = enc->width;
-            frame_aspect_ratio = av_q2d(enc->sample_aspect_ratio) * enc->width / enc->height;
-            frame_pix_fmt = enc->pix_fmt;
+            job->frame_height = enc->height;
+            job->frame_width = enc->width;
+            job->frame_aspect_ratio = av_q2d(enc->sample_aspect_ratio) * enc->width / enc->height;
+            job->frame_pix_fmt = enc->pix_fmt;
             rfps      = ic->streams[i]->r_frame_rate.num;
             rfps_base = ic->streams[i]->r_frame_rate.den;
+            if(job->decode_lowres && !job->video_stream_copy && !job->frame_topBand &&
+               !job->frame_bottomBand && !job->frame_leftBand && !job->frame_rightBand) {
+                int lowres = ffmpeg_set_decode_scale(enc, job->lowres_width, job->lowres_height);
+                if (lowres && job->verbose >= 0)
+                    fprintf(stderr, "\nDecoding stream %d at 1/%d size: %dx%d\n",
+                            i, 1 << lowres, enc->width, enc->height);
+            }
             if(enc->lowres) enc->flags |= CODEC_FLAG_EMU_EDGE;
-            if(me_threshold)
+            if(job->me_threshold)
                 enc->debug |= FF_DEBUG_MV;
 
             if (enc->time_base.den != rfps || enc->time_base.num != rfps_base) {
 
-                if (verbose >= 0)
+                if (job->verbose >= 0)
                     fprintf(stderr,"\nSeems that stream %d comes from film source: %2.2f (%d/%d) -> %2.2f (%d/%d)\n",
                             i, (float)enc->time_base.den / enc->time_base.num, enc->time_base.den, enc->time_base.num,
 
                     (float)rfps / rfps_base, rfps, rfps_base);
             }
             /* update the current frame rate to match the stream frame rate */
-            frame_rate      = rfps;
-            frame_rate_base = rfps_base;
+            job->frame_rate      = rfps;
+            job->frame_rate_base = rfps_base;
 
-            enc->rate_emu = rate_emu;
-            if(video_disable)
+            enc->rate_emu = job->rate_emu;
+            if(job->video_disable)
                 ic->streams[i]->discard= AVDISCARD_ALL;
-            else if(video_discard)
-                ic->streams[i]->discard= video_discard;
+            else if(job->video_discard)
+                ic->streams[i]->discard= job->video_discard;
             break;
         case CODEC_TYPE_DATA:
             break;
@@ -2560,38 +3022,29 @@ static void opt_input_file(const char *filename)
         }
     }
 
-    input_files[nb_input_files] = ic;
-    input_files_ts_offset[nb_input_files] = input_ts_offset - (copy_ts ? 0 : timestamp);
+    job->input_files[job->nb_input_files] = ic;
+    job->input_files_ts_offset[job->nb_input_files] = job->input_ts_offset - (job->copy_ts ? 0 : timestamp);
     /* dump the file content */
-    if (verbose >= 0)
-        dump_format(ic, nb_input_files, filename, 0);
-
-    nb_input_files++;
-    file_iformat = NULL;
-    file_oformat = NULL;
-    image_format = NULL;
+    if (job->verbose >= 0)
+        dump_format(ic, job->nb_input_files, filename, 0);
 
-    grab_device = NULL;
-    video_channel = 0;
+    job->nb_input_files++;
+    job->file_iformat = NULL;
+    job->file_oformat = NULL;
+    job->image_format = NULL;
 
-    rate_emu = 0;
+    job->rate_emu = 0;
 }
 
-static void opt_grab(const char *arg)
-{
-    file_iformat = av_find_input_format(arg);
-    opt_input_file("");
-}
-
-static void check_audio_video_inputs(int *has_video_ptr, int *has_audio_ptr)
+static void check_audio_video_inputs(FFmpegJob *job, int *has_video_ptr, int *has_audio_ptr)
 {
     int has_video, has_audio, i, j;
     AVFormatContext *ic;
 
     has_video = 0;
     has_audio = 0;
-    for(j=0;j<nb_input_files;j++) {
-        ic = input_files[j];
+    for(j=0;j<job->nb_input_files;j++) {
+        ic = job->input_files[j];
         for(i=0;i<ic->nb_streams;i++) {
             AVCodecContext *enc = ic->streams[i]->codec;
             switch(enc->codec_type) {
@@ -2614,7 +3067,7 @@ static void check_audio_video_inputs(int *has_video_ptr, int *has_audio_ptr)
     *has_audio_ptr = has_audio;
 }
 
-static void new_video_stream(AVFormatContext *oc)
+static void new_video_stream(FFmpegJob *job, AVFormatContext *oc)
 {
     AVStream *st;
     AVCodecContext *video_enc;
@@ -2623,32 +3076,33 @@ static void new_video_stream(AVFormatContext *oc)
     st = av_new_stream(oc, oc->nb_streams);
     if (!st) {
         fprintf(stderr, "Could not alloc stream\n");
-        exit(1);
+        job_fail(job, -ENOMEM);
+        return;
     }
-    bitstream_filters[nb_output_files][oc->nb_streams - 1]= video_bitstream_filters;
-    video_bitstream_filters= NULL;
+    job->bitstream_filters[job->nb_output_files][oc->nb_streams - 1]= job->video_bitstream_filters;
+    job->video_bitstream_filters= NULL;
 
 #if defined(HAVE_THREADS)
-    if(thread_count>1)
-        avcodec_thread_init(st->codec, thread_count);
+    if(job->thread_count>1)
+        avcodec_thread_init(st->codec, job->thread_count);
 #endif
 
     video_enc = st->codec;
 
-    if(video_codec_tag)
-        video_enc->codec_tag= video_codec_tag;
+    if(job->video_codec_tag)
+        video_enc->codec_tag= job->video_codec_tag;
 
-    if(   (video_global_header&1)
-       || (video_global_header==0 && (oc->oformat->flags & AVFMT_GLOBALHEADER))){
+    if(   (job->video_global_header&1)
+       || (job->video_global_header==0 && (oc->oformat->flags & AVFMT_GLOBALHEADER))){
         video_enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
-        avctx_opts->flags|= CODEC_FLAG_GLOBAL_HEADER;
+        job->avctx_opts->flags|= CODEC_FLAG_GLOBAL_HEADER;
     }
-    if(video_global_header&2){
+    if(job->video_global_header&2){
         video_enc->flags2 |= CODEC_FLAG2_LOCAL_HEADER;
-        avctx_opts->flags2|= CODEC_FLAG2_LOCAL_HEADER;
+        job->avctx_opts->flags2|= CODEC_FLAG2_LOCAL_HEADER;
     }
 
-    if (video_stream_copy) {
+    if (job->video_stream_copy) {
         st->stream_copy = 1;
         video_enc->codec_type = CODEC_TYPE_VIDEO;
     } else {
@@ -2657,25 +3111,25 @@ static void new_video_stream(AVFormatContext *oc)
         AVCodec *codec;
 
         codec_id = av_guess_codec(oc->oformat, NULL, oc->filename, NULL, CODEC_TYPE_VIDEO);
-        if (video_codec_id != CODEC_ID_NONE)
-            codec_id = video_codec_id;
+        if (job->video_codec_id != CODEC_ID_NONE)
+            codec_id = job->video_codec_id;
 
         video_enc->codec_id = codec_id;
         codec = avcodec_find_encoder(codec_id);
 
-        for(i=0; i<opt_name_count; i++){
+        for(i=0; i<job->opt_name_count; i++){
              AVOption *opt;
-             double d= av_get_double(avctx_opts, opt_names[i], &opt);
+             double d= av_get_double(job->avctx_opts, job->opt_names[i], &opt);
              if(d==d && (opt->flags&AV_OPT_FLAG_VIDEO_PARAM) && (opt->flags&AV_OPT_FLAG_ENCODING_PARAM))
-                 av_set_double(video_enc, opt_names[i], d);
+                 av_set_double(video_enc, job->opt_names[i], d);
         }
 
-        video_enc->bit_rate = video_bit_rate;
-        video_enc->time_base.den = frame_rate;
-        video_enc->time_base.num = frame_rate_base;
+        video_enc->bit_rate = job->video_bit_rate;
+        video_enc->time_base.den = job->frame_rate;
+        video_enc->time_base.num = job->frame_rate_base;
         if(codec && codec->supported_framerates){
             const AVRational *p= codec->supported_framerates;
-            AVRational req= (AVRational){frame_rate, frame_rate_base};
+            AVRational req= (AVRational){job->frame_rate, job->frame_rate_base};
             const AVRational *best=NULL;
             AVRational best_error= (AVRational){INT_MAX, 1};
             for(; p->den!=0; p++){
@@ -2690,10 +3144,10 @@ static void new_video_stream(AVFormatContext *oc)
             video_enc->time_base.num= best->den;
         }
 
-        video_enc->width = frame_width + frame_padright + frame_padleft;
-        video_enc->height = frame_height + frame_padtop + frame_padbottom;
-        video_enc->sample_aspect_ratio = av_d2q(frame_aspect_ratio*video_enc->height/video_enc->width, 255);
-        video_enc->pix_fmt = frame_pix_fmt;
+        video_enc->width = job->frame_width + job->frame_padright + job->frame_padleft;
+        video_enc->height = job->frame_height + job->frame_padtop + job->frame_padbottom;
+        video_enc->sample_aspect_ratio = av_d2q(job->frame_aspect_ratio*video_enc->height/video_enc->width, 255);
+        video_enc->pix_fmt = job->frame_pix_fmt;
 
         if(codec && codec->pix_fmts){
             const enum PixelFormat *p= codec->pix_fmts;
@@ -2705,29 +3159,30 @@ static void new_video_stream(AVFormatContext *oc)
                 video_enc->pix_fmt = codec->pix_fmts[0];
         }
 
-        if (intra_only)
+        if (job->intra_only)
             video_enc->gop_size = 0;
-        if (video_qscale || same_quality) {
+        if (job->video_qscale || job->same_quality) {
             video_enc->flags |= CODEC_FLAG_QSCALE;
             video_enc->global_quality=
-                st->quality = FF_QP2LAMBDA * video_qscale;
+                st->quality = FF_QP2LAMBDA * job->video_qscale;
         }
 
-        if(intra_matrix)
-            video_enc->intra_matrix = intra_matrix;
-        if(inter_matrix)
-            video_enc->inter_matrix = inter_matrix;
+        if(job->intra_matrix)
+            video_enc->intra_matrix = job->intra_matrix;
+        if(job->inter_matrix)
+            video_enc->inter_matrix = job->inter_matrix;
 
-        video_enc->max_qdiff = video_qdiff;
-        video_enc->rc_eq = video_rc_eq;
-        video_enc->thread_count = thread_count;
-        p= video_rc_override_string;
+        video_enc->max_qdiff = job->video_qdiff;
+        video_enc->rc_eq = job->video_rc_eq;
+        video_enc->thread_count = job->thread_count;
+        p= job->video_rc_override_string;
         for(i=0; p; i++){
             int start, end, q;
             int e=sscanf(p, "%d,%d,%d", &start, &end, &q);
             if(e!=3){
                 fprintf(stderr, "error parsing rc_override\n");
-                exit(1);
+                job_fail(job, -EINVAL);
+                return;
             }
             video_enc->rc_override=
                 av_realloc(video_enc->rc_override,
@@ -2747,23 +3202,23 @@ static void new_video_stream(AVFormatContext *oc)
         }
         video_enc->rc_override_count=i;
         video_enc->rc_initial_buffer_occupancy = video_enc->rc_buffer_size*3/4;
-        video_enc->me_threshold= me_threshold;
-        video_enc->intra_dc_precision= intra_dc_precision - 8;
-        video_enc->strict_std_compliance = strict;
+        video_enc->me_threshold= job->me_threshold;
+        video_enc->intra_dc_precision= job->intra_dc_precision - 8;
+        video_enc->strict_std_compliance = job->strict;
 
-        if(packet_size){
+        if(job->packet_size){
             video_enc->rtp_mode= 1;
-            video_enc->rtp_payload_size= packet_size;
+            video_enc->rtp_payload_size= job->packet_size;
         }
 
-        if (do_psnr)
+        if (job->do_psnr)
             video_enc->flags|= CODEC_FLAG_PSNR;
 
-        video_enc->me_method = me_method;
+        video_enc->me_method = job->me_method;
 
         /* two pass mode */
-        if (do_pass) {
-            if (do_pass == 1) {
+        if (job->do_pass) {
+            if (job->do_pass == 1) {
                 video_enc->flags |= CODEC_FLAG_PASS1;
             } else {
                 video_enc->flags |= CODEC_FLAG_PASS2;
@@ -2772,12 +3227,12 @@ static void new_video_stream(AVFormatContext *oc)
     }
 
     /* reset some key parameters */
-    video_disable = 0;
-    video_codec_id = CODEC_ID_NONE;
-    video_stream_copy = 0;
+    job->video_disable = 0;
+    job->video_codec_id = CODEC_ID_NONE;
+    job->video_stream_copy = 0;
 }
 
-static void new_audio_stream(AVFormatContext *oc)
+static void new_audio_stream(FFmpegJob *job, AVFormatContext *oc)
 {
     AVStream *st;
     AVCodecContext *audio_enc;
@@ -2786,177 +3241,183 @@ static void new_audio_stream(AVFormatContext *oc)
     st = av_new_stream(oc, oc->nb_streams);
     if (!st) {
         fprintf(stderr, "Could not alloc stream\n");
-        exit(1);
+        job_fail(job, -ENOMEM);
+        return;
     }
 
-    bitstream_filters[nb_output_files][oc->nb_streams - 1]= audio_bitstream_filters;
-    audio_bitstream_filters= NULL;
-
-#if defined(HAVE_THREADS)
-    if(thread_count>1)
-        avcodec_thread_init(st->codec, thread_count);
-#endif
+    job->bitstream_filters[job->nb_output_files][oc->nb_streams - 1]= job->audio_bitstream_filters;
+    job->audio_bitstream_filters= NULL;
 
     audio_enc = st->codec;
     audio_enc->codec_type = CODEC_TYPE_AUDIO;
 
-    if(audio_codec_tag)
-        audio_enc->codec_tag= audio_codec_tag;
+    if(job->audio_codec_tag)
+        audio_enc->codec_tag= job->audio_codec_tag;
 
     if (oc->oformat->flags & AVFMT_GLOBALHEADER) {
         audio_enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
-        avctx_opts->flags|= CODEC_FLAG_GLOBAL_HEADER;
+        job->avctx_opts->flags|= CODEC_FLAG_GLOBAL_HEADER;
     }
-    if (audio_stream_copy) {
+    if (job->audio_stream_copy) {
         st->stream_copy = 1;
-        audio_enc->channels = audio_channels;
+        audio_enc->channels = job->audio_channels;
     } else {
         codec_id = av_guess_codec(oc->oformat, NULL, oc->filename, NULL, CODEC_TYPE_AUDIO);
 
-        for(i=0; i<opt_name_count; i++){
+        for(i=0; i<job->opt_name_count; i++){
             AVOption *opt;
-            double d= av_get_double(avctx_opts, opt_names[i], &opt);
+            double d= av_get_double(job->avctx_opts, job->opt_names[i], &opt);
             if(d==d && (opt->flags&AV_OPT_FLAG_AUDIO_PARAM) && (opt->flags&AV_OPT_FLAG_ENCODING_PARAM))
-                av_set_double(audio_enc, opt_names[i], d);
+                av_set_double(audio_enc, job->opt_names[i], d);
         }
 
-        if (audio_codec_id != CODEC_ID_NONE)
-            codec_id = audio_codec_id;
+        if (job->audio_codec_id != CODEC_ID_NONE)
+            codec_id = job->audio_codec_id;
         audio_enc->codec_id = codec_id;
 
-        audio_enc->bit_rate = audio_bit_rate;
-        if (audio_qscale > QSCALE_NONE) {
+        audio_enc->bit_rate = job->audio_bit_rate;
+        if (job->audio_qscale > QSCALE_NONE) {
             audio_enc->flags |= CODEC_FLAG_QSCALE;
-            audio_enc->global_quality = st->quality = FF_QP2LAMBDA * audio_qscale;
+            audio_enc->global_quality = st->quality = FF_QP2LAMBDA * job->audio_qscale;
         }
-        audio_enc->strict_std_compliance = strict;
-        audio_enc->thread_count = thread_count;
+        audio_enc->strict_std_compliance = job->strict;
         /* For audio codecs other than AC3 or DTS we limit */
         /* the number of coded channels to stereo   */
-        if (audio_channels > 2 && codec_id != CODEC_ID_AC3
+        if (job->audio_channels > 2 && codec_id != CODEC_ID_AC3
             && codec_id != CODEC_ID_DTS) {
             audio_enc->channels = 2;
         } else
-            audio_enc->channels = audio_channels;
+            audio_enc->channels = job->audio_channels;
     }
-    audio_enc->sample_rate = audio_sample_rate;
-    audio_enc->time_base= (AVRational){1, audio_sample_rate};
-    if (audio_language) {
-        pstrcpy(st->language, sizeof(st->language), audio_language);
-        av_free(audio_language);
-        audio_language = NULL;
+    audio_enc->sample_rate = job->audio_sample_rate;
+    audio_enc->time_base= (AVRational){1, job->audio_sample_rate};
+    if (job->audio_language) {
+        pstrcpy(st->language, sizeof(st->language), job->audio_language);
+        av_free(job->audio_language);
+        job->audio_language = NULL;
     }
 
     /* reset some key parameters */
-    audio_disable = 0;
-    audio_codec_id = CODEC_ID_NONE;
-    audio_stream_copy = 0;
+    job->audio_disable = 0;
+    job->audio_codec_id = CODEC_ID_NONE;
+    job->audio_stream_copy = 0;
 }
 
-static void opt_new_subtitle_stream(void)
+static void opt_new_subtitle_stream(FFmpegJob *job)
 {
     AVFormatContext *oc;
     AVStream *st;
     AVCodecContext *subtitle_enc;
     int i;
 
-    if (nb_output_files <= 0) {
+    if (job->nb_output_files <= 0) {
         fprintf(stderr, "At least one output file must be specified\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    oc = output_files[nb_output_files - 1];
+    oc = job->output_files[job->nb_output_files - 1];
 
     st = av_new_stream(oc, oc->nb_streams);
     if (!st) {
         fprintf(stderr, "Could not alloc stream\n");
-        exit(1);
+        job_fail(job, -ENOMEM);
+        return;
     }
 
     subtitle_enc = st->codec;
     subtitle_enc->codec_type = CODEC_TYPE_SUBTITLE;
-    if (subtitle_stream_copy) {
+    if (job->subtitle_stream_copy) {
         st->stream_copy = 1;
     } else {
-        for(i=0; i<opt_name_count; i++){
+        for(i=0; i<job->opt_name_count; i++){
              AVOption *opt;
-             double d= av_get_double(avctx_opts, opt_names[i], &opt);
+             double d= av_get_double(job->avctx_opts, job->opt_names[i], &opt);
              if(d==d && (opt->flags&AV_OPT_FLAG_SUBTITLE_PARAM) && (opt->flags&AV_OPT_FLAG_ENCODING_PARAM))
-                 av_set_double(subtitle_enc, opt_names[i], d);
+                 av_set_double(subtitle_enc, job->opt_names[i], d);
         }
-        subtitle_enc->codec_id = subtitle_codec_id;
+        subtitle_enc->codec_id = job->subtitle_codec_id;
     }
 
-    if (subtitle_language) {
-        pstrcpy(st->language, sizeof(st->language), subtitle_language);
-        av_free(subtitle_language);
-        subtitle_language = NULL;
+    if (job->subtitle_language) {
+        pstrcpy(st->language, sizeof(st->language), job->subtitle_language);
+        av_free(job->subtitle_language);
+        job->subtitle_language = NULL;
     }
 
-    subtitle_codec_id = CODEC_ID_NONE;
-    subtitle_stream_copy = 0;
+    job->subtitle_codec_id = CODEC_ID_NONE;
+    job->subtitle_stream_copy = 0;
 }
 
-static void opt_new_audio_stream(void)
+static void opt_new_audio_stream(FFmpegJob *job)
 {
     AVFormatContext *oc;
-    if (nb_output_files <= 0) {
+    if (job->nb_output_files <= 0) {
         fprintf(stderr, "At least one output file must be specified\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    oc = output_files[nb_output_files - 1];
-    new_audio_stream(oc);
+    oc = job->output_files[job->nb_output_files - 1];
+    new_audio_stream(job, oc);
 }
 
-static void opt_new_video_stream(void)
+static void opt_new_video_stream(FFmpegJob *job)
 {
     AVFormatContext *oc;
-    if (nb_output_files <= 0) {
+    if (job->nb_output_files <= 0) {
         fprintf(stderr, "At least one output file must be specified\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    oc = output_files[nb_output_files - 1];
-    new_video_stream(oc);
+    oc = job->output_files[job->nb_output_files - 1];
+    new_video_stream(job, oc);
 }
 
-static void opt_output_file(const char *filename)
+static void opt_output_file(FFmpegJob *job, const char *filename)
 {
     AVFormatContext *oc;
     int use_video, use_audio, input_has_video, input_has_audio, i;
+    int file_opened = 0;
     AVFormatParameters params, *ap = &params;
 
     if (!strcmp(filename, "-"))
         filename = "pipe:";
 
     oc = av_alloc_format_context();
+    if (!oc) {
+        job_fail(job, -ENOMEM);
+        return;
+    }
 
-    if (!file_oformat) {
-        file_oformat = guess_format(NULL, filename, NULL);
-        if (!file_oformat) {
+    if (!job->file_oformat) {
+        job->file_oformat = guess_format(NULL, filename, NULL);
+        if (!job->file_oformat) {
             fprintf(stderr, "Unable for find a suitable output format for '%s'\n",
                     filename);
-            exit(1);
+            job_fail(job, -EINVAL);
+            goto fail;
         }
     }
 
-    oc->oformat = file_oformat;
+    oc->oformat = job->file_oformat;
     pstrcpy(oc->filename, sizeof(oc->filename), filename);
 
-    if (!strcmp(file_oformat->name, "ffm") &&
+    if (!strcmp(job->file_oformat->name, "ffm") &&
         strstart(filename, "http:", NULL)) {
         /* special case for files sent to ffserver: we get the stream
            parameters from ffserver */
         if (read_ffserver_streams(oc, filename) < 0) {
             fprintf(stderr, "Could not read stream parameters from '%s'\n", filename);
-            exit(1);
+            job_fail(job, -EIO);
+            goto fail;
         }
     } else {
-        use_video = file_oformat->video_codec != CODEC_ID_NONE || video_stream_copy || video_codec_id != CODEC_ID_NONE;
-        use_audio = file_oformat->audio_codec != CODEC_ID_NONE || audio_stream_copy || audio_codec_id != CODEC_ID_NONE;
+        use_video = job->file_oformat->video_codec != CODEC_ID_NONE || job->video_stream_copy || job->video_codec_id != CODEC_ID_NONE;
+        use_audio = job->file_oformat->audio_codec != CODEC_ID_NONE || job->audio_stream_copy || job->audio_codec_id != CODEC_ID_NONE;
 
         /* disable if no corresponding type found and at least one
            input file */
-        if (nb_input_files > 0) {
-            check_audio_video_inputs(&input_has_video, &input_has_audio);
+        if (job->nb_input_files > 0) {
+            check_audio_video_inputs(job, &input_has_video, &input_has_audio);
             if (!input_has_video)
                 use_video = 0;
             if (!input_has_audio)
@@ -2964,214 +3425,135 @@ static void opt_output_file(const char *filename)
         }
 
         /* manual disable */
-        if (audio_disable) {
+        if (job->audio_disable) {
             use_audio = 0;
         }
-        if (video_disable) {
+        if (job->video_disable) {
             use_video = 0;
         }
 
         if (use_video) {
-            new_video_stream(oc);
+            new_video_stream(job, oc);
         }
 
         if (use_audio) {
-            new_audio_stream(oc);
+            new_audio_stream(job, oc);
         }
+        if (job->error)
+            goto fail;
 
         if (!oc->nb_streams) {
             fprintf(stderr, "No audio or video streams available\n");
-            exit(1);
+            job_fail(job, -EINVAL);
+            goto fail;
         }
 
-        oc->timestamp = rec_timestamp;
-
-        if (str_title)
-            pstrcpy(oc->title, sizeof(oc->title), str_title);
-        if (str_author)
-            pstrcpy(oc->author, sizeof(oc->author), str_author);
-        if (str_copyright)
-            pstrcpy(oc->copyright, sizeof(oc->copyright), str_copyright);
-        if (str_comment)
-            pstrcpy(oc->comment, sizeof(oc->comment), str_comment);
-        if (str_album)
-            pstrcpy(oc->album, sizeof(oc->album), str_album);
+        oc->timestamp = job->rec_timestamp;
+
+        if (job->str_title)
+            pstrcpy(oc->title, sizeof(oc->title), job->str_title);
+        if (job->str_author)
+            pstrcpy(oc->author, sizeof(oc->author), job->str_author);
+        if (job->str_copyright)
+            pstrcpy(oc->copyright, sizeof(oc->copyright), job->str_copyright);
+        if (job->str_comment)
+            pstrcpy(oc->comment, sizeof(oc->comment), job->str_comment);
+        if (job->str_album)
+            pstrcpy(oc->album, sizeof(oc->album), job->str_album);
     }
 
-    output_files[nb_output_files++] = oc;
-
     /* check filename in case of an image number is expected */
     if (oc->oformat->flags & AVFMT_NEEDNUMBER) {
         if (!av_filename_number_test(oc->filename)) {
             //print_error(oc->filename, AVERROR_NUMEXPECTED);
-            //exit(1);
-            return;
+            job_fail(job, AVERROR_NUMEXPECTED);
+            goto fail;
         }
     }
 
     if (!(oc->oformat->flags & AVFMT_NOFILE)) {
         /* test if it already exists to avoid loosing precious files */
-        if (!file_overwrite &&
+        if (!job->file_overwrite &&
             (strchr(filename, ':') == NULL ||
              strstart(filename, "file:", NULL))) {
             if (url_exist(filename)) {
                 int c;
 
-                if ( !using_stdin ) {
+                if ( !job->using_stdin ) {
                     fprintf(stderr,"File '%s' already exists. Overwrite ? [y/N] ", filename);
                     fflush(stderr);
                     c = getchar();
                     if (toupper(c) != 'Y') {
                         fprintf(stderr, "Not overwriting - exiting\n");
-                        exit(1);
+                        job_fail(job, -EEXIST);
+                        goto fail;
                     }
                                 }
                                 else {
                     fprintf(stderr,"File '%s' already exists. Exiting.\n", filename);
-                    exit(1);
+                    job_fail(job, -EEXIST);
+                    goto fail;
                                 }
             }
         }
 
         /* open the file */
-        if (url_fopen(&oc->pb, filename, URL_WRONLY) < 0) {
+        if (output_fopen(&oc->pb, filename, job->async_output) < 0) {
             fprintf(stderr, "Could not open '%s'\n", filename);
-            exit(1);
+            job_fail(job, -EIO);
+            goto fail;
         }
+        file_opened = 1;
     }
 
     memset(ap, 0, sizeof(*ap));
-    ap->image_format = image_format;
+    ap->image_format = job->image_format;
     if (av_set_parameters(oc, ap) < 0) {
         fprintf(stderr, "%s: Invalid encoding parameters\n",
                 oc->filename);
-        exit(1);
+        job_fail(job, -EINVAL);
+        goto fail;
     }
 
-    oc->preload= (int)(mux_preload*AV_TIME_BASE);
-    oc->max_delay= (int)(mux_max_delay*AV_TIME_BASE);
-    oc->loop_output = loop_output;
+    oc->preload= (int)(job->mux_preload*AV_TIME_BASE);
+    oc->max_delay= (int)(job->mux_max_delay*AV_TIME_BASE);
+    oc->loop_output = job->loop_output;
 
-    for(i=0; i<opt_name_count; i++){
+    for(i=0; i<job->opt_name_count; i++){
         AVOption *opt;
-        double d = av_get_double(avformat_opts, opt_names[i], &opt);
+        double d = av_get_double(job->avformat_opts, job->opt_names[i], &opt);
         if(d==d && (opt->flags&AV_OPT_FLAG_ENCODING_PARAM))
-            av_set_double(oc, opt_names[i], d);
-    }
-
-    /* reset some options */
-    file_oformat = NULL;
-    file_iformat = NULL;
-    image_format = NULL;
-}
-
-/* prepare dummy protocols for grab */
-static void prepare_grab(void)
-{
-    int has_video, has_audio, i, j;
-    AVFormatContext *oc;
-    AVFormatContext *ic;
-    AVFormatParameters vp1, *vp = &vp1;
-    AVFormatParameters ap1, *ap = &ap1;
-
-    /* see if audio/video inputs are needed */
-    has_video = 0;
-    has_audio = 0;
-    memset(ap, 0, sizeof(*ap));
-    memset(vp, 0, sizeof(*vp));
-    vp->time_base.num= 1;
-    for(j=0;j<nb_output_files;j++) {
-        oc = output_files[j];
-        for(i=0;i<oc->nb_streams;i++) {
-            AVCodecContext *enc = oc->streams[i]->codec;
-            switch(enc->codec_type) {
-            case CODEC_TYPE_AUDIO:
-                if (enc->sample_rate > ap->sample_rate)
-                    ap->sample_rate = enc->sample_rate;
-                if (enc->channels > ap->channels)
-                    ap->channels = enc->channels;
-                has_audio = 1;
-                break;
-            case CODEC_TYPE_VIDEO:
-                if (enc->width > vp->width)
-                    vp->width = enc->width;
-                if (enc->height > vp->height)
-                    vp->height = enc->height;
-
-                if (vp->time_base.num*(int64_t)enc->time_base.den > enc->time_base.num*(int64_t)vp->time_base.den){
-                    vp->time_base = enc->time_base;
-                    vp->width += frame_leftBand + frame_rightBand;
-                    vp->width -= (frame_padleft + frame_padright);
-                    vp->height += frame_topBand + frame_bottomBand;
-                    vp->height -= (frame_padtop + frame_padbottom);
-                }
-                has_video = 1;
-                break;
-            default:
-                av_abort();
-            }
-        }
+            av_set_double(oc, job->opt_names[i], d);
     }
 
-    if (has_video == 0 && has_audio == 0) {
-        fprintf(stderr, "Output file must have at least one audio or video stream\n");
-        exit(1);
-    }
+    job->output_files[job->nb_output_files++] = oc;
 
-    if (has_video) {
-        AVInputFormat *fmt1;
-        fmt1 = av_find_input_format(video_grab_format);
-        vp->device  = video_device;
-        vp->channel = video_channel;
-        vp->standard = video_standard;
-        vp->pix_fmt = frame_pix_fmt;
-        if (av_open_input_file(&ic, "", fmt1, 0, vp) < 0) {
-            fprintf(stderr, "Could not find video grab device\n");
-            exit(1);
-        }
-        /* If not enough info to get the stream parameters, we decode the
-           first frames to get it. */
-        if ((ic->ctx_flags & AVFMTCTX_NOHEADER) && av_find_stream_info(ic) < 0) {
-            fprintf(stderr, "Could not find video grab parameters\n");
-            exit(1);
-        }
-        /* by now video grab has one stream */
-        ic->streams[0]->r_frame_rate.num = vp->time_base.den;
-        ic->streams[0]->r_frame_rate.den = vp->time_base.num;
-        input_files[nb_input_files] = ic;
-
-        if (verbose >= 0)
-            dump_format(ic, nb_input_files, "", 0);
-
-        nb_input_files++;
-    }
-    if (has_audio && audio_grab_format) {
-        AVInputFormat *fmt1;
-        fmt1 = av_find_input_format(audio_grab_format);
-        ap->device = audio_device;
-        if (av_open_input_file(&ic, "", fmt1, 0, ap) < 0) {
-            fprintf(stderr, "Could not find audio grab device\n");
-            exit(1);
-        }
-        input_files[nb_input_files] = ic;
-
-        if (verbose >= 0)
-            dump_format(ic, nb_input_files, "", 0);
-
-        nb_input_files++;
+    /* reset some options */
+    job->file_oformat = NULL;
+    job->file_iformat = NULL;
+    job->image_format = NULL;
+    return;
+ fail:
+    if (file_opened)
+        url_fclose(&oc->pb);
+    for(i=0;i<oc->nb_streams;i++) {
+        av_free(oc->streams[i]->codec);
+        av_free(oc->streams[i]);
     }
+    av_free(oc);
 }
 
 /* same option as mencoder */
-static void opt_pass(const char *pass_str)
+static void opt_pass(FFmpegJob *job, const char *pass_str)
 {
     int pass;
     pass = atoi(pass_str);
     if (pass != 1 && pass != 2) {
         fprintf(stderr, "pass number can be only 1 or 2\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
-    do_pass = pass;
+    job->do_pass = pass;
 }
 
 #if defined(__MINGW32__) || defined(CONFIG_OS2)
@@ -3193,149 +3575,7 @@ static int64_t getutime(void)
 extern int ffm_nopts;
 #endif
 
-static void show_formats(void)
-{
-    AVInputFormat *ifmt;
-    AVOutputFormat *ofmt;
-    AVImageFormat *image_fmt;
-    URLProtocol *up;
-    AVCodec *p, *p2;
-    const char **pp, *last_name;
-
-    printf("File formats:\n");
-    last_name= "000";
-    for(;;){
-        int decode=0;
-        int encode=0;
-        const char *name=NULL;
-        const char *long_name=NULL;
-
-        for(ofmt = first_oformat; ofmt != NULL; ofmt = ofmt->next) {
-            if((name == NULL || strcmp(ofmt->name, name)<0) &&
-                strcmp(ofmt->name, last_name)>0){
-                name= ofmt->name;
-                long_name= ofmt->long_name;
-                encode=1;
-            }
-        }
-        for(ifmt = first_iformat; ifmt != NULL; ifmt = ifmt->next) {
-            if((name == NULL || strcmp(ifmt->name, name)<0) &&
-                strcmp(ifmt->name, last_name)>0){
-                name= ifmt->name;
-                long_name= ifmt->long_name;
-                encode=0;
-            }
-            if(name && strcmp(ifmt->name, name)==0)
-                decode=1;
-        }
-        if(name==NULL)
-            break;
-        last_name= name;
-
-        printf(
-            " %s%s %-15s %s\n",
-            decode ? "D":" ",
-            encode ? "E":" ",
-            name,
-            long_name ? long_name:" ");
-    }
-    printf("\n");
-
-    printf("Image formats (filename extensions, if any, follow):\n");
-    for(image_fmt = first_image_format; image_fmt != NULL;
-        image_fmt = image_fmt->next) {
-        printf(
-            " %s%s %-6s %s\n",
-            image_fmt->img_read  ? "D":" ",
-            image_fmt->img_write ? "E":" ",
-            image_fmt->name,
-            image_fmt->extensions ? image_fmt->extensions:" ");
-    }
-    printf("\n");
-
-    printf("Codecs:\n");
-    last_name= "000";
-    for(;;){
-        int decode=0;
-        int encode=0;
-        int cap=0;
-        const char *type_str;
-
-        p2=NULL;
-        for(p = first_avcodec; p != NULL; p = p->next) {
-            if((p2==NULL || strcmp(p->name, p2->name)<0) &&
-                strcmp(p->name, last_name)>0){
-                p2= p;
-                decode= encode= cap=0;
-            }
-            if(p2 && strcmp(p->name, p2->name)==0){
-                if(p->decode) decode=1;
-                if(p->encode) encode=1;
-                cap |= p->capabilities;
-            }
-        }
-        if(p2==NULL)
-            break;
-        last_name= p2->name;
-
-        switch(p2->type) {
-        case CODEC_TYPE_VIDEO:
-            type_str = "V";
-            break;
-        case CODEC_TYPE_AUDIO:
-            type_str = "A";
-            break;
-        case CODEC_TYPE_SUBTITLE:
-            type_str = "S";
-            break;
-        default:
-            type_str = "?";
-            break;
-        }
-        printf(
-            " %s%s%s%s%s%s %s",
-            decode ? "D": (/*p2->decoder ? "d":*/" "),
-            encode ? "E":" ",
-            type_str,
-            cap & CODEC_CAP_DRAW_HORIZ_BAND ? "S":" ",
-            cap & CODEC_CAP_DR1 ? "D":" ",
-            cap & CODEC_CAP_TRUNCATED ? "T":" ",
-            p2->name);
-       /* if(p2->decoder && decode==0)
-            printf(" use %s for decoding", p2->decoder->name);*/
-        printf("\n");
-    }
-    printf("\n");
-
-    printf("Supported file protocols:\n");
-    for(up = first_protocol; up != NULL; up = up->next)
-        printf(" %s:", up->name);
-    printf("\n");
-
-    printf("Frame size, frame rate abbreviations:\n ntsc pal qntsc qpal sntsc spal film ntsc-film sqcif qcif cif 4cif\n");
-    printf("Motion estimation methods:\n");
-    pp = motion_str;
-    while (*pp) {
-        printf(" %s", *pp);
-        if ((pp - motion_str + 1) == ME_ZERO)
-            printf("(fastest)");
-        else if ((pp - motion_str + 1) == ME_FULL)
-            printf("(slowest)");
-        else if ((pp - motion_str + 1) == ME_EPZS)
-            printf("(default)");
-        pp++;
-    }
-    printf("\n\n");
-    printf(
-"Note, the names of encoders and decoders dont always match, so there are\n"
-"several cases where the above table shows encoder only or decoder only entries\n"
-"even though both encoding and decoding are supported for example, the h263\n"
-"decoder corresponds to the h263 and h263p encoders, for file formats its even\n"
-"worse\n");
-    exit(1);
-}
-
-static void parse_matrix_coeffs(uint16_t *dest, const char *str)
+static void parse_matrix_coeffs(FFmpegJob *job, uint16_t *dest, const char *str)
 {
     int i;
     const char *p = str;
@@ -3346,25 +3586,26 @@ static void parse_matrix_coeffs(uint16_t *dest, const char *str)
         p = strchr(p, ',');
         if(!p) {
             fprintf(stderr, "Syntax error in matrix \"%s\" at coeff %d\n", str, i);
-            exit(1);
+            job_fail(job, -EINVAL);
+            return;
         }
         p++;
     }
 }
 
-static void opt_inter_matrix(const char *arg)
+static void opt_inter_matrix(FFmpegJob *job, const char *arg)
 {
-    inter_matrix = av_mallocz(sizeof(uint16_t) * 64);
-    parse_matrix_coeffs(inter_matrix, arg);
+    job->inter_matrix = av_mallocz(sizeof(uint16_t) * 64);
+    parse_matrix_coeffs(job, job->inter_matrix, arg);
 }
 
-static void opt_intra_matrix(const char *arg)
+static void opt_intra_matrix(FFmpegJob *job, const char *arg)
 {
-    intra_matrix = av_mallocz(sizeof(uint16_t) * 64);
-    parse_matrix_coeffs(intra_matrix, arg);
+    job->intra_matrix = av_mallocz(sizeof(uint16_t) * 64);
+    parse_matrix_coeffs(job, job->intra_matrix, arg);
 }
 
-static void opt_target(const char *arg)
+static void opt_target(FFmpegJob *job, const char *arg)
 {
     int norm = -1;
     static const char *const frame_rates[] = {"25", "30000/1001", "24000/1001"};
@@ -3381,18 +3622,18 @@ static void opt_target(const char *arg)
     } else {
         int fr;
         /* Calculate FR via float to avoid int overflow */
-        fr = (int)(frame_rate * 1000.0 / frame_rate_base);
+        fr = (int)(job->frame_rate * 1000.0 / job->frame_rate_base);
         if(fr == 25000) {
             norm = 0;
         } else if((fr == 29970) || (fr == 23976)) {
             norm = 1;
         } else {
             /* Try to determine PAL/NTSC by peeking in the input files */
-            if(nb_input_files) {
+            if(job->nb_input_files) {
                 int i, j;
-                for(j = 0; j < nb_input_files; j++) {
-                    for(i = 0; i < input_files[j]->nb_streams; i++) {
-                        AVCodecContext *c = input_files[j]->streams[i]->codec;
+                for(j = 0; j < job->nb_input_files; j++) {
+                    for(i = 0; i < job->input_files[j]->nb_streams; i++) {
+                        AVCodecContext *c = job->input_files[j]->streams[i]->codec;
                         if(c->codec_type != CODEC_TYPE_VIDEO)
                             continue;
                         fr = c->time_base.den * 1000 / c->time_base.num;
@@ -3409,7 +3650,7 @@ static void opt_target(const char *arg)
                 }
             }
         }
-        if(verbose && norm >= 0)
+        if(job->verbose && norm >= 0)
             fprintf(stderr, "Assuming %s for target.\n", norm ? "NTSC" : "PAL");
     }
 
@@ -3417,108 +3658,111 @@ static void opt_target(const char *arg)
         fprintf(stderr, "Could not determine norm (PAL/NTSC/NTSC-Film) for target.\n");
         fprintf(stderr, "Please prefix target with \"pal-\", \"ntsc-\" or \"film-\",\n");
         fprintf(stderr, "or set a framerate with \"-r xxx\".\n");
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 
     if(!strcmp(arg, "vcd")) {
 
-        opt_video_codec("mpeg1video");
-        opt_audio_codec("mp2");
-        opt_format("vcd");
+        opt_video_codec(job, "mpeg1video");
+        opt_audio_codec(job, "mp2");
+        opt_format(job, "vcd");
 
-        opt_frame_size(norm ? "352x240" : "352x288");
-        opt_frame_rate(frame_rates[norm]);
-        opt_default("gop", norm ? "18" : "15");
+        opt_frame_size(job, norm ? "352x240" : "352x288");
+        opt_frame_rate(job, frame_rates[norm]);
+        opt_default(job, "gop", norm ? "18" : "15");
 
-        opt_default("b", "1150000");
-        opt_default("maxrate", "1150000");
-        opt_default("minrate", "1150000");
-        opt_default("bufsize", "327680"); // 40*1024*8;
+        opt_default(job, "b", "1150000");
+        opt_default(job, "maxrate", "1150000");
+        opt_default(job, "minrate", "1150000");
+        opt_default(job, "bufsize", "327680"); // 40*1024*8;
 
-        audio_bit_rate = 224000;
-        audio_sample_rate = 44100;
+        job->audio_bit_rate = 224000;
+        job->audio_sample_rate = 44100;
 
-        opt_default("packetsize", "2324");
-        opt_default("muxrate", "1411200"); // 2352 * 75 * 8;
+        opt_default(job, "packetsize", "2324");
+        opt_default(job, "muxrate", "1411200"); // 2352 * 75 * 8;
 
         /* We have to offset the PTS, so that it is consistent with the SCR.
            SCR starts at 36000, but the first two packs contain only padding
            and the first pack from the other stream, respectively, may also have
            been written before.
            So the real data starts at SCR 36000+3*1200. */
-        mux_preload= (36000+3*1200) / 90000.0; //0.44
+        job->mux_preload= (36000+3*1200) / 90000.0; //0.44
     } else if(!strcmp(arg, "svcd")) {
 
-        opt_video_codec("mpeg2video");
-        opt_audio_codec("mp2");
-        opt_format("svcd");
+        opt_video_codec(job, "mpeg2video");
+        opt_audio_codec(job, "mp2");
+        opt_format(job, "svcd");
 
-        opt_frame_size(norm ? "480x480" : "480x576");
-        opt_frame_rate(frame_rates[norm]);
-        opt_default("gop", norm ? "18" : "15");
+        opt_frame_size(job, norm ? "480x480" : "480x576");
+        opt_frame_rate(job, frame_rates[norm]);
+        opt_default(job, "gop", norm ? "18" : "15");
 
-        opt_default("b", "2040000");
-        opt_default("maxrate", "2516000");
-        opt_default("minrate", "0"); //1145000;
-        opt_default("bufsize", "1835008"); //224*1024*8;
-        opt_default("flags", "+SCAN_OFFSET");
+        opt_default(job, "b", "2040000");
+        opt_default(job, "maxrate", "2516000");
+        opt_default(job, "minrate", "0"); //1145000;
+        opt_default(job, "bufsize", "1835008"); //224*1024*8;
+        opt_default(job, "flags", "+SCAN_OFFSET");
 
 
-        audio_bit_rate = 224000;
-        audio_sample_rate = 44100;
+        job->audio_bit_rate = 224000;
+        job->audio_sample_rate = 44100;
 
-        opt_default("packetsize", "2324");
+        opt_default(job, "packetsize", "2324");
 
     } else if(!strcmp(arg, "dvd")) {
 
-        opt_video_codec("mpeg2video");
-        opt_audio_codec("ac3");
-        opt_format("dvd");
+        opt_video_codec(job, "mpeg2video");
+        opt_audio_codec(job, "ac3");
+        opt_format(job, "dvd");
 
-        opt_frame_size(norm ? "720x480" : "720x576");
-        opt_frame_rate(frame_rates[norm]);
-        opt_default("gop", norm ? "18" : "15");
+        opt_frame_size(job, norm ? "720x480" : "720x576");
+        opt_frame_rate(job, frame_rates[norm]);
+        opt_default(job, "gop", norm ? "18" : "15");
 
-        opt_default("b", "6000000");
-        opt_default("maxrate", "9000000");
-        opt_default("minrate", "0"); //1500000;
-        opt_default("bufsize", "1835008"); //224*1024*8;
+        opt_default(job, "b", "6000000");
+        opt_default(job, "maxrate", "9000000");
+        opt_default(job, "minrate", "0"); //1500000;
+        opt_default(job, "bufsize", "1835008"); //224*1024*8;
 
-        opt_default("packetsize", "2048");  // from www.mpucoder.com: DVD sectors contain 2048 bytes of data, this is also the size of one pack.
-        opt_default("muxrate", "10080000"); // from mplex project: data_rate = 1260000. mux_rate = data_rate * 8
+        opt_default(job, "packetsize", "2048");  // from www.mpucoder.com: DVD sectors contain 2048 bytes of data, this is also the size of one pack.
+        opt_default(job, "muxrate", "10080000"); // from mplex project: data_rate = 1260000. mux_rate = data_rate * 8
 
-        audio_bit_rate = 448000;
-        audio_sample_rate = 48000;
+        job->audio_bit_rate = 448000;
+        job->audio_sample_rate = 48000;
 
     } else if(!strncmp(arg, "dv", 2)) {
 
-        opt_format("dv");
+        opt_format(job, "dv");
 
-        opt_frame_size(norm ? "720x480" : "720x576");
-        opt_frame_pix_fmt(!strncmp(arg, "dv50", 4) ? "yuv422p" :
+        opt_frame_size(job, norm ? "720x480" : "720x576");
+        opt_frame_pix_fmt(job, !strncmp(arg, "dv50", 4) ? "yuv422p" :
                                              (norm ? "yuv411p" : "yuv420p"));
-        opt_frame_rate(frame_rates[norm]);
+        opt_frame_rate(job, frame_rates[norm]);
 
-        audio_sample_rate = 48000;
-        audio_channels = 2;
+        job->audio_sample_rate = 48000;
+        job->audio_channels = 2;
 
     } else {
         fprintf(stderr, "Unknown target: %s\n", arg);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 }
 
-static void opt_video_bsf(const char *arg)
+static void opt_video_bsf(FFmpegJob *job, const char *arg)
 {
     AVBitStreamFilterContext *bsfc= av_bitstream_filter_init(arg); //FIXME split name and args for filter at '='
     AVBitStreamFilterContext **bsfp;
 
     if(!bsfc){
         fprintf(stderr, "Unkown bitstream filter %s\n", arg);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 
-    bsfp= &video_bitstream_filters;
+    bsfp= &job->video_bitstream_filters;
     while(*bsfp)
         bsfp= &(*bsfp)->next;
 
@@ -3526,254 +3770,510 @@ static void opt_video_bsf(const char *arg)
 }
 
 //FIXME avoid audio - video code duplication
-static void opt_audio_bsf(const char *arg)
+static void opt_audio_bsf(FFmpegJob *job, const char *arg)
 {
     AVBitStreamFilterContext *bsfc= av_bitstream_filter_init(arg); //FIXME split name and args for filter at '='
     AVBitStreamFilterContext **bsfp;
 
     if(!bsfc){
         fprintf(stderr, "Unkown bitstream filter %s\n", arg);
-        exit(1);
+        job_fail(job, -EINVAL);
+        return;
     }
 
-    bsfp= &audio_bitstream_filters;
+    bsfp= &job->audio_bitstream_filters;
     while(*bsfp)
         bsfp= &(*bsfp)->next;
 
     *bsfp= bsfc;
 }
 
-static void show_version(void)
-{
-    /* TODO: add function interface to avutil and avformat */
-    fprintf(stderr, "ffmpeg      " FFMPEG_VERSION "\n"
-           "libavutil   %d\n"
-           "libavcodec  %d\n"
-           "libavformat %d\n",
-           LIBAVUTIL_BUILD, avcodec_build(), LIBAVFORMAT_BUILD);
-    exit(1);
-}
-
-static int opt_default(const char *opt, const char *arg){
-    AVOption *o= av_set_string(avctx_opts, opt, arg);
+static int opt_default(FFmpegJob *job, const char *opt, const char *arg){
+    AVOption *o= av_set_string(job->avctx_opts, opt, arg);
     if(!o)
-        o = av_set_string(avformat_opts, opt, arg);
+        o = av_set_string(job->avformat_opts, opt, arg);
     if(!o)
         return -1;
 
-//    av_log(NULL, AV_LOG_ERROR, "%s:%s: %f 0x%0X\n", opt, arg, av_get_double(avctx_opts, opt, NULL), (int)av_get_int(avctx_opts, opt, NULL));
+//    av_log(NULL, AV_LOG_ERROR, "%s:%s: %f 0x%0X\n", opt, arg, av_get_double(job->avctx_opts, opt, NULL), (int)av_get_int(job->avctx_opts, opt, NULL));
 
     //FIXME we should always use avctx_opts, ... for storing options so there wont be any need to keep track of whats set over this
-    opt_names= av_realloc(opt_names, sizeof(void*)*(opt_name_count+1));
-    opt_names[opt_name_count++]= o->name;
+    job->opt_names= av_realloc(job->opt_names, sizeof(void*)*(job->opt_name_count+1));
+    job->opt_names[job->opt_name_count++]= o->name;
 
 #if defined(CONFIG_FFM_DEMUXER) || defined(CONFIG_FFM_MUXER)
     /* disable generate of real time pts in ffm (need to be supressed anyway) */
-    if(avctx_opts->flags & CODEC_FLAG_BITEXACT)
+    if(job->avctx_opts->flags & CODEC_FLAG_BITEXACT)
         ffm_nopts = 1;
 #endif
 
-    if(avctx_opts->debug)
+    if(job->avctx_opts->debug)
         av_log_set_level(AV_LOG_DEBUG);
     return 0;
 }
 
-const OptionDef options[] = {
-    /* main options */
-    { "L", 0, {(void*)show_license}, "show license" },
-    { "h", 0, {(void*)show_help}, "show help" },
-    { "version", 0, {(void*)show_version}, "show version" },
-    { "formats", 0, {(void*)show_formats}, "show available formats, codecs, protocols, ..." },
-    { "f", HAS_ARG, {(void*)opt_format}, "force format", "fmt" },
-    { "img", HAS_ARG, {(void*)opt_image_format}, "force image format", "img_fmt" },
-    { "i", HAS_ARG, {(void*)opt_input_file}, "input file name", "filename" },
-    { "y", OPT_BOOL, {(void*)&file_overwrite}, "overwrite output files" },
-    { "map", HAS_ARG | OPT_EXPERT, {(void*)opt_map}, "set input stream mapping", "file:stream[:syncfile:syncstream]" },
-    { "map_meta_data", HAS_ARG | OPT_EXPERT, {(void*)opt_map_meta_data}, "set meta data information of outfile from infile", "outfile:infile" },
-    { "t", HAS_ARG, {(void*)opt_recording_time}, "set the recording time", "duration" },
-    { "fs", HAS_ARG | OPT_INT, {(void*)&limit_filesize}, "set the limit file size", "limit_size" }, //
-    { "ss", HAS_ARG, {(void*)opt_start_time}, "set the start time offset", "time_off" },
-    { "itsoffset", HAS_ARG, {(void*)opt_input_ts_offset}, "set the input ts offset", "time_off" },
-    { "title", HAS_ARG | OPT_STRING, {(void*)&str_title}, "set the title", "string" },
-    { "timestamp", HAS_ARG, {(void*)&opt_rec_timestamp}, "set the timestamp", "time" },
-    { "author", HAS_ARG | OPT_STRING, {(void*)&str_author}, "set the author", "string" },
-    { "copyright", HAS_ARG | OPT_STRING, {(void*)&str_copyright}, "set the copyright", "string" },
-    { "comment", HAS_ARG | OPT_STRING, {(void*)&str_comment}, "set the comment", "string" },
-    { "album", HAS_ARG | OPT_STRING, {(void*)&str_album}, "set the album", "string" },
-    { "benchmark", OPT_BOOL | OPT_EXPERT, {(void*)&do_benchmark},
-      "add timings for benchmarking" },
-    { "dump", OPT_BOOL | OPT_EXPERT, {(void*)&do_pkt_dump},
-      "dump each input packet" },
-    { "hex", OPT_BOOL | OPT_EXPERT, {(void*)&do_hex_dump},
-      "when dumping packets, also dump the payload" },
-    { "re", OPT_BOOL | OPT_EXPERT, {(void*)&rate_emu}, "read input at native frame rate", "" },
-    { "loop_input", OPT_BOOL | OPT_EXPERT, {(void*)&loop_input}, "loop (current only works with images)" },
-    { "loop_output", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&loop_output}, "number of times to loop output in formats that support looping (0 loops forever)", "" },
-    { "v", HAS_ARG, {(void*)opt_verbose}, "control amount of logging", "verbose" },
-    { "target", HAS_ARG, {(void*)opt_target}, "specify target file type (\"vcd\", \"svcd\", \"dvd\", \"dv\", \"dv50\", \"pal-vcd\", \"ntsc-svcd\", ...)", "type" },
-    { "threads", HAS_ARG | OPT_EXPERT, {(void*)opt_thread_count}, "thread count", "count" },
-    { "vsync", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&video_sync_method}, "video sync method", "" },
-    { "async", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&audio_sync_method}, "audio sync method", "" },
-    { "vglobal", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&video_global_header}, "video global header storage type", "" },
-    { "copyts", OPT_BOOL | OPT_EXPERT, {(void*)&copy_ts}, "copy timestamps" },
-    { "shortest", OPT_BOOL | OPT_EXPERT, {(void*)&opt_shortest}, "finish encoding within shortest input" }, //
-    { "dts_delta_threshold", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&dts_delta_threshold}, "timestamp discontinuity delta threshold", "" },
-
-    /* video options */
-    { "vframes", OPT_INT | HAS_ARG | OPT_VIDEO, {(void*)&max_frames[CODEC_TYPE_VIDEO]}, "set the number of video frames to record", "number" },
-    { "aframes", OPT_INT | HAS_ARG | OPT_AUDIO, {(void*)&max_frames[CODEC_TYPE_AUDIO]}, "set the number of audio frames to record", "number" },
-    { "dframes", OPT_INT | HAS_ARG, {(void*)&max_frames[CODEC_TYPE_DATA]}, "set the number of data frames to record", "number" },
-    { "r", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_rate}, "set frame rate (Hz value, fraction or abbreviation)", "rate" },
-    { "s", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_size}, "set frame size (WxH or abbreviation)", "size" },
-    { "aspect", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_aspect_ratio}, "set aspect ratio (4:3, 16:9 or 1.3333, 1.7777)", "aspect" },
-    { "pix_fmt", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_frame_pix_fmt}, "set pixel format", "format" },
-    { "croptop", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_crop_top}, "set top crop band size (in pixels)", "size" },
-    { "cropbottom", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_crop_bottom}, "set bottom crop band size (in pixels)", "size" },
-    { "cropleft", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_crop_left}, "set left crop band size (in pixels)", "size" },
-    { "cropright", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_crop_right}, "set right crop band size (in pixels)", "size" },
-    { "padtop", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_pad_top}, "set top pad band size (in pixels)", "size" },
-    { "padbottom", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_pad_bottom}, "set bottom pad band size (in pixels)", "size" },
-    { "padleft", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_pad_left}, "set left pad band size (in pixels)", "size" },
-    { "padright", HAS_ARG | OPT_VIDEO, {(void*)opt_frame_pad_right}, "set right pad band size (in pixels)", "size" },
-    { "padcolor", HAS_ARG | OPT_VIDEO, {(void*)opt_pad_color}, "set color of pad bands (Hex 000000 thru FFFFFF)", "color" },
-    { "intra", OPT_BOOL | OPT_EXPERT | OPT_VIDEO, {(void*)&intra_only}, "use only intra frames"},
-    { "vn", OPT_BOOL | OPT_VIDEO, {(void*)&video_disable}, "disable video" },
-    { "vdt", OPT_INT | HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)&video_discard}, "discard threshold", "n" },
-    { "qscale", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_qscale}, "use fixed video quantiser scale (VBR)", "q" },
-    { "qdiff", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_qdiff}, "max difference between the quantiser scale (VBR)", "q" },
-    { "rc_eq", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_video_rc_eq}, "set rate control equation", "equation" },
-    { "rc_override", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_video_rc_override_string}, "rate control override for specific intervals", "override" },
-    { "vcodec", HAS_ARG | OPT_VIDEO, {(void*)opt_video_codec}, "force video codec ('copy' to copy stream)", "codec" },
-    { "me", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_motion_estimation}, "set motion estimation method",
-      "method" },
-    { "me_threshold", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_me_threshold}, "motion estimaton threshold",  "" },
-    { "ps", HAS_ARG | OPT_EXPERT, {(void*)opt_packet_size}, "set packet size in bits", "size" },
-    { "strict", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_strict}, "how strictly to follow the standards", "strictness" },
-    { "sameq", OPT_BOOL | OPT_VIDEO, {(void*)&same_quality},
-      "use same video quality as source (implies VBR)" },
-    { "pass", HAS_ARG | OPT_VIDEO, {(void*)&opt_pass}, "select the pass number (1 or 2)", "n" },
-    { "passlogfile", HAS_ARG | OPT_STRING | OPT_VIDEO, {(void*)&pass_logfilename}, "select two pass log file name", "file" },
-    { "deinterlace", OPT_BOOL | OPT_EXPERT | OPT_VIDEO, {(void*)&do_deinterlace},
-      "deinterlace pictures" },
-    { "psnr", OPT_BOOL | OPT_EXPERT | OPT_VIDEO, {(void*)&do_psnr}, "calculate PSNR of compressed frames" },
-    { "vstats", OPT_BOOL | OPT_EXPERT | OPT_VIDEO, {(void*)&do_vstats}, "dump video coding statistics to file" },
-    { "vhook", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)add_frame_hooker}, "insert video processing module", "module" },
-    { "intra_matrix", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_intra_matrix}, "specify intra matrix coeffs", "matrix" },
-    { "inter_matrix", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_inter_matrix}, "specify inter matrix coeffs", "matrix" },
-    { "top", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_top_field_first}, "top=1/bottom=0/auto=-1 field first", "" },
-    { "dc", OPT_INT | HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)&intra_dc_precision}, "intra_dc_precision", "precision" },
-    { "vtag", HAS_ARG | OPT_EXPERT | OPT_VIDEO, {(void*)opt_video_tag}, "force video tag/fourcc", "fourcc/tag" },
-    { "newvideo", OPT_VIDEO, {(void*)opt_new_video_stream}, "add a new video stream to the current output stream" },
-    { "qphist", OPT_BOOL | OPT_EXPERT | OPT_VIDEO, { (void *)&qp_hist }, "show QP histogram" },
-
-    /* audio options */
-    { "ab", HAS_ARG | OPT_AUDIO, {(void*)opt_audio_bitrate}, "set audio bitrate (in kbit/s)", "bitrate", },
-    { "aq", OPT_FLOAT | HAS_ARG | OPT_AUDIO, {(void*)&audio_qscale}, "set audio quality (codec-specific)", "quality", },
-    { "ar", HAS_ARG | OPT_AUDIO, {(void*)opt_audio_rate}, "set audio sampling rate (in Hz)", "rate" },
-    { "ac", HAS_ARG | OPT_AUDIO, {(void*)opt_audio_channels}, "set number of audio channels", "channels" },
-    { "an", OPT_BOOL | OPT_AUDIO, {(void*)&audio_disable}, "disable audio" },
-    { "acodec", HAS_ARG | OPT_AUDIO, {(void*)opt_audio_codec}, "force audio codec ('copy' to copy stream)", "codec" },
-    { "atag", HAS_ARG | OPT_EXPERT | OPT_AUDIO, {(void*)opt_audio_tag}, "force audio tag/fourcc", "fourcc/tag" },
-    { "vol", OPT_INT | HAS_ARG | OPT_AUDIO, {(void*)&audio_volume}, "change audio volume (256=normal)" , "volume" }, //
-    { "newaudio", OPT_AUDIO, {(void*)opt_new_audio_stream}, "add a new audio stream to the current output stream" },
-    { "alang", HAS_ARG | OPT_STRING | OPT_AUDIO, {(void *)&audio_language}, "set the ISO 639 language code (3 letters) of the current audio stream" , "code" },
-
-    /* subtitle options */
-    { "scodec", HAS_ARG | OPT_SUBTITLE, {(void*)opt_subtitle_codec}, "force subtitle codec ('copy' to copy stream)", "codec" },
-    { "newsubtitle", OPT_SUBTITLE, {(void*)opt_new_subtitle_stream}, "add a new subtitle stream to the current output stream" },
-    { "slang", HAS_ARG | OPT_STRING | OPT_SUBTITLE, {(void *)&subtitle_language}, "set the ISO 639 language code (3 letters) of the current subtitle stream" , "code" },
-
-    /* grab options */
-    { "vd", HAS_ARG | OPT_EXPERT | OPT_VIDEO | OPT_GRAB, {(void*)opt_video_device}, "set video grab device", "device" },
-    { "vc", HAS_ARG | OPT_EXPERT | OPT_VIDEO | OPT_GRAB, {(void*)opt_video_channel}, "set video grab channel (DV1394 only)", "channel" },
-    { "tvstd", HAS_ARG | OPT_EXPERT | OPT_VIDEO | OPT_GRAB, {(void*)opt_video_standard}, "set television standard (NTSC, PAL (SECAM))", "standard" },
-    { "ad", HAS_ARG | OPT_EXPERT | OPT_AUDIO | OPT_GRAB, {(void*)opt_audio_device}, "set audio device", "device" },
-
-    /* G.2 grab options */
-    { "grab", HAS_ARG | OPT_EXPERT | OPT_GRAB, {(void*)opt_grab}, "request grabbing using", "format" },
-    { "gd", HAS_ARG | OPT_EXPERT | OPT_VIDEO | OPT_GRAB, {(void*)opt_grab_device}, "set grab device", "device" },
-
-    /* muxer options */
-    { "muxdelay", OPT_FLOAT | HAS_ARG | OPT_EXPERT, {(void*)&mux_max_delay}, "set the maximum demux-decode delay", "seconds" },
-    { "muxpreload", OPT_FLOAT | HAS_ARG | OPT_EXPERT, {(void*)&mux_preload}, "set the initial demux-decode delay", "seconds" },
-
-    { "absf", HAS_ARG | OPT_AUDIO | OPT_EXPERT, {(void*)opt_audio_bsf}, "", "bitstream filter" },
-    { "vbsf", HAS_ARG | OPT_VIDEO | OPT_EXPERT, {(void*)opt_video_bsf}, "", "bitstream filter" },
-
-    { "default", OPT_FUNC2 | HAS_ARG | OPT_AUDIO | OPT_VIDEO | OPT_EXPERT, {(void*)opt_default}, "generic catch all option", "" },
-    { NULL, },
+/*
+ * async: protocol. Output is collected in two large buffers, one filled
+ * by the muxer while the other is written by an I/O thread, so the
+ * encoder does not wait for slow (network, USB) storage. Seeks, used by
+ * the muxer for the trailer, wait for pending writes. Data is synced
+ * once, at close.
+ */
+#define ASYNC_BUF_SIZE (1024 * 1024)
+
+typedef struct AsyncFile {
+    int fd;
+    uint8_t *buf[2];
+    int cur;                 /* buffer filled by muxer */
+    int fill;
+    int pending;             /* bytes of buf[!cur] being written, 0 when idle */
+    int error;
+    int quit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} AsyncFile;
+
+static int write_all(int fd, const uint8_t *buf, int len)
+{
+    while (len > 0) {
+        int ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void *async_file_thread(void *arg)
+{
+    AsyncFile *f = arg;
+
+    pthread_mutex_lock(&f->lock);
+    for(;;) {
+        uint8_t *buf;
+        int len, ret;
+
+        while (!f->pending && !f->quit)
+            pthread_cond_wait(&f->cond, &f->lock);
+        if (!f->pending)
+            break;
+        /* cur does not change while a write is pending */
+        buf = f->buf[!f->cur];
+        len = f->pending;
+        pthread_mutex_unlock(&f->lock);
+
+        ret = write_all(f->fd, buf, len);
+
+        pthread_mutex_lock(&f->lock);
+        if (ret < 0 && !f->error)
+            f->error = ret;
+        f->pending = 0;
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
+}
+
+/* hand filled buffer to the I/O thread, waiting for the previous one.
+   wait = 1 also waits until it is written */
+static int async_file_submit(AsyncFile *f, int wait)
+{
+    int ret;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->pending)
+        pthread_cond_wait(&f->cond, &f->lock);
+    if (f->fill) {
+        f->pending = f->fill;
+        f->cur = !f->cur;
+        f->fill = 0;
+        pthread_cond_broadcast(&f->cond);
+    }
+    while (wait && f->pending)
+        pthread_cond_wait(&f->cond, &f->lock);
+    ret = f->error;
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+static int async_open(URLContext *h, const char *filename, int flags)
+{
+    AsyncFile *f;
+
+    if (flags != URL_WRONLY)
+        return -EINVAL;
+    strstart(filename, "async:", &filename);
+
+    f = av_mallocz(sizeof(AsyncFile));
+    if (!f)
+        return -ENOMEM;
+    f->buf[0] = av_malloc(ASYNC_BUF_SIZE);
+    f->buf[1] = av_malloc(ASYNC_BUF_SIZE);
+    f->fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (!f->buf[0] || !f->buf[1] || f->fd < 0)
+        goto fail;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    if (pthread_create(&f->thread, NULL, async_file_thread, f)) {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        goto fail;
+    }
+    h->priv_data = f;
+    return 0;
+ fail:
+    if (f->fd >= 0)
+        close(f->fd);
+    av_free(f->buf[0]);
+    av_free(f->buf[1]);
+    av_free(f);
+    return -ENOENT;
+}
+
+static int async_read(URLContext *h, unsigned char *buf, int size)
+{
+    return -1;
+}
+
+static int async_write(URLContext *h, unsigned char *buf, int size)
+{
+    AsyncFile *f = h->priv_data;
+    int done = 0;
+
+    while (done < size) {
+        int len = FFMIN(size - done, ASYNC_BUF_SIZE - f->fill);
+        memcpy(f->buf[f->cur] + f->fill, buf + done, len);
+        f->fill += len;
+        done += len;
+        if (f->fill == ASYNC_BUF_SIZE && async_file_submit(f, 0) < 0)
+            return -1;
+    }
+    return size;
+}
+
+static offset_t async_seek(URLContext *h, offset_t pos, int whence)
+{
+    AsyncFile *f = h->priv_data;
+
+    if (async_file_submit(f, 1) < 0)
+        return -1;
+    return lseek(f->fd, pos, whence);
+}
+
+static int async_close(URLContext *h)
+{
+    AsyncFile *f = h->priv_data;
+    int ret = async_file_submit(f, 1);
+
+    pthread_mutex_lock(&f->lock);
+    f->quit = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    pthread_join(f->thread, NULL);
+
+    if (fdatasync(f->fd) < 0 && !ret)
+        ret = -errno;
+    if (close(f->fd) < 0 && !ret)
+        ret = -errno;
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    av_free(f->buf[0]);
+    av_free(f->buf[1]);
+    av_free(f);
+    return ret;
+}
+
+static URLProtocol async_protocol = {
+    "async",
+    async_open,
+    async_read,
+    async_write,
+    async_seek,
+    async_close,
 };
 
-static void show_banner(void)
+/*
+ * readahead: and mmap: protocols for input, URL is proto:window_kb:path.
+ * readahead keeps a ring of window bytes filled by a background thread.
+ * mmap maps the whole file and asks the kernel for the next window with
+ * madvise. Both tell the kernel reading is sequential.
+ */
+#define READAHEAD_CHUNK (256 * 1024)
+
+typedef struct Prefetch {
+    int fd;
+    int64_t file_size;
+    int64_t pos;             /* demuxer position */
+    int window;
+
+    /* mmap */
+    uint8_t *map;
+    int64_t advised;         /* end of range already passed to madvise */
+
+    /* readahead thread, ring of window bytes starting at pos */
+    uint8_t *buf;
+    int rpos, count;
+    int64_t file_pos;        /* where thread reads next */
+    int gen;                 /* bumped by seeks, older reads are dropped */
+    int eof, error, quit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Prefetch;
+
+static void *readahead_thread(void *arg)
 {
-    fprintf(stderr, "FFmpeg version " FFMPEG_VERSION ", Copyright (c) 2000-2004 Fabrice Bellard\n");
-    fprintf(stderr, "  configuration: " FFMPEG_CONFIGURATION "\n");
-    fprintf(stderr, "  libavutil version: " AV_STRINGIFY(LIBAVUTIL_VERSION) "\n");
-    fprintf(stderr, "  libavcodec version: " AV_STRINGIFY(LIBAVCODEC_VERSION) "\n");
-    fprintf(stderr, "  libavformat version: " AV_STRINGIFY(LIBAVFORMAT_VERSION) "\n");
-    fprintf(stderr, "  built on " __DATE__ " " __TIME__);
-#ifdef __GNUC__
-    fprintf(stderr, ", gcc: " __VERSION__ "\n");
-#else
-    fprintf(stderr, ", using a non-gcc compiler\n");
-#endif
+    Prefetch *f = arg;
+
+    pthread_mutex_lock(&f->lock);
+    while (!f->quit) {
+        int wpos, len, gen, err;
+        int64_t pos;
+        ssize_t ret;
+
+        if (f->count == f->window || f->eof || f->error) {
+            pthread_cond_wait(&f->cond, &f->lock);
+            continue;
+        }
+        wpos = (f->rpos + f->count) % f->window;
+        len = FFMIN(f->window - f->count, f->window - wpos);
+        len = FFMIN(len, READAHEAD_CHUNK);
+        pos = f->file_pos;
+        gen = f->gen;
+        pthread_mutex_unlock(&f->lock);
+
+        /* free part of the ring is only touched here */
+        ret = pread(f->fd, f->buf + wpos, len, pos);
+        err = errno;
+
+        pthread_mutex_lock(&f->lock);
+        if (gen != f->gen)
+            continue;
+        if (ret > 0) {
+            f->count += ret;
+            f->file_pos += ret;
+        } else if (!ret) {
+            f->eof = 1;
+        } else if (err != EINTR) {
+            f->error = 1;
+        }
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
 }
 
-static void show_help(void)
+static int prefetch_start_thread(Prefetch *f)
 {
+    f->buf = av_malloc(f->window);
+    if (!f->buf)
+        return -1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    if (pthread_create(&f->thread, NULL, readahead_thread, f)) {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        av_freep(&f->buf);
+        return -1;
+    }
+    return 0;
 }
 
-static void show_license(void)
+static int prefetch_open(URLContext *h, const char *filename, int flags)
 {
-    show_banner();
-#ifdef CONFIG_GPL
-    printf(
-    "This program is free software; you can redistribute it and/or modify\n"
-    "it under the terms of the GNU General Public License as published by\n"
-    "the Free Software Foundation; either version 2 of the License, or\n"
-    "(at your option) any later version.\n"
-    "\n"
-    "This program is distributed in the hope that it will be useful,\n"
-    "but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
-    "MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the\n"
-    "GNU General Public License for more details.\n"
-    "\n"
-    "You should have received a copy of the GNU General Public License\n"
-    "along with this program; if not, write to the Free Software\n"
-    "Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA\n"
-    );
-#else
-    printf(
-    "This library is free software; you can redistribute it and/or\n"
-    "modify it under the terms of the GNU Lesser General Public\n"
-    "License as published by the Free Software Foundation; either\n"
-    "version 2 of the License, or (at your option) any later version.\n"
-    "\n"
-    "This library is distributed in the hope that it will be useful,\n"
-    "but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
-    "MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU\n"
-    "Lesser General Public License for more details.\n"
-    "\n"
-    "You should have received a copy of the GNU Lesser General Public\n"
-    "License along with this library; if not, write to the Free Software\n"
-    "Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA\n"
-    );
+    Prefetch *f;
+    struct stat st;
+    char *end;
+    int use_mmap;
+
+    if (flags != URL_RDONLY)
+        return -EINVAL;
+    use_mmap = strstart(filename, "mmap:", &filename);
+    if (!use_mmap)
+        strstart(filename, "readahead:", &filename);
+
+    f = av_mallocz(sizeof(Prefetch));
+    if (!f)
+        return -ENOMEM;
+    f->window = strtol(filename, &end, 10) * 1024;
+    if (*end == ':')
+        filename = end + 1;
+    if (f->window < READAHEAD_CHUNK)
+        f->window = READAHEAD_CHUNK;
+
+    f->fd = open(filename, O_RDONLY);
+    if (f->fd < 0 || fstat(f->fd, &st) < 0)
+        goto fail;
+    f->file_size = st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
-    exit(1);
+
+    /* large file on 32 bit host does not fit in address space */
+    if (use_mmap && f->file_size > 0 && f->file_size == (size_t)f->file_size) {
+        f->map = mmap(NULL, f->file_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+        if (f->map == MAP_FAILED)
+            f->map = NULL;
+        else
+            madvise(f->map, f->file_size, MADV_SEQUENTIAL);
+    }
+    if (!f->map && prefetch_start_thread(f) < 0)
+        goto fail;
+    h->priv_data = f;
+    return 0;
+ fail:
+    if (f->fd >= 0)
+        close(f->fd);
+    av_free(f);
+    return -ENOENT;
 }
 
+static int prefetch_read(URLContext *h, unsigned char *buf, int size)
+{
+    Prefetch *f = h->priv_data;
+    int len;
+
+    if (f->map) {
+        if (f->pos >= f->file_size)
+            return 0;
+        len = FFMIN(size, f->file_size - f->pos);
+        if (f->pos + len > f->advised) {
+            long page = sysconf(_SC_PAGESIZE);
+            int64_t start = FFMAX(f->advised, f->pos) & ~(int64_t)(page - 1);
+            f->advised = FFMIN(f->pos + f->window, f->file_size);
+            madvise(f->map + start, f->advised - start, MADV_WILLNEED);
+        }
+        memcpy(buf, f->map + f->pos, len);
+        f->pos += len;
+        return len;
+    }
 
-void parse_arg_file(const char *filename)
+    pthread_mutex_lock(&f->lock);
+    while (!f->count && !f->eof && !f->error)
+        pthread_cond_wait(&f->cond, &f->lock);
+    if (!f->count) {
+        len = f->error ? -1 : 0;
+        pthread_mutex_unlock(&f->lock);
+        return len;
+    }
+    len = FFMIN(size, f->count);
+    len = FFMIN(len, f->window - f->rpos);
+    pthread_mutex_unlock(&f->lock);
+
+    /* filled part of the ring is only touched by the reader */
+    memcpy(buf, f->buf + f->rpos, len);
+
+    pthread_mutex_lock(&f->lock);
+    f->rpos = (f->rpos + len) % f->window;
+    f->count -= len;
+    f->pos += len;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    return len;
+}
+
+static int prefetch_write(URLContext *h, unsigned char *buf, int size)
 {
-    opt_output_file(filename);
+    return -1;
 }
 
+static offset_t prefetch_seek(URLContext *h, offset_t pos, int whence)
+{
+    Prefetch *f = h->priv_data;
+
+    if (whence == SEEK_CUR)
+        pos += f->pos;
+    else if (whence == SEEK_END)
+        pos += f->file_size;
+    else if (whence != SEEK_SET)
+        return -1;
+    if (pos < 0)
+        return -1;
+
+    if (f->map) {
+        f->pos = f->advised = pos;
+        return pos;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    if (pos >= f->pos && pos - f->pos <= f->count) {
+        /* already read ahead, skip to it */
+        int skip = pos - f->pos;
+        f->rpos = (f->rpos + skip) % f->window;
+        f->count -= skip;
+    } else {
+        f->gen++;
+        f->rpos = f->count = 0;
+        f->eof = f->error = 0;
+        f->file_pos = pos;
+    }
+    f->pos = pos;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    return pos;
+}
+
+static int prefetch_close(URLContext *h)
+{
+    Prefetch *f = h->priv_data;
+
+    if (f->map) {
+        munmap(f->map, f->file_size);
+    } else {
+        pthread_mutex_lock(&f->lock);
+        f->quit = 1;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+        pthread_join(f->thread, NULL);
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        av_free(f->buf);
+    }
+    close(f->fd);
+    av_free(f);
+    return 0;
+}
+
+static URLProtocol readahead_protocol = {
+    "readahead",
+    prefetch_open,
+    prefetch_read,
+    prefetch_write,
+    prefetch_seek,
+    prefetch_close,
+};
+
+static URLProtocol mmap_protocol = {
+    "mmap",
+    prefetch_open,
+    prefetch_read,
+    prefetch_write,
+    prefetch_seek,
+    prefetch_close,
+};
+
+/* open output file, through async: when job asks for it */
+static int output_fopen(ByteIOContext *pb, const char *filename, int async)
+{
+    char name[1024];
+
+    if (!async)
+        return url_fopen(pb, filename, URL_WRONLY);
+    snprintf(name, sizeof(name), "async:%s", filename);
+    return url_fopen(pb, name, URL_WRONLY);
+}
 
 void ffmpeg_init()
 {
     av_register_all();
-
-    avctx_opts= avcodec_alloc_context();
+    register_protocol(&async_protocol);
+    register_protocol(&readahead_protocol);
+    register_protocol(&mmap_protocol);
 }
 
 void ffmpeg_deinit()
@@ -3781,74 +4281,483 @@ void ffmpeg_deinit()
     av_free_static();
 }
 
-int ffmpeg_do_transcode(char *in_file, char *out_file, int avitrate, int vbitrate,
-                int size_v, int size_h, int pad_v, int pad_h, char *title,
+void ffmpeg_lock()
+{
+    pthread_mutex_lock(&codec_lock);
+}
+
+void ffmpeg_unlock()
+{
+    pthread_mutex_unlock(&codec_lock);
+}
+
+void ffmpeg_job_set_range(FFmpegJob *job, int64_t start_time, int64_t end_time)
+{
+    job->start_time = start_time;
+    job->recording_time = end_time ? end_time - start_time : 0;
+    job->cut_at_start = 1;
+}
+
+void ffmpeg_job_set_async_output(FFmpegJob *job, int on)
+{
+    job->async_output = on;
+}
+
+void ffmpeg_job_set_stream_copy(FFmpegJob *job, int video, int audio)
+{
+    job->video_stream_copy = video;
+    job->audio_stream_copy = audio;
+}
+
+void ffmpeg_job_set_prefetch(FFmpegJob *job, int mode, int window)
+{
+    job->input_prefetch = mode;
+    if (window > 0)
+        job->prefetch_window = window;
+}
+
+void ffmpeg_job_set_lowres(FFmpegJob *job, int on)
+{
+    job->decode_lowres = on;
+}
+
+/* 4x4 and 2x2 idct are much cheaper than scaling a full picture down */
+#define MAX_LOWRES 2
+
+int ffmpeg_set_decode_scale(AVCodecContext *enc, int dst_w, int dst_h)
+{
+    int lowres = 0;
+
+    if (dst_w <= 0 || dst_h <= 0)
+        return 0;
+
+    switch (enc->codec_id) {
+    case CODEC_ID_MPEG1VIDEO:
+    case CODEC_ID_MPEG2VIDEO:
+    case CODEC_ID_MPEG4:
+    case CODEC_ID_H263:
+    case CODEC_ID_MSMPEG4V3:
+    case CODEC_ID_MJPEG:
+        break;
+    case CODEC_ID_H264:
+        /* no lowres here, skip the next most expensive step */
+        if (enc->width >= 2 * dst_w && enc->height >= 2 * dst_h)
+            enc->skip_loop_filter = AVDISCARD_ALL;
+        return 0;
+    default:
+        return 0;
+    }
+
+    while (lowres < MAX_LOWRES &&
+           enc->width >= dst_w << (lowres + 1) && enc->height >= dst_h << (lowres + 1))
+        lowres++;
+    if (!lowres)
+        return 0;
+
+    /* avcodec_open derives width from coded size, don't let it shift twice */
+    if (!enc->coded_width || !enc->coded_height) {
+        enc->coded_width = enc->width;
+        enc->coded_height = enc->height;
+    }
+    enc->lowres = lowres;
+    enc->flags |= CODEC_FLAG_EMU_EDGE;
+    enc->width = -((-enc->coded_width) >> lowres);
+    enc->height = -((-enc->coded_height) >> lowres);
+    return lowres;
+}
+
+/* how many packets to read after a seek looking for a keyframe */
+#define SPLIT_MAX_PACKETS 4096
+
+int ffmpeg_find_split_points(char *in_file, int64_t *points, int nb_points)
+{
+    AVFormatContext *ic;
+    int i, n, ret, video_index = -1;
+    int64_t start;
+
+    ffmpeg_lock();
+    ret = av_open_input_file(&ic, in_file, NULL, 0, NULL);
+    if (ret >= 0 && (ret = av_find_stream_info(ic)) < 0)
+        av_close_input_file(ic);
+    ffmpeg_unlock();
+    if (ret < 0)
+        return 0;
+
+    for(i=0;i<ic->nb_streams;i++) {
+        if (ic->streams[i]->codec->codec_type == CODEC_TYPE_VIDEO) {
+            video_index = i;
+            break;
+        }
+    }
+    start = (ic->start_time != AV_NOPTS_VALUE) ? ic->start_time : 0;
+
+    n = 0;
+    points[n++] = 0;
+    for(i=1; i<nb_points && video_index >= 0 && ic->duration != AV_NOPTS_VALUE; i++) {
+        AVStream *st = ic->streams[video_index];
+        int64_t key = AV_NOPTS_VALUE;
+        AVPacket pkt;
+        int j;
+
+        /* same seek opt_input_file will do, so segment starts right here */
+        if (av_seek_frame(ic, -1, start + ic->duration * i / nb_points, AVSEEK_FLAG_BACKWARD) < 0)
+            break;
+        for(j=0; j<SPLIT_MAX_PACKETS && key == AV_NOPTS_VALUE; j++) {
+            if (av_read_frame(ic, &pkt) < 0)
+                break;
+            if (pkt.stream_index == video_index && (pkt.flags & PKT_FLAG_KEY)) {
+                if (pkt.pts != AV_NOPTS_VALUE)
+                    key = av_rescale_q(pkt.pts, st->time_base, AV_TIME_BASE_Q) - start;
+                else if (pkt.dts != AV_NOPTS_VALUE)
+                    key = av_rescale_q(pkt.dts, st->time_base, AV_TIME_BASE_Q) - start;
+            }
+            av_free_packet(&pkt);
+        }
+        if (key == AV_NOPTS_VALUE || key <= points[n-1] || key >= ic->duration)
+            continue;
+        points[n++] = key;
+    }
+
+    ffmpeg_lock();
+    av_close_input_file(ic);
+    ffmpeg_unlock();
+    return n;
+}
+
+/* output streams of concat are stream copies of the first segment */
+static int concat_open_output(AVFormatContext *oc, AVFormatContext *ic, int async)
+{
+    AVFormatParameters params;
+    int i;
+
+    for(i=0;i<ic->nb_streams;i++) {
+        AVCodecContext *codec, *icodec = ic->streams[i]->codec;
+        AVStream *st = av_new_stream(oc, i);
+        if (!st)
+            return -1;
+        st->stream_copy = 1;
+        codec = st->codec;
+        codec->codec_id = icodec->codec_id;
+        codec->codec_type = icodec->codec_type;
+        codec->codec_tag = icodec->codec_tag;
+        codec->bit_rate = icodec->bit_rate;
+        if (icodec->extradata_size) {
+            /* input is closed after each segment, keep own copy */
+            codec->extradata = av_mallocz(icodec->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+            if (!codec->extradata)
+                return -1;
+            memcpy(codec->extradata, icodec->extradata, icodec->extradata_size);
+            codec->extradata_size = icodec->extradata_size;
+        }
+        switch(codec->codec_type) {
+        case CODEC_TYPE_AUDIO:
+            codec->sample_rate = icodec->sample_rate;
+            codec->channels = icodec->channels;
+            codec->frame_size = icodec->frame_size;
+            codec->block_align = icodec->block_align;
+            codec->time_base.num = 1;
+            codec->time_base.den = icodec->sample_rate;
+            break;
+        case CODEC_TYPE_VIDEO:
+            codec->pix_fmt = icodec->pix_fmt;
+            codec->width = icodec->width;
+            codec->height = icodec->height;
+            codec->has_b_frames = icodec->has_b_frames;
+            codec->time_base = icodec->time_base;
+            if (!codec->time_base.num || !codec->time_base.den) {
+                codec->time_base.num = 1001;
+                codec->time_base.den = 30000;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (output_fopen(&oc->pb, oc->filename, async) < 0) {
+        fprintf(stderr, "Could not open '%s'\n", oc->filename);
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    if (av_set_parameters(oc, &params) < 0 || av_write_header(oc) < 0) {
+        fprintf(stderr, "Could not write header for '%s'\n", oc->filename);
+        url_fclose(&oc->pb);
+        return -1;
+    }
+    return 0;
+}
+
+int ffmpeg_do_concat(char **in_files, int nb_in_files, int64_t *start_times,
+                     char *out_file, char *title, int async_output)
+{
+    AVFormatContext *oc, *ic;
+    int64_t next_dts[MAX_STREAMS], offset[MAX_STREAMS];
+    int i, k, ret = 0, header_written = 0, write_error = 0;
+
+    oc = av_alloc_format_context();
+    if (!oc)
+        return 0;
+    oc->oformat = guess_format("psp", 0, 0);
+    pstrcpy(oc->filename, sizeof(oc->filename), out_file);
+    if (title)
+        pstrcpy(oc->title, sizeof(oc->title), title);
+
+    for(i=0;i<nb_in_files;i++) {
+        AVPacket pkt;
+
+        ffmpeg_lock();
+        ret = av_open_input_file(&ic, in_files[i], NULL, 0, NULL);
+        if (ret >= 0 && (ret = av_find_stream_info(ic)) < 0)
+            av_close_input_file(ic);
+        ffmpeg_unlock();
+        if (ret < 0) {
+            fprintf(stderr, "%s: could not open segment\n", in_files[i]);
+            break;
+        }
+
+        if (!i) {
+            ret = concat_open_output(oc, ic, async_output);
+            header_written = (ret >= 0);
+            for(k=0;k<MAX_STREAMS;k++)
+                next_dts[k] = 0;
+        } else if (ic->nb_streams != oc->nb_streams) {
+            fprintf(stderr, "%s: streams differ from first segment\n", in_files[i]);
+            ret = -1;
+        }
+        if (ret < 0) {
+            ffmpeg_lock();
+            av_close_input_file(ic);
+            ffmpeg_unlock();
+            break;
+        }
+
+        /*
+         * Segment timestamps start from 0. Shift each one to where it was
+         * cut from the source, but never back over the previous segment:
+         * muxer needs monotonic dts.
+         */
+        for(k=0;k<oc->nb_streams;k++) {
+            offset[k] = FFMAX(next_dts[k],
+                av_rescale_q(start_times[i], AV_TIME_BASE_Q, oc->streams[k]->time_base));
+        }
+        while (av_read_frame(ic, &pkt) >= 0) {
+            AVStream *ist, *ost;
+
+            k = pkt.stream_index;
+            if (k >= oc->nb_streams) {
+                av_free_packet(&pkt);
+                continue;
+            }
+            ist = ic->streams[k];
+            ost = oc->streams[k];
+            if (pkt.pts != AV_NOPTS_VALUE)
+                pkt.pts = av_rescale_q(pkt.pts, ist->time_base, ost->time_base) + offset[k];
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                pkt.dts = av_rescale_q(pkt.dts, ist->time_base, ost->time_base) + offset[k];
+                next_dts[k] = FFMAX(next_dts[k],
+                    pkt.dts + FFMAX(1, av_rescale_q(pkt.duration, ist->time_base, ost->time_base)));
+            }
+            if (av_interleaved_write_frame(oc, &pkt) < 0)
+                write_error = 1;
+            av_free_packet(&pkt);
+            if (write_error)
+                break;
+        }
+
+        ffmpeg_lock();
+        av_close_input_file(ic);
+        ffmpeg_unlock();
+        if (write_error) {
+            fprintf(stderr, "%s: write error\n", out_file);
+            break;
+        }
+    }
+
+    if (header_written) {
+        if (av_write_trailer(oc) < 0)
+            write_error = 1;
+        /* with async: output, errors of the writer thread show up here */
+        if (url_fclose(&oc->pb) < 0)
+            write_error = 1;
+    }
+    for(k=0;k<oc->nb_streams;k++) {
+        av_free(oc->streams[k]->codec->extradata);
+        av_free(oc->streams[k]->codec);
+        av_free(oc->streams[k]);
+    }
+    av_free(oc);
+
+    return i == nb_in_files && !write_error;
+}
+
+FFmpegJob *ffmpeg_job_alloc()
+{
+    FFmpegJob *job = av_mallocz(sizeof(FFmpegJob));
+    if (!job)
+        return NULL;
+
+    /* same defaults ffmpeg.c has for its statics */
+    job->frame_pix_fmt = PIX_FMT_NONE;
+    job->padcolor[0] = 16;          /* default to black */
+    job->padcolor[1] = 128;
+    job->padcolor[2] = 128;
+    job->max_frames[0] = job->max_frames[1] = INT_MAX;
+    job->max_frames[2] = job->max_frames[3] = INT_MAX;
+    job->input_prefetch = FFMPEG_PREFETCH_THREAD;
+    job->prefetch_window = FFMPEG_PREFETCH_WINDOW;
+    job->decode_lowres = 1;
+    job->frame_rate = 25;
+    job->frame_rate_base = 1;
+    job->video_bit_rate = 200*1000;
+    job->video_qdiff = 3;
+    job->video_rc_eq = "tex^qComp";
+    job->me_method = ME_EPZS;
+    job->video_codec_id = CODEC_ID_NONE;
+    job->top_field_first = -1;
+    job->intra_dc_precision = 8;
+    job->loop_output = AVFMT_NOOUTPUTLOOP;
+    job->audio_sample_rate = 44100;
+    job->audio_bit_rate = 64000;
+    job->audio_qscale = QSCALE_NONE;
+    job->audio_channels = 1;
+    job->audio_codec_id = CODEC_ID_NONE;
+    job->subtitle_codec_id = CODEC_ID_NONE;
+    job->mux_preload = 0.5;
+    job->mux_max_delay = 0.7;
+    job->video_sync_method = 1;
+    job->audio_volume = 256;
+    job->verbose = 1;
+    job->thread_count = 1;
+    job->dts_delta_threshold = 10;
+    job->sws_flags = SWS_BICUBIC;
+    job->bit_buffer_size = 1024*256;
+
+    job->avctx_opts = avcodec_alloc_context();
+    if (!job->avctx_opts) {
+        av_free(job);
+        return NULL;
+    }
+    return job;
+}
+
+void ffmpeg_job_free(FFmpegJob *job)
+{
+    if (!job)
+        return;
+    if (job->fvstats)
+        fclose(job->fvstats);
+    av_free(job->bit_buffer);
+    av_free(job->audio_out);
+    job_buffer_free(&job->samples);
+    job_buffer_free(&job->deinterlace_buf);
+    av_free(job->subtitle_out);
+    av_free(job->opt_names);
+    av_free(job->avctx_opts);
+    av_free(job);
+}
+
+int ffmpeg_do_transcode(FFmpegJob *job, char *in_file, char *out_file, int avitrate, int vbitrate,
+                int size_v, int size_h, int pad_v, int pad_h, char *title, int threads,
                 int(*cb)(void *, int), void *ptr)
 {
         int i;
-        received_sigterm = 0;
-        file_overwrite = 1;
-        nb_input_files = nb_output_files = nb_stream_maps = nb_meta_data_maps = 0;
-
-        audio_disable = video_disable = 0;
-        recording_time = 0;
-        start_time = 0;
+        int64_t seg_start;
+        job->received_sigterm = 0;
+        job->error = 0;
+        job->file_overwrite = 1;
+
+        job->cpp_passed_ptr = ptr;
+        job->cpp_callback = cb;
+
+        // must be set before input is opened: used for decoder too.
+        // mpeg4 encoder refuses more than MAX_THREADS slices
+        if ( threads < 1 ) {
+            threads = 1;
+        } else if ( threads > FFMPEG_MAX_THREADS ) {
+            threads = FFMPEG_MAX_THREADS;
+        }
+        job->thread_count = threads;
 
-        cpp_passed_ptr = ptr;
-        cpp_callback = cb;
+        // set by ffmpeg_job_set_range, opt_input_file resets start_time
+        seg_start = job->start_time;
 
-        opt_input_file(in_file);
+        // decoded picture is not made smaller than active output area
+        job->lowres_width = size_h;
+        job->lowres_height = size_v;
+        opt_input_file(job, in_file);
+        if ( job->error ) {
+            goto done;
+        }
 
         // PSP codec params
-        audio_channels = 2;
-        audio_sample_rate = 24000;
-        frame_rate = 30000000;
-        frame_rate_base = 1001000;
+        job->audio_channels = 2;
+        job->audio_sample_rate = 24000;
+        job->frame_rate = 30000000;
+        job->frame_rate_base = 1001000;
+
+        // segment of longer movie: cut on the same frame grid the whole
+        // movie would have, so the pieces add up to the right frame count
+        if ( job->recording_time ) {
+            job->max_frames[CODEC_TYPE_VIDEO] =
+                av_rescale(seg_start + job->recording_time, job->frame_rate, (int64_t)job->frame_rate_base * AV_TIME_BASE) -
+                av_rescale(seg_start, job->frame_rate, (int64_t)job->frame_rate_base * AV_TIME_BASE);
+        }
 
         // size & padding
-        frame_width = size_h;
-        frame_height = size_v;
-        frame_padtop = frame_padbottom = pad_v;
-        frame_padleft = frame_padright = pad_h;
+        job->frame_width = size_h;
+        job->frame_height = size_v;
+        job->frame_padtop = job->frame_padbottom = pad_v;
+        job->frame_padleft = job->frame_padright = pad_h;
 
         // codecs
-        file_iformat = 0;
-        file_oformat = guess_format("psp", 0, 0);
+        job->file_iformat = 0;
+        job->file_oformat = guess_format("psp", 0, 0);
 
         // rates
-        video_bit_rate = vbitrate * 1000;
-        audio_bit_rate = avitrate * 1000;
+        job->video_bit_rate = vbitrate * 1000;
+        job->audio_bit_rate = avitrate * 1000;
 
-        str_title = title;
-        opt_output_file(out_file);
+        job->str_title = title;
+        opt_output_file(job, out_file);
 
 	// prevent opening stdin
-	using_stdin = 1;
+	job->using_stdin = 1;
 	
-    av_encode(output_files, nb_output_files, input_files, nb_input_files,
-              stream_maps, nb_stream_maps);
+    if ( !job->error ) {
+        int ret = av_encode(job);
+        if ( ret < 0 ) {
+            job_fail(job, ret);
+        }
+    }
 
+ done:
     /* close files */
-    for(i=0;i<nb_output_files;i++) {
+    for(i=0;i<job->nb_output_files;i++) {
         /* maybe av_close_output_file ??? */
-        AVFormatContext *s = output_files[i];
+        AVFormatContext *s = job->output_files[i];
         int j;
-        if (!(s->oformat->flags & AVFMT_NOFILE))
-            url_fclose(&s->pb);
+        /* async: output reports its write errors only on close */
+        if (!(s->oformat->flags & AVFMT_NOFILE)) {
+            int ret = url_fclose(&s->pb);
+            if (ret < 0)
+                job_fail(job, ret);
+        }
         for(j=0;j<s->nb_streams;j++)
             av_free(s->streams[j]);
         av_free(s);
     }
-    for(i=0;i<nb_input_files;i++) {
-        av_close_input_file(input_files[i]);
+    ffmpeg_lock();
+    for(i=0;i<job->nb_input_files;i++) {
+        av_close_input_file(job->input_files[i]);
     }
+    ffmpeg_unlock();
 
-    if(intra_matrix) {
-        av_free(intra_matrix);
+    if(job->intra_matrix) {
+        av_free(job->intra_matrix);
     }
-    if(inter_matrix) {
-        av_free(inter_matrix);
+    if(job->inter_matrix) {
+        av_free(job->inter_matrix);
     }
 
-        return 1;
+        return job->error == 0;
 }
@@ -0,0 +1,204 @@
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+#include <QtGui>
+
+#include "jobqueue.h"
+#include "avutils.h"
+#include "pspmovie.h"
+
+//
+// Worker thread
+//
+CTranscodeWorker::CTranscodeWorker(CJobQueue *queue) : QThread(queue)
+{
+	m_queue = queue;
+	m_busy = false;
+	m_job = 0;
+	m_frames_done = 0;
+}
+
+void CTranscodeWorker::run()
+{
+	CTranscode *job;
+	while ( (job = m_queue->TakeNext(this)) != 0 ) {
+		int id = job->Id();
+		emit m_queue->jobStarted(id);
+
+		if ( !job->Threads() ) {
+			job->SetThreads(m_queue->ThreadsPerJob());
+		}
+
+		// failed job ends alone, others keep running
+		bool ok = job->RunTranscode(*m_queue->m_ffmpeg, UpdateTranscodeProgress, this);
+		if ( ok && !m_queue->m_abort ) {
+			job->RunThumbnail(*m_queue->m_ffmpeg);
+		}
+
+		{
+			QMutexLocker locker(&m_queue->m_lock);
+			m_job = 0;
+		}
+		delete job;
+		// stopped job is not an error
+		if ( ok || m_queue->m_abort ) {
+			emit m_queue->jobFinished(id);
+		} else {
+			emit m_queue->jobFailed(id);
+		}
+	}
+}
+
+int CTranscodeWorker::UpdateTranscodeProgress(void *p, int num_of_frames_done)
+{
+	CTranscodeWorker *This = (CTranscodeWorker *)p;
+	This->m_frames_done = num_of_frames_done / 2;
+
+	// non-zero return keeps encoder loop going
+	return !This->m_queue->m_abort;
+}
+
+//
+// Job queue
+//
+CJobQueue::CJobQueue(CFFmpeg_Glue *ffmpeg, int max_jobs)
+{
+	m_ffmpeg = ffmpeg;
+	m_running = 0;
+	m_abort = false;
+
+	if ( max_jobs <= 0 ) {
+		max_jobs = GetNumberOfCpus();
+	}
+	for(int i = 0; i < max_jobs; i++) {
+		m_workers.push_back(new CTranscodeWorker(this));
+	}
+}
+
+CJobQueue::~CJobQueue()
+{
+	Abort();
+	Wait();
+	// workers are children of the queue, deleted by QObject
+}
+
+void CJobQueue::Add(CTranscode *job)
+{
+	CTranscodeWorker *idle = 0;
+	{
+		QMutexLocker locker(&m_lock);
+
+		if ( m_abort ) {
+			// still stopping after Abort()
+			emit jobDropped(job->Id());
+			delete job;
+			return;
+		}
+		m_pending.push_back(job);
+
+		if ( m_running == (int)m_workers.size() ) {
+			// will be picked up by first worker to finish
+			return;
+		}
+		for(std::vector<CTranscodeWorker *>::iterator i = m_workers.begin(); i != m_workers.end(); i++) {
+			CTranscodeWorker *w = *i;
+			if ( !w->m_busy ) {
+				w->m_busy = true;
+				m_running++;
+				idle = w;
+				break;
+			}
+		}
+	}
+	if ( idle ) {
+		// worker may still be on its way out of run(). It is past its
+		// last TakeNext, so join it without holding the lock
+		idle->wait();
+		idle->start();
+	}
+}
+
+CTranscode *CJobQueue::TakeNext(CTranscodeWorker *worker)
+{
+	QMutexLocker locker(&m_lock);
+
+	if ( m_abort || m_pending.empty() ) {
+		worker->m_busy = false;
+		m_running--;
+		if ( !m_running ) {
+			m_abort = false;
+			emit allDone();
+		}
+		return 0;
+	}
+	CTranscode *job = m_pending.front();
+	m_pending.pop_front();
+	worker->m_job = job;
+	worker->m_frames_done = 0;
+
+	return job;
+}
+
+void CJobQueue::Abort()
+{
+	QMutexLocker locker(&m_lock);
+
+	// flag is cleared by the last worker going idle
+	m_abort = (m_running != 0);
+	for(std::list<CTranscode *>::iterator i = m_pending.begin(); i != m_pending.end(); i++) {
+		emit jobDropped((*i)->Id());
+		delete *i;
+	}
+	m_pending.clear();
+}
+
+void CJobQueue::Wait()
+{
+	for(std::vector<CTranscodeWorker *>::iterator i = m_workers.begin(); i != m_workers.end(); i++) {
+		(*i)->wait();
+	}
+}
+
+int CJobQueue::ThreadsPerJob()
+{
+	QMutexLocker locker(&m_lock);
+
+	// single long movie gets all cpus, full queue one each. Pending jobs
+	// count too: they start on idle workers soon and share the same cpus
+	int jobs = m_running + m_pending.size();
+	if ( jobs > (int)m_workers.size() ) {
+		jobs = m_workers.size();
+	}
+	int threads = GetNumberOfCpus() / (jobs ? jobs : 1);
+	return threads ? threads : 1;
+}
+
+void CJobQueue::GetProgress(std::map<int, int> &frames)
+{
+	QMutexLocker locker(&m_lock);
+
+	for(std::vector<CTranscodeWorker *>::iterator i = m_workers.begin(); i != m_workers.end(); i++) {
+		CTranscodeWorker *w = *i;
+		if ( w->m_job ) {
+			frames[w->m_job->Id()] = w->m_frames_done;
+		}
+	}
+}
+
+bool CJobQueue::IsRunning()
+{
+	QMutexLocker locker(&m_lock);
+
+	return m_running != 0;
+}
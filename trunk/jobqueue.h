@@ -0,0 +1,109 @@
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <QThread>
+#include <QMutex>
+
+#include <list>
+#include <vector>
+#include <map>
+
+class CFFmpeg_Glue;
+class CTranscode;
+class CJobQueue;
+
+//
+// One slot of the worker pool. Keeps taking jobs from the queue
+// until there is nothing left, then exits.
+//
+class CTranscodeWorker : public QThread {
+		Q_OBJECT
+		CJobQueue *m_queue;
+
+		// guarded by queue lock
+		bool m_busy;
+
+		// current job, set and cleared under queue lock
+		CTranscode *m_job;
+
+		// written by encoder loop on every packet, sampled by gui. Plain
+		// int store, no locking or signals on the hot path
+		volatile int m_frames_done;
+
+		static int UpdateTranscodeProgress(void *, int);
+
+		friend class CJobQueue;
+	protected:
+		void run();
+	public:
+		CTranscodeWorker(CJobQueue *queue);
+};
+
+//
+// Transcode job queue. Up to MaxJobs() jobs are run at the same time,
+// each one on its own worker thread. When a job is finished, the worker
+// starts the next pending one right away.
+// Signals are emitted from worker threads, so connections to gui are
+// queued. Progress is not signalled: gui polls GetProgress() on a timer.
+//
+class CJobQueue : public QObject {
+		Q_OBJECT
+		CFFmpeg_Glue *m_ffmpeg;
+
+		QMutex m_lock;
+		std::list<CTranscode *> m_pending;
+		std::vector<CTranscodeWorker *> m_workers;
+		int m_running;
+
+		volatile bool m_abort;
+
+		CTranscode *TakeNext(CTranscodeWorker *worker);
+
+		// codec threads for a job with "auto" setting starting now
+		int ThreadsPerJob();
+
+		friend class CTranscodeWorker;
+	public:
+		// max_jobs = 0 means "one per cpu"
+		CJobQueue(CFFmpeg_Glue *ffmpeg, int max_jobs = 0);
+		~CJobQueue();
+
+		// queue takes ownership of job
+		void Add(CTranscode *job);
+
+		// drop pending jobs and stop running ones
+		void Abort();
+
+		// wait until all workers are finished
+		void Wait();
+
+		// frames done by each running job, by job id
+		void GetProgress(std::map<int, int> &frames);
+
+		bool IsRunning();
+		bool IsAborted() { return m_abort; }
+		int MaxJobs() { return m_workers.size(); }
+
+	signals:
+		void jobStarted(int job_id);
+		void jobFinished(int job_id);
+		void jobFailed(int job_id);
+		void jobDropped(int job_id);
+		void allDone();
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include "mainwin.h"
 #include "xferwin.h"
 #include "transcode.h"
+#include "jobqueue.h"
 #include "pspmovie.h"
 #include "pspdetect.h"
 
@@ -10,85 +11,154 @@ class CFFmpeg_Glue;
 
 MainWindow::MainWindow(CFFmpeg_Glue *gl) : QMainWindow(0)
 {
-	m_current_job = 0;
 	m_ffmpeg = gl;
 	ui.setupUi(this);
 	
 	ui.lcdNumberFrames->display(0);
 	ui.lcdNumberFramesTotal->display(0);
 	ui.progressBar->setValue(0);
-	m_current_job = 0;
+	m_batch_total_frames = m_batch_done_frames = 0;
+
+	ui.jobList->setHeaderLabels(QStringList() << tr("Movie") << tr("Progress"));
+	ui.jobList->setColumnWidth(0, 240);
+
+	m_queue = new CJobQueue(m_ffmpeg);
+	connect(m_queue, SIGNAL(jobStarted(int)), this, SLOT(jobStarted(int)));
+	connect(m_queue, SIGNAL(jobFinished(int)), this, SLOT(jobDone(int)));
+	connect(m_queue, SIGNAL(jobFailed(int)), this, SLOT(jobFailed(int)));
+	connect(m_queue, SIGNAL(jobDropped(int)), this, SLOT(jobDone(int)));
+	connect(m_queue, SIGNAL(allDone()), this, SLOT(allDone()));
+
+	m_progress_timer.setInterval(500);
+	connect(&m_progress_timer, SIGNAL(timeout()), this, SLOT(updateProgress()));
 }
 
 MainWindow::~MainWindow()
 {
+	delete m_queue;
 }
 
 void MainWindow::on_transcodeButton_clicked()
 {
-	//
-	// Check if transcode already running, so it's "Cancel" click
-	//
-	if ( m_current_job ) {
-		if ( QMessageBox::question(this, "PSPMovie", tr("Abort transcoding ?"),
-				QMessageBox::Yes, QMessageBox::No) == QMessageBox::Yes ) {
-			m_stop_transcode = true;
-		}
-		return;		
-	}
-	
 	TranscodeDialog dlg;
 	if ( !dlg.exec() ) {
 		return;
 	}
-	//
-	// begin transcoding
-	//
 	CTranscode *job = dlg.getJob();
 	if ( !job ) {
 		return;
 	}
-	m_current_job = job;
-	m_stop_transcode = false;
+	if ( !job->IsOK() ) {
+		QMessageBox::critical(this, "PSPMovie", job->InputError());
+		delete job;
+		return;
+	}
 
-	ui.lcdNumberFramesTotal->display(m_current_job->TotalFrames());
-	ui.lcdNumberFrames->display(0);
-	ui.progressBar->setValue(0);
-	m_last_update_frame = 0, m_last_update_time = time(0);
-	
-	ui.transcodeButton->setIcon(QPixmap(":/mainwin/images/cancel.png").scaled(64,64));
-	ui.transcodeButton->setToolTip(tr("Stop transcoding"));
-	ui.transcodeButton->setStatusTip(tr("Stop transcoding"));
-	
-	job->RunTranscode(*m_ffmpeg, UpdateTranscodeProgress, this);
-	job->RunThumbnail(*m_ffmpeg);
+	CJobRow row;
+	row.m_item = new QTreeWidgetItem(ui.jobList);
+	row.m_item->setText(0, job->ShortName());
+	row.m_item->setText(1, tr("queued"));
+	row.m_total_frames = job->TotalFrames();
+	row.m_frames_done = 0;
+	m_jobs[job->Id()] = row;
+
+	m_batch_total_frames += row.m_total_frames;
+	UpdateTotalProgress();
+	ui.stopButton->setEnabled(true);
+	if ( !m_progress_timer.isActive() ) {
+		m_progress_timer.start();
+	}
+
+	//
+	// begin transcoding - queue starts it as soon as worker is free
+	//
+	m_queue->Add(job);
+}
+
+void MainWindow::on_stopButton_clicked()
+{
+	if ( QMessageBox::question(this, "PSPMovie", tr("Abort transcoding ?"),
+			QMessageBox::Yes, QMessageBox::No) == QMessageBox::Yes ) {
+		m_queue->Abort();
+	}
+}
+
+void MainWindow::jobStarted(int job_id)
+{
+	if ( !m_jobs.count(job_id) ) {
+		return;
+	}
+	m_jobs[job_id].m_item->setText(1, "0%");
+}
+
+void MainWindow::updateProgress()
+{
+	std::map<int, int> frames;
+	m_queue->GetProgress(frames);
+
+	for(std::map<int, int>::iterator i = frames.begin(); i != frames.end(); i++) {
+		if ( !m_jobs.count(i->first) ) {
+			continue;
+		}
+		CJobRow &row = m_jobs[i->first];
+		if ( row.m_frames_done == i->second ) {
+			continue;
+		}
+		row.m_frames_done = i->second;
+		if ( row.m_total_frames ) {
+			row.m_item->setText(1, QString("%1%").arg((int)((qint64)i->second*100/row.m_total_frames)));
+		}
+	}
+	UpdateTotalProgress();
+}
+
+void MainWindow::jobDone(int job_id)
+{
+	if ( !m_jobs.count(job_id) ) {
+		return;
+	}
+	CJobRow &row = m_jobs[job_id];
+	m_batch_done_frames += row.m_total_frames;
+	delete row.m_item;
+	m_jobs.erase(job_id);
 	
+	UpdateTotalProgress();
+}
+
+void MainWindow::jobFailed(int job_id)
+{
+	if ( !m_jobs.count(job_id) ) {
+		return;
+	}
+	statusBar()->showMessage(tr("%1: transcoding failed").arg(m_jobs[job_id].m_item->text(0)));
+	jobDone(job_id);
+}
+
+void MainWindow::allDone()
+{
+	if ( !m_jobs.empty() ) {
+		// new job was added while last worker was finishing
+		return;
+	}
+	m_progress_timer.stop();
+	m_batch_total_frames = m_batch_done_frames = 0;
 	ui.lcdNumberFrames->display(0);
 	ui.lcdNumberFramesTotal->display(0);
 	ui.progressBar->setValue(0);
-	m_last_update_frame = 0, m_last_update_time = time(0);
-	
-	delete m_current_job;
-	m_current_job = 0;
-	ui.transcodeButton->setIcon(QPixmap(":/mainwin/images/folder_video.png").scaled(128,128));
-	ui.transcodeButton->setToolTip(tr("Transcode movie to PSP format"));
-	ui.transcodeButton->setStatusTip(tr("Transcode movie to PSP format"));
+	ui.stopButton->setEnabled(false);
 }
 
-int MainWindow::UpdateTranscodeProgress(void *p, int num_of_frames_done)
+void MainWindow::UpdateTotalProgress()
 {
-	MainWindow *This = (MainWindow *)p;
-	num_of_frames_done /= 2;
-	//printf("this=%p, progress=%d of %d\r", This, progress, This->m_current_job->TotalFrames());
-	if ( ((num_of_frames_done - This->m_last_update_frame) > 100) || ((time(0) - This->m_last_update_time) > 0) ) { 
-		This->ui.progressBar->setValue(num_of_frames_done*100/This->m_current_job->TotalFrames());
-		This->ui.lcdNumberFrames->display(num_of_frames_done);
-		This->m_last_update_frame = num_of_frames_done;
-		qApp->processEvents();
-		This->m_last_update_time = time(0);
+	int done = m_batch_done_frames;
+	for(std::map<int, CJobRow>::iterator i = m_jobs.begin(); i != m_jobs.end(); i++) {
+		done += i->second.m_frames_done;
+	}
+	ui.lcdNumberFrames->display(done);
+	ui.lcdNumberFramesTotal->display(m_batch_total_frames);
+	if ( m_batch_total_frames ) {
+		ui.progressBar->setValue((int)((qint64)done*100/m_batch_total_frames));
 	}
-	
-	return !This->m_stop_transcode;
 }
 
 void MainWindow::on_xferButton_clicked()
@@ -113,12 +183,13 @@ void MainWindow::on_xferButton_clicked()
 
 void MainWindow::closeEvent(QCloseEvent * event)
 {
-	if ( m_current_job ) {
+	if ( m_queue->IsRunning() ) {
 		if ( QMessageBox::warning(this, "PSPMovie", tr("Transcoding is still running\n"
 				"Stop transcoding and quit the program ?"), "Yes", "No", 0, 1) ) {
 			event->ignore();
 		} else {
-			m_stop_transcode = true;
+			m_queue->Abort();
+			m_queue->Wait();
 		}
 	}
 }
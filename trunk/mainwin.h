@@ -3,8 +3,13 @@
 
 #include "ui_mainwin.h"
 
+#include <map>
+
+#include <QTimer>
+
 class CFFmpeg_Glue;
 class CTranscode;
+class CJobQueue;
 
 class MainWindow : public QMainWindow {
 		Q_OBJECT
@@ -14,20 +19,41 @@ class MainWindow : public QMainWindow {
 	
     private slots:
     	void on_transcodeButton_clicked();
+    	void on_stopButton_clicked();
     	void on_xferButton_clicked();
+
+    	// from job queue
+    	void jobStarted(int job_id);
+    	void jobDone(int job_id);
+    	void jobFailed(int job_id);
+    	void allDone();
+
+    	void updateProgress();
     	
     private:
 		Ui::MainWindow ui;
-		bool m_stop_transcode;
-		int m_last_update_frame, m_last_update_time;
 		
 		CFFmpeg_Glue *m_ffmpeg;
 
-		CTranscode *m_current_job;
+		CJobQueue *m_queue;
+
+		// samples job progress while queue is running
+		QTimer m_progress_timer;
+
+		//
+		// Jobs shown in job list. Frame counts are used for total progress
+		// of current batch.
+		//
+		struct CJobRow {
+			QTreeWidgetItem *m_item;
+			int m_total_frames, m_frames_done;
+		};
+		std::map<int, CJobRow> m_jobs;
+		int m_batch_total_frames, m_batch_done_frames;
 		
-		void closeEvent(QCloseEvent * event);
+		void UpdateTotalProgress();
 		
-		static int UpdateTranscodeProgress(void *, int);
+		void closeEvent(QCloseEvent * event);
 };
 
 #endif
@@ -26,10 +26,14 @@ QString CastToXBytes(unsigned long size)
 //
 int CTranscode::m_curr_id = 1001;
 
+// shortest time range worth a cpu of its own, in seconds
+#define MIN_SEGMENT_SEC 300
+
 CTranscode::CTranscode(QString &src, uint32_t thumbnail_time,
-			QString &s_bitrate, QString &v_bitrate, bool fix_aspect)
+			QString &s_bitrate, QString &v_bitrate, bool fix_aspect,
+			int threads, int segments)
 {
-	CAVInfo in_info(src.toUtf8());
+	CAVInfo in_info(src.toUtf8(), 0, 0, true);
 	m_input_ok = in_info.HaveVStream() && in_info.HaveAStream() && in_info.CodecOk();
 	if ( !m_input_ok ) {
 		m_input_error = in_info.InputError();
@@ -39,6 +43,13 @@ CTranscode::CTranscode(QString &src, uint32_t thumbnail_time,
 	m_being_run = false;
 	m_src = src;
 	m_thumbnail_time = thumbnail_time;
+	m_threads = threads;
+	m_segments = segments;
+	m_duration = in_info.Sec();
+	m_async_write = true;
+	m_lowres = true;
+	m_copy_video = in_info.PSPVideo();
+	m_copy_audio = in_info.PSPAudio();
 	
 	m_fix_aspect = fix_aspect;
 	
@@ -113,7 +124,7 @@ int CTranscode::TotalFrames()
 	return m_frame_count;
 }
 
-void CTranscode::RunTranscode(CFFmpeg_Glue &ffmpeg, int (cb)(void *, int), void *ptr)
+bool CTranscode::RunTranscode(CFFmpeg_Glue &ffmpeg, int (cb)(void *, int), void *ptr)
 {
 	m_being_run = true;
 	QFileInfo fi(m_src);
@@ -125,9 +136,28 @@ void CTranscode::RunTranscode(CFFmpeg_Glue &ffmpeg, int (cb)(void *, int), void
 	//
 	int v_size = 240 - 2*m_v_padding;
 	int h_size = 320 - 2*m_h_padding;
-	ffmpeg.RunTranscode(m_src.toUtf8(), target_path.toUtf8(), m_s_bitrate, m_v_bitrate,
+
+	//
+	// Long movie with spare cpus is cut into time ranges encoded in
+	// parallel, which scales much better than codec threads at this
+	// resolution. Each range should be at least few minutes long.
+	//
+	int threads = m_threads ? m_threads : GetNumberOfCpus();
+	int segments = m_segments;
+	if ( !segments ) {
+		segments = m_duration / MIN_SEGMENT_SEC;
+		if ( segments > threads ) {
+			segments = threads;
+		}
+	}
+	bool ok = ffmpeg.RunTranscode(m_src.toUtf8(), target_path.toUtf8(), m_s_bitrate, m_v_bitrate,
 		v_size, h_size, m_v_padding, m_h_padding, 
-		fi.completeBaseName().toUtf8(), cb, ptr);
+		fi.completeBaseName().toUtf8(), threads, segments, m_async_write,
+		m_copy_video, m_copy_audio, m_lowres, cb, ptr);
+	if ( !ok ) {
+		QFile::remove(target_path);
+	}
+	return ok;
 }
 
 void CTranscode::RunThumbnail(CFFmpeg_Glue &)
@@ -135,18 +165,22 @@ void CTranscode::RunThumbnail(CFFmpeg_Glue &)
 	QFileInfo fi(m_src);
 	QString target_path = GetAppSettings()->TargetDir().filePath(fi.completeBaseName() + ".thm");
 
-	CAVInfo m_in_info(m_src.toUtf8());
+	CAVInfo m_in_info(m_src.toUtf8(), 160, 120);
 	m_in_info.Seek(m_thumbnail_time);
-	m_in_info.GetNextFrame();
+	if ( !m_in_info.GetNextFrame(160, 120) ) {
+		return;
+	}
 
-	QImage img(m_in_info.ImageData(), m_in_info.W(), m_in_info.H(),
+	QImage img(m_in_info.ImageData(), m_in_info.ImageW(), m_in_info.ImageH(),
 		QImage::Format_RGB32);
-	img.scaled(160, 120).save(target_path, "JPEG");
+	img.save(target_path, "JPEG");
 }
 
 const QString CTranscode::Target()
 {
-	QString s = QString("%1 / %2 kbps") . arg(m_v_bitrate) . arg(m_s_bitrate);
+	QString s = QString("%1 / %2 kbps")
+		. arg(m_copy_video ? QString("copy") : QString::number(m_v_bitrate))
+		. arg(m_copy_audio ? QString("copy") : QString::number(m_s_bitrate));
 
 	return s;
 }
@@ -156,7 +190,7 @@ const QString CTranscode::Target()
 //
 int CPSPMovie::s_next_id = 1;
 
-CPSPMovie::CPSPMovie(const QFileInfo &info) : m_dir(info.dir().path())
+CPSPMovie::CPSPMovie(const QFileInfo &info, CPSPMovieIndex *index, int id) : m_dir(info.dir().path())
 {
 	QRegExp id_exp("M4V(\\d{5})", Qt::CaseInsensitive);
 	if ( id_exp.exactMatch(info.baseName()) ) {
@@ -165,32 +199,73 @@ CPSPMovie::CPSPMovie(const QFileInfo &info) : m_dir(info.dir().path())
 		m_movie_name = info.completeBaseName().toUpper() + ".MP4";
 		m_thmb_name = info.completeBaseName().toUpper() + ".THM";
 	} else {
-		m_id = s_next_id++;
+		m_id = id ? id : s_next_id++;
 		m_movie_name = info.completeBaseName() + ".mp4";
 		m_thmb_name = info.completeBaseName() + ".thm";
 	}
 
 	//printf("Test thumbnail at [%s]\n", (const char *)m_dir.filePath(m_thmb_name));
 	
-	m_have_thumbnail = QFile::exists(m_dir.filePath(m_thmb_name));
+	QFileInfo thmb_info(m_dir.filePath(m_thmb_name));
+	m_have_thumbnail = thmb_info.exists();
 	m_size = info.size();
 //	printf("File [%d] [%s] with thumbnail [%s]\n", m_id, (const char *)m_movie_name.toUtf8(),
 //	       m_have_thumbnail ? "yes" : "no");
 	m_str_size = CastToXBytes(m_size);
-	
+
+	CPSPMovieIndexEntry &e = m_index_entry;
+	e.m_size = info.size();
+	e.m_mtime = info.lastModified().toTime_t();
+	e.m_thmb_size = m_have_thumbnail ? thmb_info.size() : -1;
+	e.m_thmb_mtime = m_have_thumbnail ? thmb_info.lastModified().toTime_t() : -1;
+	m_need_load = true;
+	if ( index && index->Find(info.fileName(), e) ) {
+		m_icon_data = e.m_icon_data;
+		m_movie_title = e.m_title;
+		m_need_load = false;
+		if ( m_movie_title.length() < 4 ) {
+			m_movie_title = m_movie_name;
+		}
+	} else if ( !index ) {
+		Load();
+	}
+}
+
+void CPSPMovie::Load()
+{
 	if ( m_have_thumbnail ) {
 		m_icon = QImage(m_dir.filePath(m_thmb_name)).scaled(2*32, 2*24);
+		QBuffer buf(&m_icon_data);
+		buf.open(QIODevice::WriteOnly);
+		m_icon.save(&buf, "PNG");
 	}
 	
 	char title_buf[512];
 	GetMP4Title(m_dir.absoluteFilePath(m_movie_name).toUtf8(), title_buf);
 	m_movie_title = title_buf;
 
+	m_index_entry.m_icon_data = m_icon_data;
+	m_index_entry.m_title = m_movie_title;
+	m_need_load = false;
+
 	if ( m_movie_title.length() < 4 ) {
 		m_movie_title = m_movie_name;
 	}
 }
 
+const QImage &CPSPMovie::Icon()
+{
+	if ( m_icon.isNull() && !m_icon_data.isEmpty() ) {
+		m_icon.loadFromData(m_icon_data, "PNG");
+	}
+	return m_icon;
+}
+
+void CPSPMovie::StoreIndex(const QString &name, CPSPMovieIndex &index)
+{
+	index.Store(name, m_index_entry);
+}
+
 bool CPSPMovie::DoCopy(QWidget *parent, const QString &source, const QString &target)
 {
 	//printf("Copying [%s] -> [%s]\n", (const char *)source, (const char *)target);
@@ -249,7 +324,7 @@ bool CPSPMovie::TransferTo(QWidget *parent, const QString &target_dir, int trg_i
 	QString trg_movie, trg_thmb;
 	if ( trg_idx == -1 ) {
 		// try to extract title
-		CAVInfo in_info(m_dir.filePath(m_movie_name).toUtf8());
+		CAVInfo in_info(m_dir.filePath(m_movie_name).toUtf8(), 0, 0, true);
 		QString src_title(in_info.Title());
 		if ( src_title.length() > 3 ) {
 			trg_movie = src_title + ".mp4";
@@ -297,10 +372,266 @@ CPSPMovieLocalList::CPSPMovieLocalList(const QString &dir_path) : m_source_dir(d
 	name_filter << "*.MP4" << "*.mp4";
 	m_source_dir.setNameFilters(name_filter);
 	QFileInfoList files(m_source_dir.entryInfoList(QDir::Files | QDir::NoSymLinks | QDir::Readable));
+	m_index = new CPSPMovieIndex(m_source_dir);
+	CPSPMovieIndex &index = *m_index;
+
+	// ids are given here, in directory order
+	std::vector<CPSPMovie> movies;
+	movies.reserve(files.size());
 	for(QList<QFileInfo>::const_iterator it = files.begin(); it != files.end(); it++) {
-    	CPSPMovie m(*it);
-    	m_movie_set[m.Id()] = m;
-    }
+		movies.push_back(CPSPMovie(*it, &index));
+	}
+	// not in index, or changed since
+	std::vector<bool> changed(movies.size());
+	std::vector<CPSPMovie *> to_load;
+	for(size_t i = 0; i < movies.size(); i++) {
+		changed[i] = movies[i].NeedLoad();
+		if ( changed[i] ) {
+			to_load.push_back(&movies[i]);
+		}
+	}
+	LoadMovies(to_load);
+
+	for(size_t i = 0; i < movies.size(); i++) {
+		CPSPMovie &m = movies[i];
+		if ( changed[i] ) {
+			m.StoreIndex(files[i].fileName(), index);
+		}
+		m_movie_set[m.Id()] = m;
+	}
+	index.Save();
+}
+
+CPSPMovieLocalList::~CPSPMovieLocalList()
+{
+	// movies updated since scan
+	m_index->Save();
+	delete m_index;
+}
+
+QString CPSPMovieLocalList::MovieName(const QString &file)
+{
+	QFileInfo fi(file);
+	QString ext = fi.suffix().toLower();
+	if ( ext != "mp4" && ext != "thm" ) {
+		return QString();
+	}
+	// same naming CPSPMovie has
+	QRegExp id_exp("M4V(\\d{5})", Qt::CaseInsensitive);
+	if ( id_exp.exactMatch(fi.baseName()) ) {
+		return fi.completeBaseName().toUpper() + ".MP4";
+	}
+	return fi.completeBaseName() + ".mp4";
+}
+
+CPSPMovie *CPSPMovieLocalList::Update(const QString &movie_name)
+{
+	int old_id = 0;
+	for(CPSPMovieListIt i = m_movie_set.begin(); i != m_movie_set.end(); i++) {
+		if ( i->second.Name() == movie_name ) {
+			old_id = i->first;
+			m_movie_set.erase(i);
+			break;
+		}
+	}
+
+	// on vfat name may show up in either case
+	QFileInfo fi(m_source_dir.filePath(movie_name));
+	if ( !fi.exists() ) {
+		QString base = QFileInfo(movie_name).completeBaseName();
+		fi = QFileInfo(m_source_dir.filePath(base + ".mp4"));
+		if ( !fi.exists() ) {
+			fi = QFileInfo(m_source_dir.filePath(base + ".MP4"));
+		}
+	}
+	if ( !fi.exists() || !fi.isReadable() ) {
+		return 0;
+	}
+	CPSPMovie m(fi, m_index, old_id);
+	if ( m.NeedLoad() ) {
+		m.Load();
+		m.StoreIndex(fi.fileName(), *m_index);
+	}
+	m_movie_set[m.Id()] = m;
+	return &m_movie_set[m.Id()];
+}
+
+int CPSPMovieLocalList::Position(CPSPMovie *m)
+{
+	int pos = 0;
+	for(CPSPMovieListIt i = m_movie_set.begin(); i != m_movie_set.end(); i++, pos++) {
+		if ( &i->second == m ) {
+			break;
+		}
+	}
+	return pos;
+}
+
+//
+// Reading thumbnails and titles is mostly waiting for the device, so
+// few files are read at a time even on single cpu
+//
+#define SCAN_THREADS 4
+
+class CMovieLoadThread : public QThread {
+	public:
+		std::vector<CPSPMovie *> *m_movies;
+		size_t *m_next;
+		QMutex *m_lock;
+	protected:
+		void run()
+		{
+			for(;;) {
+				CPSPMovie *m;
+				{
+					QMutexLocker locker(m_lock);
+					if ( *m_next == m_movies->size() ) {
+						return;
+					}
+					m = (*m_movies)[(*m_next)++];
+				}
+				m->Load();
+			}
+		}
+};
+
+void CPSPMovieLocalList::LoadMovies(std::vector<CPSPMovie *> &movies)
+{
+	if ( movies.size() < 2 ) {
+		for(size_t i = 0; i < movies.size(); i++) {
+			movies[i]->Load();
+		}
+		return;
+	}
+	size_t next = 0;
+	QMutex lock;
+	int nthreads = movies.size() < SCAN_THREADS ? movies.size() : SCAN_THREADS;
+	std::vector<CMovieLoadThread *> threads;
+	for(int i = 0; i < nthreads; i++) {
+		CMovieLoadThread *t = new CMovieLoadThread;
+		t->m_movies = &movies;
+		t->m_next = &next;
+		t->m_lock = &lock;
+		threads.push_back(t);
+		t->start();
+	}
+	for(int i = 0; i < nthreads; i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+}
+
+//
+// Library index
+//
+#define INDEX_MAGIC		0x50534958
+#define INDEX_VERSION	2
+
+static QDataStream &operator<<(QDataStream &s, const CPSPMovieIndexEntry &e)
+{
+	s << e.m_size << e.m_mtime << e.m_thmb_size << e.m_thmb_mtime << e.m_title << e.m_icon_data;
+	return s;
+}
+
+static QDataStream &operator>>(QDataStream &s, CPSPMovieIndexEntry &e)
+{
+	s >> e.m_size >> e.m_mtime >> e.m_thmb_size >> e.m_thmb_mtime >> e.m_title >> e.m_icon_data;
+	return s;
+}
+
+CPSPMovieIndex::CPSPMovieIndex(const QDir &dir)
+{
+	m_dir_path = dir.absolutePath();
+	m_file = GetAppSettings()->LibraryIndexPath(dir);
+	m_changed = false;
+
+	QFile f(m_file);
+	if ( !f.open(QIODevice::ReadOnly) ) {
+		return;
+	}
+	QDataStream s(&f);
+	s.setVersion(QDataStream::Qt_4_0);
+	quint32 magic, version;
+	QString dir_path;
+	s >> magic >> version >> dir_path;
+	// other version, or other dir with same hash
+	if ( s.status() != QDataStream::Ok || magic != INDEX_MAGIC ||
+		version != INDEX_VERSION || dir_path != m_dir_path ) {
+		m_changed = true;
+		return;
+	}
+	quint32 count;
+	s >> count;
+	for(quint32 i = 0; i < count && s.status() == QDataStream::Ok; i++) {
+		QString name;
+		CPSPMovieIndexEntry e;
+		s >> name >> e;
+		m_entries[name] = e;
+	}
+	if ( s.status() != QDataStream::Ok ) {
+		m_entries.clear();
+		m_changed = true;
+	}
+}
+
+bool CPSPMovieIndex::Find(const QString &name, CPSPMovieIndexEntry &e)
+{
+	m_seen[name] = true;
+	std::map<QString, CPSPMovieIndexEntry>::iterator i = m_entries.find(name);
+	if ( i == m_entries.end() ) {
+		return false;
+	}
+	const CPSPMovieIndexEntry &c = i->second;
+	if ( c.m_size != e.m_size || c.m_mtime != e.m_mtime ||
+		c.m_thmb_size != e.m_thmb_size || c.m_thmb_mtime != e.m_thmb_mtime ) {
+		return false;
+	}
+	e = c;
+	return true;
+}
+
+void CPSPMovieIndex::Store(const QString &name, const CPSPMovieIndexEntry &e)
+{
+	m_seen[name] = true;
+	m_entries[name] = e;
+	m_changed = true;
+}
+
+void CPSPMovieIndex::Save()
+{
+	// drop files deleted since last time
+	for(std::map<QString, CPSPMovieIndexEntry>::iterator i = m_entries.begin(); i != m_entries.end(); ) {
+		if ( !m_seen.count(i->first) ) {
+			m_entries.erase(i++);
+			m_changed = true;
+		} else {
+			i++;
+		}
+	}
+	if ( !m_changed ) {
+		return;
+	}
+	// new file renamed over old one, so a crash never leaves half index
+	QString tmp_file = m_file + ".tmp";
+	QFile f(tmp_file);
+	if ( !f.open(QIODevice::WriteOnly | QIODevice::Truncate) ) {
+		return;
+	}
+	QDataStream s(&f);
+	s.setVersion(QDataStream::Qt_4_0);
+	s << (quint32)INDEX_MAGIC << (quint32)INDEX_VERSION << m_dir_path;
+	s << (quint32)m_entries.size();
+	for(std::map<QString, CPSPMovieIndexEntry>::iterator i = m_entries.begin(); i != m_entries.end(); i++) {
+		s << i->first << i->second;
+	}
+	f.close();
+	if ( s.status() != QDataStream::Ok ) {
+		QFile::remove(tmp_file);
+		return;
+	}
+	QFile::remove(m_file);
+	QFile::rename(tmp_file, m_file);
+	m_changed = false;
 }
 
 bool CPSPMovieLocalList::Transfer(QWidget *parent, int id, const QString &dest)
@@ -311,7 +642,7 @@ bool CPSPMovieLocalList::Transfer(QWidget *parent, int id, const QString &dest)
 	return m.TransferTo(parent, dest, -1);
 }
 
-bool CPSPMovieLocalList::TransferPSP(QWidget *parent, int id, const QString &base)
+bool CPSPMovieLocalList::TransferPSP(QWidget *parent, int id, const QString &base, CM4VIndexAllocator &idx_alloc)
 {
 	Q_ASSERT ( m_movie_set.count(id) );
 	CPSPMovie &m = m_movie_set[id];
@@ -325,7 +656,11 @@ bool CPSPMovieLocalList::TransferPSP(QWidget *parent, int id, const QString &bas
 	QDir trg_dir(mp_root.filePath("100MNV01"));
 
 	// get free index before moving directory
-	int free_idx = GetAppSettings()->GetNewOutputNameIdx(trg_dir.path());
+	int free_idx = idx_alloc.Next(trg_dir);
+	if ( free_idx == -1 ) {
+		printf("ERROR: no free M4V index in [%s]\n", (const char *)trg_dir.path().toUtf8());
+		return false;
+	}
 
 	QDir trg_dir_backup(mp_root.filePath("100MNV01_BACK"));
 	if ( trg_dir.exists() ) {
@@ -423,6 +758,8 @@ CAppSettings::CAppSettings(): m_settings("pspmovie")
 		}
 	}
 
+	SetProbeCacheFile(QDir(m_app_dir_path).filePath("probe.cache"));
+
 	//printf("Tmp dir -> [%s]\n", (const char *)m_tmp_dir_path);
 }
 
@@ -430,20 +767,57 @@ CAppSettings::~CAppSettings()
 {
 }
 
-int CAppSettings::GetNewOutputNameIdx(const QDir &trg_dir) const
+QString CAppSettings::LibraryIndexPath(const QDir &dir) const
 {
-	for(int i = 1 ; i < 999999; i++) {
-		QString next_name;
-		next_name.sprintf("M4V%05d.MP4", i);
-		QFileInfo fi(trg_dir.filePath(next_name));
-		//printf("DEBUG: testing [%s] - ", (const char *)trg_dir.filePath(next_name));
-		if ( !fi.exists() ) {
-			//printf("not found, id=%d\n", i);
-			return i;
+	QString name;
+	name.sprintf("library_%08x.idx", qHash(dir.absolutePath()));
+	return QDir(m_app_dir_path).filePath(name);
+}
+
+//
+// M4V index allocation
+//
+CM4VIndexAllocator::CM4VIndexAllocator()
+{
+	m_loaded = false;
+	m_first_free_word = 0;
+}
+
+int CM4VIndexAllocator::Next(const QDir &trg_dir)
+{
+	if ( !m_loaded ) {
+		m_used.assign(M4V_MAX_INDEX / 32 + 1, 0);
+		// index 0 is never used
+		m_used[0] = 1;
+		// thumbnail without movie still takes the index
+		QRegExp id_exp("M4V(\\d{5})\\.(MP4|THM)", Qt::CaseInsensitive);
+		QStringList files(trg_dir.entryList(QDir::Files));
+		for(QStringList::const_iterator it = files.begin(); it != files.end(); it++) {
+			if ( id_exp.exactMatch(*it) ) {
+				int i = id_exp.cap(1).toInt();
+				m_used[i / 32] |= 1U << (i % 32);
+			}
 		}
-		//printf("found\n");
+		m_loaded = true;
+	}
+	int words = m_used.size();
+	while ( m_first_free_word < words && m_used[m_first_free_word] == 0xffffffffU ) {
+		m_first_free_word++;
 	}
-	return -1;
+	if ( m_first_free_word == words ) {
+		return -1;
+	}
+	quint32 w = m_used[m_first_free_word];
+	int bit = 0;
+	while ( w & (1U << bit) ) {
+		bit++;
+	}
+	int i = m_first_free_word * 32 + bit;
+	if ( i > M4V_MAX_INDEX ) {
+		return -1;
+	}
+	m_used[m_first_free_word] |= 1U << bit;
+	return i;
 }
 
 int main(int argc, char *argv[])
@@ -463,6 +837,12 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	//
+	// Settings are used by transcode workers - make sure they're created
+	// here in gui thread and not in one of those.
+	//
+	GetAppSettings();
+
 	MainWindow win(&g);
 	win.show();
 	app.exec();	
@@ -33,6 +33,22 @@ class CTranscode {
 		QString m_input_error;
 		
 		uint32_t m_frame_count;
+		
+		// codec threads, 0 = auto
+		int m_threads;
+		
+		// parallel time ranges, 0 = auto, 1 = off
+		int m_segments;
+		int m_duration;
+
+		// write output from background thread, for slow target storage
+		bool m_async_write;
+
+		// decode big input at 1/2 or 1/4 size, it's scaled down anyway
+		bool m_lowres;
+
+		// input streams already fit for PSP, remuxed instead of encoded
+		bool m_copy_video, m_copy_audio;
 				
 		QString m_str_duration;
 		
@@ -44,7 +60,8 @@ class CTranscode {
 	public:
 	
 		CTranscode(QString &src, uint32_t thumbnail_time,
-			QString &s_bitrate, QString &v_bitrate, bool fix_aspect);
+			QString &s_bitrate, QString &v_bitrate, bool fix_aspect,
+			int threads = 0, int segments = 0);
 		
 		bool IsOK();
 		const QString InputError() { return m_input_error; }
@@ -52,7 +69,18 @@ class CTranscode {
 		int TotalFrames();
 		
 		bool IsRunning() { return m_being_run; }
-		void RunTranscode(CFFmpeg_Glue &, int (cb)(void *, int), void *);
+		int Threads() { return m_threads; }
+		void SetThreads(int threads) { m_threads = threads; }
+		int Segments() { return m_segments; }
+		void SetSegments(int segments) { m_segments = segments; }
+		bool AsyncWrite() { return m_async_write; }
+		void SetAsyncWrite(bool async_write) { m_async_write = async_write; }
+		bool Lowres() { return m_lowres; }
+		void SetLowres(bool lowres) { m_lowres = lowres; }
+		bool CopyVideo() { return m_copy_video; }
+		bool CopyAudio() { return m_copy_audio; }
+		// false when encoder failed, partial output is removed
+		bool RunTranscode(CFFmpeg_Glue &, int (cb)(void *, int), void *);
 		void RunThumbnail(CFFmpeg_Glue &);
 		
 		int Id() { return m_id; }
@@ -63,6 +91,38 @@ class CTranscode {
 		const QString Target();
 };
 
+//
+// What CPSPMovie reads from movie and thumbnail files. Saved per
+// directory under app dir, so files not changed since are not opened
+// again: over USB reading every THM and MP4 header takes long.
+//
+struct CPSPMovieIndexEntry {
+	qint64 m_size, m_mtime;
+	// -1 when there is no thumbnail
+	qint64 m_thmb_size, m_thmb_mtime;
+	QString m_title;
+	// png, decoded when row is shown
+	QByteArray m_icon_data;
+};
+
+class CPSPMovieIndex {
+		QString m_file, m_dir_path;
+		std::map<QString, CPSPMovieIndexEntry> m_entries;
+
+		// names looked up since load, others are gone from directory
+		std::map<QString, bool> m_seen;
+		bool m_changed;
+	public:
+		CPSPMovieIndex(const QDir &dir);
+
+		// true if entry for name has same sizes and times as e
+		bool Find(const QString &name, CPSPMovieIndexEntry &e);
+		void Store(const QString &name, const CPSPMovieIndexEntry &e);
+
+		// writes index if anything changed
+		void Save();
+};
+
 class CPSPMovie {
 		int m_id;
 		static int s_next_id;
@@ -75,10 +135,26 @@ class CPSPMovie {
 		bool DoCopy(QWidget *parent, const QString &source, const QString &target);
 
 		QImage m_icon;
+		QByteArray m_icon_data;
+
+		// index key, and whether title and icon still need reading
+		CPSPMovieIndexEntry m_index_entry;
+		bool m_need_load;
 	public:
-		CPSPMovie(const QFileInfo &info);
+		//
+		// With index, title and icon of changed files are left for
+		// Load(). Without, everything is read here. id is kept from
+		// earlier scan of the same file, 0 gives a new one.
+		//
+		CPSPMovie(const QFileInfo &info, CPSPMovieIndex *index = 0, int id = 0);
 		
 		CPSPMovie() {  /* for stl */ }
+
+		// reads thumbnail and title. Touches nothing shared, so
+		// many movies can be loaded in parallel
+		void Load();
+		bool NeedLoad() { return m_need_load; }
+		void StoreIndex(const QString &name, CPSPMovieIndex &index);
 		
 		bool TransferTo(QWidget *parent, const QString &target_dir, int trg_idx = -1);
 		bool Delete();
@@ -90,14 +166,42 @@ class CPSPMovie {
 		
 		int Id() { return m_id; }
 		
-		const QImage &Icon() { return m_icon; }
+		// decoded on first call
+		const QImage &Icon();
+		// png Icon() is made of, empty without thumbnail
+		const QByteArray &IconData() { return m_icon_data; }
+};
+
+//
+// Free M4Vnnnnn indices of a PSP movie directory. Directory is read once,
+// on first Next(), then used indices are kept in a bitmap, so a batch
+// transfer costs one listing instead of a stat per tried name. Same
+// allocator must be used for the whole batch.
+//
+#define M4V_MAX_INDEX 99999
+
+class CM4VIndexAllocator {
+		bool m_loaded;
+		std::vector<quint32> m_used;
+		// words below are all used
+		int m_first_free_word;
+	public:
+		CM4VIndexAllocator();
+
+		// lowest free index, marked used. -1 when directory is full
+		int Next(const QDir &trg_dir);
 };
 
 class CPSPMovieLocalList {
 		std::map<int, CPSPMovie> m_movie_set;
 		QDir m_source_dir;
+		CPSPMovieIndex *m_index;
+
+		// Load() on bounded number of threads
+		static void LoadMovies(std::vector<CPSPMovie *> &movies);
 	public:
 		CPSPMovieLocalList(const QString &dir);
+		~CPSPMovieLocalList();
 		
 		typedef std::map<int, CPSPMovie>::iterator CPSPMovieListIt;
 		
@@ -105,8 +209,24 @@ class CPSPMovieLocalList {
 		CPSPMovieListIt End() { return m_movie_set.end(); }
 		
 		bool Transfer(QWidget *parent, int id, const QString &dest);
-		bool TransferPSP(QWidget *parent, int id, const QString &base);
+		bool TransferPSP(QWidget *parent, int id, const QString &base, CM4VIndexAllocator &idx_alloc);
 		bool Delete(int id);
+
+		//
+		// Name of movie a file in the directory belongs to (movie
+		// itself or its thumbnail), empty for other files
+		//
+		static QString MovieName(const QString &file);
+
+		//
+		// Re-reads one movie after its files changed, instead of
+		// scanning whole directory. Entry keeps its id, so its place
+		// in the list. Returns new entry, or 0 when movie file is gone.
+		//
+		CPSPMovie *Update(const QString &movie_name);
+
+		// place of movie in Begin() .. End()
+		int Position(CPSPMovie *m);
 };
 
 class CAppSettings {
@@ -126,7 +246,8 @@ class CAppSettings {
 		QString ffmpeg() { return m_ffmpeg_path; }
 		const QDir &TargetDir() const { return m_tmp_dir; } 
 		
-		int GetNewOutputNameIdx(const QDir &trg_dir) const;
+		// where library index of a movie directory is kept
+		QString LibraryIndexPath(const QDir &dir) const;
 			
 };
 
@@ -7,20 +7,23 @@ FORMS += transcode.ui mainwin.ui xferwin.ui
 SOURCES += pspmovie.cpp \
 	avutils.cpp \
 	ffmpeg_patched.c \
+	yuvscale.c \
+	audiomix.c \
 	transcode.cpp \
 	xferwin.cpp \
-	mainwin.cpp
+	mainwin.cpp \
+	jobqueue.cpp
 
-SOURCES += pspdetect_linux.cpp
+SOURCES += pspdetect_linux.cpp dirwatch_linux.cpp
 
 HEADERS += avutils.h pspdetect.h \
-	transcode.h mainwin.h xferwin.h
+	transcode.h mainwin.h xferwin.h jobqueue.h dirwatch.h
 
 
 RESOURCES	= pspmovie.qrc
 
 INCLUDEPATH += ffmpeg ffmpeg/libavformat ffmpeg/libavcodec ffmpeg/libavutil
 
-unix:LIBS	+= -lhal -lhal-storage ffmpeg/libavformat/libavformat.a ffmpeg/libavcodec/libavcodec.a ffmpeg/libavutil/libavutil.a -lmp4v2 -lfaad -lfaac -lxvidcore
+unix:LIBS	+= -lhal -lhal-storage ffmpeg/libavformat/libavformat.a ffmpeg/libavcodec/libavcodec.a ffmpeg/libavutil/libavutil.a -lfaad -lfaac -lxvidcore
 
 unix:INCLUDEPATH	+= . /usr/include/hal /usr/include/dbus-1.0/ /usr/lib/dbus-1.0/include/
@@ -34,7 +34,7 @@ device.
 
 %build
 cd ffmpeg
-./configure --disable-ffplay --disable-ffserver --disable-v4l --enable-gpl --enable-a52 --enable-faad --enable-faac --disable-vhook --disable-network
+./configure --disable-ffplay --disable-ffserver --enable-pthreads --disable-v4l --enable-gpl --enable-a52 --enable-faad --enable-faac --disable-vhook --disable-network
 make RPM_OPT_FLAGS="$RPM_OPT_FLAGS"
 cd ..
 qmake pspmovie.pro
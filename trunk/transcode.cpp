@@ -6,15 +6,176 @@
 #include "transcode.h"
 #include "avutils.h"
 
+//
+// Filmstrip worker
+//
+// strip frames are half the preview size, shown scaled up while exact
+// frame is decoded
+#define FILMSTRIP_FRAMES 100
+
+// ms after last change of file name before it is opened
+#define OPEN_DELAY 300
+
+CFilmstripWorker::CFilmstripWorker(const QString &file, int duration, int w, int h,
+	QObject *parent) : QThread(parent)
+{
+	m_file = file;
+	m_duration = duration;
+	m_width = w;
+	m_height = h;
+	m_request = m_decoding = -1;
+	m_stop = false;
+}
+
+CFilmstripWorker::~CFilmstripWorker()
+{
+	{
+		QMutexLocker locker(&m_lock);
+		m_stop = true;
+		m_wake.wakeOne();
+	}
+	wait();
+}
+
+void CFilmstripWorker::run()
+{
+	// own decoder, gui one is never touched from here
+	CAVInfo info(m_file.toUtf8(), m_width, m_height);
+	if ( !info.CodecOk() ) {
+		return;
+	}
+	int next_slot = 0;
+	for(;;) {
+		int sec;
+		bool exact;
+		{
+			QMutexLocker locker(&m_lock);
+			while ( !m_stop && m_request < 0 && next_slot >= FILMSTRIP_FRAMES ) {
+				m_wake.wait(&m_lock);
+			}
+			if ( m_stop ) {
+				return;
+			}
+			if ( m_request >= 0 ) {
+				sec = m_request;
+				m_request = -1;
+				exact = true;
+			} else {
+				sec = next_slot++ * m_duration / FILMSTRIP_FRAMES;
+				if ( m_strip.count(sec) ) {
+					// short movie, slots share a second
+					continue;
+				}
+				exact = false;
+			}
+			m_decoding = sec;
+		}
+		QImage img;
+		if ( info.Seek(sec, exact) &&
+			info.GetNextFrame(exact ? m_width : m_width / 2, exact ? m_height : m_height / 2) ) {
+			// decoder buffer is reused by next frame
+			img = QImage(info.ImageData(), info.ImageW(), info.ImageH(), QImage::Format_RGB32).copy();
+		}
+		{
+			QMutexLocker locker(&m_lock);
+			m_decoding = -1;
+			if ( exact ) {
+				if ( m_exact.size() >= FILMSTRIP_FRAMES ) {
+					m_exact.clear();
+				}
+				m_exact[sec] = img;
+			} else if ( !img.isNull() ) {
+				m_strip[sec] = img;
+			}
+		}
+		if ( !img.isNull() ) {
+			emit frameReady(sec);
+		}
+	}
+}
+
+bool CFilmstripWorker::Get(int sec, QImage &img)
+{
+	QMutexLocker locker(&m_lock);
+
+	std::map<int, QImage>::iterator i = m_exact.find(sec);
+	if ( i != m_exact.end() ) {
+		// null when frame can't be decoded
+		if ( i->second.isNull() ) {
+			return false;
+		}
+		img = i->second;
+		return true;
+	}
+	if ( sec != m_decoding ) {
+		// replaces whatever was asked before and is not started yet
+		m_request = sec;
+		m_wake.wakeOne();
+	}
+
+	i = m_strip.lower_bound(sec);
+	if ( i == m_strip.end() ) {
+		if ( m_strip.empty() ) {
+			return false;
+		}
+		--i;
+	} else if ( i != m_strip.begin() ) {
+		std::map<int, QImage>::iterator prev = i;
+		--prev;
+		if ( sec - prev->first < i->first - sec ) {
+			i = prev;
+		}
+	}
+	img = i->second;
+	return true;
+}
+
+void CFilmstripWorker::Release()
+{
+	disconnect(this, SIGNAL(frameReady(int)), 0, 0);
+	setParent(0);
+	connect(this, SIGNAL(finished()), this, SLOT(deleteLater()));
+	{
+		QMutexLocker locker(&m_lock);
+		m_stop = true;
+		m_wake.wakeOne();
+	}
+	// already out of run(), or never started
+	if ( isFinished() || !isRunning() ) {
+		deleteLater();
+	}
+}
+
+//
+// Dialog
+//
 TranscodeDialog::TranscodeDialog(QWidget *parent) : QDialog(parent)
 {
 	m_avinfo = 0;
+	m_filmstrip = 0;
 	ui.setupUi(this);
 	ui.okButton->setEnabled(false);
+
+	m_open_timer.setSingleShot(true);
+	m_open_timer.setInterval(OPEN_DELAY);
+	connect(&m_open_timer, SIGNAL(timeout()), this, SLOT(openInput()));
 }
 
 TranscodeDialog::~TranscodeDialog()
 {
+	stopFilmstrip();
+	if ( m_avinfo ) {
+		delete m_avinfo;
+	}
+}
+
+void TranscodeDialog::stopFilmstrip()
+{
+	if ( m_filmstrip ) {
+		// finishes decode in progress on its own
+		m_filmstrip->Release();
+		m_filmstrip = 0;
+	}
 }
 
 void TranscodeDialog::on_browseButton_clicked()
@@ -35,9 +196,18 @@ void TranscodeDialog::on_browseButton_clicked()
     }
 }
 
-void TranscodeDialog::on_filenameEdit_textChanged (const QString &s)
+void TranscodeDialog::on_filenameEdit_textChanged (const QString &)
 {
 //	printf("TranscodeDialog::on_filenameEdit_changed()\n");
+	stopFilmstrip();
+	// until new name is checked
+	ui.okButton->setEnabled(false);
+	m_open_timer.start();
+}
+
+void TranscodeDialog::openInput()
+{
+	QString s = ui.filenameEdit->text();
 	if ( s.trimmed().length() == 0 ) {
     	//textLabel_Status->setText("No input file");
     	m_avinfo = 0;
@@ -52,7 +222,7 @@ void TranscodeDialog::on_filenameEdit_textChanged (const QString &s)
 		delete m_avinfo;
 		m_avinfo = 0;
 	}
-	m_avinfo = new CAVInfo(s.trimmed().toStdString().c_str());
+	m_avinfo = new CAVInfo(s.trimmed().toStdString().c_str(), 0, 0, true);
 
 	//m_thumbnail_time = 0;
 
@@ -68,21 +238,47 @@ void TranscodeDialog::on_filenameEdit_textChanged (const QString &s)
 
 	//slider_thm_time_valueChanged(1);
 	ui.okButton->setEnabled(true);
-	on_thumbnailSlider_valueChanged(0);
+
+	m_filmstrip = new CFilmstripWorker(s.trimmed(), m_avinfo->Sec(),
+		ui.thumbnailLabel->width(), ui.thumbnailLabel->height(), this);
+	connect(m_filmstrip, SIGNAL(frameReady(int)), this, SLOT(filmstripFrameReady(int)));
+	m_filmstrip->start(QThread::LowPriority);
+
+	on_thumbnailSlider_valueChanged(ui.thumbnailSlider->value());
 }
 
 void TranscodeDialog::on_thumbnailSlider_valueChanged(int value)
 {
+	if ( !m_avinfo ) {
+		return;
+	}
 	m_thumbnail_time = value * m_avinfo->Sec() / ui.thumbnailSlider->maximum();
 	printf("image: %d -> %d (of %d)\n", value, m_thumbnail_time, m_avinfo->Sec());
-    if ( m_avinfo->Seek(m_thumbnail_time) && m_avinfo->GetNextFrame() )  {
-    	QImage img(m_avinfo->ImageData(), m_avinfo->W(), m_avinfo->H(),QImage::Format_RGB32);
-		QImage scaled_img (img.scaled(ui.thumbnailLabel->width(), ui.thumbnailLabel->height()));
-    	ui.thumbnailLabel->setPixmap(QPixmap::fromImage(scaled_img));
+	showThumbnail();
 //    	lCDNumber_H->display((int)m_thumbnail_time / 3600);
 //    	lCDNumber_M->display((int)(m_thumbnail_time / 60) % 60);
 //    	lCDNumber_S->display((int)m_thumbnail_time % 60);
-    }
+}
+
+void TranscodeDialog::filmstripFrameReady(int)
+{
+	// exact frame, or strip frame nearer than what is shown
+	showThumbnail();
+}
+
+void TranscodeDialog::showThumbnail()
+{
+	if ( !m_filmstrip ) {
+		return;
+	}
+	QImage img;
+	if ( !m_filmstrip->Get(m_thumbnail_time, img) ) {
+		return;
+	}
+	if ( img.width() != ui.thumbnailLabel->width() || img.height() != ui.thumbnailLabel->height() ) {
+		img = img.scaled(ui.thumbnailLabel->width(), ui.thumbnailLabel->height());
+	}
+	ui.thumbnailLabel->setPixmap(QPixmap::fromImage(img));
 }
 
 CTranscode *TranscodeDialog::getJob()
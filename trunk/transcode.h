@@ -1,28 +1,89 @@
 #ifndef TRANSCODE_FORM_H
 #define TRANSCODE_FORM_H
 
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QImage>
+#include <QTimer>
+
+#include <map>
+
 #include "ui_transcode.h"
 
 class CAVInfo;
 class CTranscode;
+
+//
+// Decodes preview frames for the thumbnail slider on its own thread.
+// Fills a strip of small keyframe images over the whole movie, and
+// exact frames for positions asked by gui. Only latest request is kept,
+// older ones are dropped while decoder is busy.
+//
+class CFilmstripWorker : public QThread {
+		Q_OBJECT
+		QString m_file;
+		int m_duration;
+		int m_width, m_height;
+
+		QMutex m_lock;
+		QWaitCondition m_wake;
+
+		// guarded by m_lock. -1 when nothing asked / decoded
+		int m_request, m_decoding;
+		bool m_stop;
+
+		// by second. Null exact image means it can't be decoded
+		std::map<int, QImage> m_strip, m_exact;
+	protected:
+		void run();
+	public:
+		CFilmstripWorker(const QString &file, int duration, int w, int h, QObject *parent);
+		~CFilmstripWorker();
+
+		//
+		// Exact frame if already decoded, otherwise nearest strip
+		// frame and exact one is queued. Returns false when there is
+		// nothing to show: img is not touched then.
+		//
+		bool Get(int sec, QImage &img);
+
+		//
+		// Stops the thread and deletes the worker once it is out of
+		// decode in progress. Does not wait, no signals come after.
+		//
+		void Release();
+	signals:
+		// emitted from worker thread
+		void frameReady(int sec);
+};
+
 class TranscodeDialog : public QDialog {
 		Q_OBJECT
 	public:
 		TranscodeDialog(QWidget *parent = 0);
 		~TranscodeDialog();
-	
+
 		CTranscode *getJob();
     private slots:
     	void on_browseButton_clicked();
     	void on_filenameEdit_textChanged (const QString &);
     	void on_thumbnailSlider_valueChanged(int);
+    	void filmstripFrameReady(int);
+    	void openInput();
     private:
     	bool isOk() { return m_avinfo != 0; }
-    	
+    	void showThumbnail();
+    	void stopFilmstrip();
+
     	QString m_filename;
 		Ui::TranscodeDialog ui;
 		CAVInfo *m_avinfo;
+		CFilmstripWorker *m_filmstrip;
 		int m_thumbnail_time;
+
+		// input is opened when typing pauses, not on every key
+		QTimer m_open_timer;
 };
 
 #endif
@@ -1,56 +1,184 @@
 #include <QtGui>
 
+#include <set>
+
 #include "xferwin.h"
 #include "pspmovie.h"
+#include "dirwatch.h"
+
+enum { COL_ICON, COL_TITLE, COL_SIZE, NB_COLUMNS };
+
+//
+// List model
+//
+CPSPMovieListModel::CPSPMovieListModel(QObject *parent) : QAbstractTableModel(parent)
+{
+}
+
+int CPSPMovieListModel::rowCount(const QModelIndex &parent) const
+{
+	return parent.isValid() ? 0 : m_rows.size();
+}
+
+int CPSPMovieListModel::columnCount(const QModelIndex &parent) const
+{
+	return parent.isValid() ? 0 : NB_COLUMNS;
+}
 
-class XferListItem : public QTableWidgetItem {
-	public:
-		CPSPMovie *m_data;
+QVariant CPSPMovieListModel::data(const QModelIndex &index, int role) const
+{
+	if ( !index.isValid() || index.row() >= (int)m_rows.size() ) {
+		return QVariant();
+	}
+	CPSPMovie *m = m_rows[index.row()];
+	switch ( index.column() ) {
+		case COL_ICON:
+			if ( role == Qt::DecorationRole ) {
+				QMap<QString, QPixmap>::iterator i = m_pixmaps.find(m->Name());
+				if ( i == m_pixmaps.end() ) {
+					QPixmap p;
+					if ( !m->Icon().isNull() ) {
+						p = QPixmap::fromImage(m->Icon());
+					}
+					i = m_pixmaps.insert(m->Name(), p);
+				}
+				if ( !i.value().isNull() ) {
+					return i.value();
+				}
+			}
+			break;
+		case COL_TITLE:
+			if ( role == Qt::DisplayRole ) {
+				return m->Title();
+			}
+			break;
+		case COL_SIZE:
+			if ( role == Qt::DisplayRole ) {
+				return m->Size();
+			}
+			break;
+	}
+	return QVariant();
+}
 
-		XferListItem(CPSPMovie *data) : QTableWidgetItem(QTableWidgetItem::UserType+1)
-		{
-			m_data = data;
+QVariant CPSPMovieListModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+	if ( orientation != Qt::Horizontal || role != Qt::DisplayRole ) {
+		return QVariant();
+	}
+	switch ( section ) {
+		case COL_ICON: return QString("icon");
+		case COL_TITLE: return QString("File");
+		case COL_SIZE: return QString("Size");
+	}
+	return QVariant();
+}
+
+void CPSPMovieListModel::SetList(CPSPMovieLocalList *list)
+{
+	std::vector<CPSPMovie *> rows;
+	std::set<QString> new_names;
+	for(CPSPMovieLocalList::CPSPMovieListIt i = list->Begin(); i != list->End(); i++) {
+		rows.push_back(&i->second);
+		new_names.insert(i->second.Name());
+	}
+
+	// from the end, so row numbers ahead stay valid
+	for(int i = (int)m_rows.size() - 1; i >= 0; i--) {
+		if ( !new_names.count(m_rows[i]->Name()) ) {
+			beginRemoveRows(QModelIndex(), i, i);
+			m_pixmaps.remove(m_rows[i]->Name());
+			m_rows.erase(m_rows.begin() + i);
+			endRemoveRows();
+		}
+	}
+	std::set<QString> old_names;
+	for(size_t i = 0; i < m_rows.size(); i++) {
+		old_names.insert(m_rows[i]->Name());
+	}
+
+	// lists are in id order, remaining rows keep their order
+	size_t j = 0;
+	for(size_t i = 0; i < rows.size(); i++, j++) {
+		CPSPMovie *m = rows[i];
+		if ( !old_names.count(m->Name()) ) {
+			beginInsertRows(QModelIndex(), j, j);
+			m_rows.insert(m_rows.begin() + j, m);
+			endInsertRows();
+			continue;
 		}
-		~XferListItem()
-		{
-			//printf("Deleted item %p\n", this);
+		if ( m_rows[j]->Name() != m->Name() ) {
+			// order changed after all, start over
+			m_rows = rows;
+			m_pixmaps.clear();
+			reset();
+			return;
 		}
-};
+		bool changed = m_rows[j]->Title() != m->Title() || m_rows[j]->Size() != m->Size() ||
+			m_rows[j]->IconData() != m->IconData();
+		m_rows[j] = m;
+		if ( changed ) {
+			// thumbnail may be the only change: cached pixmap is stale too
+			m_pixmaps.remove(m->Name());
+			emit dataChanged(index(j, 0), index(j, columnCount() - 1));
+		}
+	}
+}
+
+void CPSPMovieListModel::UpdateMovie(CPSPMovieLocalList *list, const QString &movie_name)
+{
+	int old_row = -1;
+	for(size_t i = 0; i < m_rows.size(); i++) {
+		if ( m_rows[i]->Name() == movie_name ) {
+			old_row = i;
+			break;
+		}
+	}
+	CPSPMovie *m = list->Update(movie_name);
+	// rows are kept in list order
+	int row = m ? list->Position(m) : -1;
+	m_pixmaps.remove(movie_name);
+	if ( old_row >= 0 && old_row == row ) {
+		// same movie written again: row and selection stay
+		m_rows[row] = m;
+		emit dataChanged(index(row, 0), index(row, columnCount() - 1));
+		return;
+	}
+	if ( old_row >= 0 ) {
+		beginRemoveRows(QModelIndex(), old_row, old_row);
+		m_rows.erase(m_rows.begin() + old_row);
+		endRemoveRows();
+	}
+	if ( !m ) {
+		return;
+	}
+	beginInsertRows(QModelIndex(), row, row);
+	m_rows.insert(m_rows.begin() + row, m);
+	endInsertRows();
+}
+
+//
+// Dialog
+//
+// PSP directory is renamed and made again on every transfer
+#define REWATCH_DELAY 500
 
-void FillListControl(CPSPMovieLocalList *file_list, QTableWidget *list)
+static void SetupListView(QTableView *list, QAbstractItemModel *model)
 {
-	list->clear();
+	list->setModel(model);
+
 	int char_width = list->fontMetrics().width('w');
 	
 	// icon size
-	list->setColumnWidth(0, 32);
+	list->setColumnWidth(COL_ICON, 32);
 	
 	const int file_name_width = 50;
-	list->setColumnWidth(1, char_width*file_name_width);
+	list->setColumnWidth(COL_TITLE, char_width*file_name_width);
 	
 	// file size
-	list->setColumnWidth(2, 5*char_width);
+	list->setColumnWidth(COL_SIZE, 5*char_width);
 	
 	list->verticalHeader()->setHidden(true);
-	
-	//CPSPMovieLocalList file_list(src_dir);
-	int row = 0;
-	for(CPSPMovieLocalList::CPSPMovieListIt i = file_list->Begin(); i != file_list->End(); i++) {
-        CPSPMovie &m = i->second;
-
-        list->insertRow(row);
-
-        QTableWidgetItem *it = new XferListItem(&m);
-        //printf("New item = %p, name %s\n", it, (const char *)(m.Title().toUtf8()));
-        if ( !m.Icon().isNull() ) {
-	        it->setIcon(QPixmap::fromImage(m.Icon()));
-        }
-        list->setItem(row, 0, it);
-
-        list->setItem(row, 1, new QTableWidgetItem(m.Title()));
-        
-        row++;
-	}
 }
 
 XferDialog::XferDialog(const QString &psp_dir, QWidget *parent) : QDialog(parent)
@@ -61,6 +189,19 @@ XferDialog::XferDialog(const QString &psp_dir, QWidget *parent) : QDialog(parent
 	m_local_file_list = 0;
 	m_psp_file_list = 0;
 
+	m_local_model = new CPSPMovieListModel(this);
+	m_psp_model = new CPSPMovieListModel(this);
+	SetupListView(ui.localList, m_local_model);
+	SetupListView(ui.pspList, m_psp_model);
+
+	QDir dir(m_psp_dir);
+	m_local_watch = new CDirWatch(GetAppSettings()->TargetDir().path(), this);
+	m_psp_watch = new CDirWatch(dir.absoluteFilePath("mp_root/100mnv01"), this);
+	connect(m_local_watch, SIGNAL(fileChanged(const QString &)), this, SLOT(localFileChanged(const QString &)));
+	connect(m_psp_watch, SIGNAL(fileChanged(const QString &)), this, SLOT(pspFileChanged(const QString &)));
+	connect(m_local_watch, SIGNAL(dirLost()), this, SLOT(localDirLost()));
+	connect(m_psp_watch, SIGNAL(dirLost()), this, SLOT(pspDirLost()));
+
 	RefreshPSP();
 	RefreshLocal();
 }
@@ -73,67 +214,112 @@ XferDialog::~XferDialog()
 
 void XferDialog::RefreshPSP()
 {
-	if ( m_psp_file_list ) {
-		delete m_psp_file_list;
+	// watch before scan, so nothing is missed in between
+	if ( !m_psp_watch->IsActive() ) {
+		m_psp_watch->Watch();
 	}
+	CPSPMovieLocalList *old_list = m_psp_file_list;
 	QDir dir(m_psp_dir);
 	m_psp_file_list = new CPSPMovieLocalList(dir.absoluteFilePath("mp_root/100mnv01"));
-	FillListControl(m_psp_file_list, ui.pspList);
+	m_psp_model->SetList(m_psp_file_list);
+	delete old_list;
 }
 
 void XferDialog::RefreshLocal()
 {
-	if ( m_local_file_list ) {
-		delete m_local_file_list;
+	if ( !m_local_watch->IsActive() ) {
+		m_local_watch->Watch();
 	}
+	CPSPMovieLocalList *old_list = m_local_file_list;
 	m_local_file_list = new CPSPMovieLocalList(GetAppSettings()->TargetDir().path());
-	FillListControl(m_local_file_list, ui.localList);
+	m_local_model->SetList(m_local_file_list);
+	delete old_list;
+}
+
+void XferDialog::localFileChanged(const QString &file)
+{
+	QString name = CPSPMovieLocalList::MovieName(file);
+	if ( !name.isEmpty() ) {
+		m_local_model->UpdateMovie(m_local_file_list, name);
+	}
+}
+
+void XferDialog::pspFileChanged(const QString &file)
+{
+	QString name = CPSPMovieLocalList::MovieName(file);
+	if ( !name.isEmpty() ) {
+		m_psp_model->UpdateMovie(m_psp_file_list, name);
+	}
+}
+
+//
+// Directory itself was moved or removed. Rescan (and watch again) once
+// the new one is in place
+//
+void XferDialog::localDirLost()
+{
+	QTimer::singleShot(REWATCH_DELAY, this, SLOT(RefreshLocal()));
+}
+
+void XferDialog::pspDirLost()
+{
+	QTimer::singleShot(REWATCH_DELAY, this, SLOT(RefreshPSP()));
 }
 
 void XferDialog::on_topspButton_clicked()
 {
-	for(int j = 0; j < ui.localList->rowCount();j++) {
-		if ( ui.localList->isItemSelected(ui.localList->item(j, 1)) ) {
-			XferListItem *it = (XferListItem *)ui.localList->item(j, 0);
-			printf("\tSelected Item at %d = %p  type %d\n",	j, it, it->type());
-			printf("zhopaPSP [%s]\n", (const char *)it->m_data->Name().toUtf8());
-			m_local_file_list->TransferPSP(this, it->m_data->Id(), m_psp_dir);
-		}
+	// progress dialog runs event loop, so rows may change while copying
+	std::vector<int> ids;
+	QModelIndexList rows = ui.localList->selectionModel()->selectedRows();
+	for(QModelIndexList::iterator i = rows.begin(); i != rows.end(); i++) {
+		CPSPMovie *m = m_local_model->Movie(i->row());
+		printf("\tSelected Item at %d = %p\n", i->row(), m);
+		printf("zhopaPSP [%s]\n", (const char *)m->Name().toUtf8());
+		ids.push_back(m->Id());
+	}
+	// one directory listing for the whole batch
+	CM4VIndexAllocator idx_alloc;
+	for(size_t i = 0; i < ids.size(); i++) {
+		m_local_file_list->TransferPSP(this, ids[i], m_psp_dir, idx_alloc);
+	}
+	if ( !m_psp_watch->IsActive() ) {
+		RefreshPSP();
 	}
-	RefreshPSP();
 }
 
 void XferDialog::on_topcButton_clicked()
 {
-	QList<QTableWidgetItem *> selitems = ui.pspList->selectedItems();
-	if ( !selitems.empty() ) {
-		for(QList<QTableWidgetItem *>::iterator i = selitems.begin(); i != selitems.end(); i++) {
-			if ( (*i)->type() == (QTableWidgetItem::UserType+1) ) {
-				XferListItem *it = (XferListItem *)(*i);
-				printf("zhopaPC [%s]\n", (const char *)it->m_data->Name().toUtf8());
-				//m_psp_file_list->Transfer(this, it->m_data->Id(), GetAppSettings()->TargetDir().path());
-			}
-		}
+	QModelIndexList rows = ui.pspList->selectionModel()->selectedRows();
+	for(QModelIndexList::iterator i = rows.begin(); i != rows.end(); i++) {
+		CPSPMovie *m = m_psp_model->Movie(i->row());
+		printf("zhopaPC [%s]\n", (const char *)m->Name().toUtf8());
+		//m_psp_file_list->Transfer(this, m->Id(), GetAppSettings()->TargetDir().path());
+	}
+	if ( !m_local_watch->IsActive() ) {
+		RefreshLocal();
 	}
-	RefreshLocal();
 }
 
-void DeleteFromList(QTableWidget *list)
+static void DeleteFromList(QTableView *list, CPSPMovieListModel *model)
 {
-	QList<QTableWidgetItem *> selitems = list->selectedItems();
-	if ( !selitems.empty() ) {
-		for(QList<QTableWidgetItem *>::iterator i = selitems.begin(); i != selitems.end(); i++) {
-			if ( (*i)->type() == (QTableWidgetItem::UserType+1) ) {
-				XferListItem *it = (XferListItem *)(*i);
-				printf("zhopa [%s]\n", (const char *)it->m_data->Name().toUtf8());
-				it->m_data->Delete();
-			}
-		}
+	QModelIndexList rows = list->selectionModel()->selectedRows();
+	for(QModelIndexList::iterator i = rows.begin(); i != rows.end(); i++) {
+		CPSPMovie *m = model->Movie(i->row());
+		printf("zhopa [%s]\n", (const char *)m->Name().toUtf8());
+		m->Delete();
 	}
 }
 
 void XferDialog::on_deleteButton_clicked()
 {
-	DeleteFromList(ui.pspList);
-	DeleteFromList(ui.localList);
+	DeleteFromList(ui.pspList, m_psp_model);
+	DeleteFromList(ui.localList, m_local_model);
+
+	// without watch deleted rows are removed by rescan
+	if ( !m_psp_watch->IsActive() ) {
+		RefreshPSP();
+	}
+	if ( !m_local_watch->IsActive() ) {
+		RefreshLocal();
+	}
 }
@@ -1,9 +1,48 @@
 #ifndef XFERWIN_FORM_H
 #define XFERWIN_FORM_H
 
+#include <QAbstractTableModel>
+#include <QPixmap>
+#include <QMap>
+
+#include <vector>
+
 #include "ui_xferwin.h"
 
+class CPSPMovie;
 class CPSPMovieLocalList;
+class CDirWatch;
+
+//
+// Rows of CPSPMovieLocalList for transfer lists. Pixmaps are made only
+// for rows the view asks for, so big library opens at once. New list is
+// applied as row inserts and removes against the current one.
+//
+class CPSPMovieListModel : public QAbstractTableModel {
+		Q_OBJECT
+		// movies in row order, owned by list
+		std::vector<CPSPMovie *> m_rows;
+
+		// icons of rows that were shown, by movie name
+		mutable QMap<QString, QPixmap> m_pixmaps;
+	public:
+		CPSPMovieListModel(QObject *parent = 0);
+
+		// old list must still exist during the call
+		void SetList(CPSPMovieLocalList *list);
+
+		// files of one movie changed: list re-reads just that movie.
+		// Its row is updated in place, or added / removed when movie
+		// appeared or is gone
+		void UpdateMovie(CPSPMovieLocalList *list, const QString &movie_name);
+		CPSPMovie *Movie(int row) { return m_rows[row]; }
+
+		int rowCount(const QModelIndex &parent = QModelIndex()) const;
+		int columnCount(const QModelIndex &parent = QModelIndex()) const;
+		QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+		QVariant headerData(int section, Qt::Orientation orientation,
+			int role = Qt::DisplayRole) const;
+};
 
 class XferDialog : public QDialog {
 		Q_OBJECT
@@ -16,12 +55,22 @@ class XferDialog : public QDialog {
     	void on_topspButton_clicked();
     	void on_topcButton_clicked();
     	void on_deleteButton_clicked();
+
+		void localFileChanged(const QString &);
+		void pspFileChanged(const QString &);
+		void localDirLost();
+		void pspDirLost();
+
+		// full rescans, when there is no watch to tell what changed
+		void RefreshPSP();
+		void RefreshLocal();
 	private:
 		QString m_psp_dir;
 		Ui::XferDialog ui;
-		
-		void RefreshPSP();
-		void RefreshLocal();
+		CPSPMovieListModel *m_local_model, *m_psp_model;
+
+		// lists follow directory changes, no rescan after each operation
+		CDirWatch *m_local_watch, *m_psp_watch;
 };
 
 #endif
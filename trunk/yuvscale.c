@@ -0,0 +1,215 @@
+/*
+ * Fixed ratio YUV 4:2:0 downscaler
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "yuvscale.h"
+
+/* area filter never covers more than ratio + 1 source pixels */
+#define MAX_TAPS (YUV_SCALE_MAX_RATIO + 1)
+
+/* weights are 8 bit fixed point: 255 * 256 + 128 still fits in 16 bits */
+#define COEF_BITS 8
+#define COEF_ONE  (1 << COEF_BITS)
+
+typedef struct YuvScaleFilter {
+    int *pos;           /* first source pixel for each output pixel */
+    uint8_t *taps;      /* number of source pixels used */
+    uint16_t *coef;     /* MAX_TAPS weights per output pixel, sum is COEF_ONE */
+} YuvScaleFilter;
+
+typedef struct YuvScalePlane {
+    int src_w, src_h, dst_w, dst_h;
+    YuvScaleFilter h, v;
+} YuvScalePlane;
+
+struct YuvScaleContext {
+    YuvScalePlane plane[3];
+    uint8_t *tmp;       /* vertically filtered source row */
+};
+
+static int filter_init(YuvScaleFilter *f, int src, int dst)
+{
+    int i, k;
+
+    f->pos = malloc(dst * sizeof(int));
+    f->taps = malloc(dst);
+    f->coef = malloc(dst * MAX_TAPS * sizeof(uint16_t));
+    if (!f->pos || !f->taps || !f->coef)
+        return -1;
+
+    /* output pixel i covers [i*src, (i+1)*src) and source pixel j
+       covers [j*dst, (j+1)*dst), both in 1/dst source pixel units */
+    for (i = 0; i < dst; i++) {
+        int start = i * src, end = start + src;
+        int first = start / dst, last = (end - 1) / dst;
+        uint16_t *c = f->coef + i * MAX_TAPS;
+        int sum = 0, big = 0;
+
+        f->pos[i] = first;
+        f->taps[i] = last - first + 1;
+        for (k = 0; k < f->taps[i]; k++) {
+            int lo = (first + k) * dst, hi = lo + dst;
+            if (lo < start)
+                lo = start;
+            if (hi > end)
+                hi = end;
+            c[k] = ((hi - lo) * COEF_ONE + src / 2) / src;
+            sum += c[k];
+            if (c[k] > c[big])
+                big = k;
+        }
+        /* rounding error goes to the heaviest tap */
+        c[big] += COEF_ONE - sum;
+    }
+    return 0;
+}
+
+static void filter_free(YuvScaleFilter *f)
+{
+    free(f->pos);
+    free(f->taps);
+    free(f->coef);
+}
+
+static void vscale_row(uint8_t *dst, const uint8_t **rows, const uint16_t *coef, int taps, int w)
+{
+    int x = 0, k;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(COEF_ONE / 2);
+
+    for (; x + 16 <= w; x += 16) {
+        __m128i lo = round, hi = round;
+        for (k = 0; k < taps; k++) {
+            __m128i c = _mm_set1_epi16(coef[k]);
+            __m128i s = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), c));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), c));
+        }
+        lo = _mm_srli_epi16(lo, COEF_BITS);
+        hi = _mm_srli_epi16(hi, COEF_BITS);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; x < w; x++) {
+        int sum = COEF_ONE / 2;
+        for (k = 0; k < taps; k++)
+            sum += rows[k][x] * coef[k];
+        dst[x] = sum >> COEF_BITS;
+    }
+}
+
+static void hscale_row(uint8_t *dst, const uint8_t *src, const YuvScaleFilter *f, int w)
+{
+    const uint16_t *coef = f->coef;
+    int x, k;
+
+    for (x = 0; x < w; x++, coef += MAX_TAPS) {
+        const uint8_t *s = src + f->pos[x];
+        int sum = COEF_ONE / 2;
+        for (k = 0; k < f->taps[x]; k++)
+            sum += s[k] * coef[k];
+        dst[x] = sum >> COEF_BITS;
+    }
+}
+
+static int plane_supported(int src, int dst)
+{
+    return dst > 0 && dst <= src && src <= dst * YUV_SCALE_MAX_RATIO;
+}
+
+YuvScaleContext *yuv_scale_init(int src_w, int src_h, int dst_w, int dst_h)
+{
+    YuvScaleContext *c;
+    int i;
+
+    if (!plane_supported(src_w, dst_w) || !plane_supported(src_h, dst_h) ||
+        !plane_supported((src_w + 1) >> 1, (dst_w + 1) >> 1) ||
+        !plane_supported((src_h + 1) >> 1, (dst_h + 1) >> 1))
+        return NULL;
+
+    c = calloc(1, sizeof(YuvScaleContext));
+    if (!c)
+        return NULL;
+    for (i = 0; i < 3; i++) {
+        YuvScalePlane *p = &c->plane[i];
+        int shift = i ? 1 : 0;
+
+        p->src_w = (src_w + shift) >> shift;
+        p->src_h = (src_h + shift) >> shift;
+        p->dst_w = (dst_w + shift) >> shift;
+        p->dst_h = (dst_h + shift) >> shift;
+        if (filter_init(&p->h, p->src_w, p->dst_w) < 0 ||
+            filter_init(&p->v, p->src_h, p->dst_h) < 0) {
+            yuv_scale_free(c);
+            return NULL;
+        }
+    }
+    c->tmp = malloc(src_w);
+    if (!c->tmp) {
+        yuv_scale_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void yuv_scale_free(YuvScaleContext *c)
+{
+    int i;
+
+    if (!c)
+        return;
+    for (i = 0; i < 3; i++) {
+        filter_free(&c->plane[i].h);
+        filter_free(&c->plane[i].v);
+    }
+    free(c->tmp);
+    free(c);
+}
+
+void yuv_scale(YuvScaleContext *c, uint8_t *src[], int src_stride[],
+               uint8_t *dst[], int dst_stride[])
+{
+    int i, y, k;
+
+    for (i = 0; i < 3; i++) {
+        const YuvScalePlane *p = &c->plane[i];
+        const uint16_t *coef = p->v.coef;
+
+        for (y = 0; y < p->dst_h; y++, coef += MAX_TAPS) {
+            const uint8_t *rows[MAX_TAPS];
+            const uint8_t *line;
+
+            for (k = 0; k < p->v.taps[y]; k++)
+                rows[k] = src[i] + (p->v.pos[y] + k) * src_stride[i];
+            if (p->v.taps[y] == 1) {
+                line = rows[0];
+            } else {
+                vscale_row(c->tmp, rows, coef, p->v.taps[y], p->src_w);
+                line = c->tmp;
+            }
+            hscale_row(dst[i] + y * dst_stride[i], line, &p->h, p->dst_w);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA
+//
+#ifndef YUVSCALE_H_
+#define YUVSCALE_H_
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Downscaler for planar YUV 4:2:0 to the small PSP frame. Area filter
+// with tables built once per job, vertical pass uses SSE2 when the
+// compiler has it. Covers downscale by up to YUV_SCALE_MAX_RATIO on each
+// axis, which is every common input (720x480, 720x576, 640x480, 1280x720).
+//
+#define YUV_SCALE_MAX_RATIO 4
+
+typedef struct YuvScaleContext YuvScaleContext;
+
+//
+// Returns 0 if sizes are not supported, caller falls back to swscale
+//
+YuvScaleContext *yuv_scale_init(int src_w, int src_h, int dst_w, int dst_h);
+void yuv_scale_free(YuvScaleContext *c);
+
+void yuv_scale(YuvScaleContext *c, uint8_t *src[], int src_stride[],
+		uint8_t *dst[], int dst_stride[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*YUVSCALE_H_*/